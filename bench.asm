@@ -0,0 +1,27 @@
+
+start:
+	MOVE R6 0
+	MOVE R7 0
+
+read:
+	MOVE R2 0
+	MOVE R3 64
+	INTERUPT #14
+	COMPARE R0 0
+	GOTO_IF_EQUAL done
+
+	ADD R7 R7 R0
+	MOVE R4 0
+	sum:
+		MOVE R5 [R4]
+		ADD R6 R6 R5
+		ADD R4 R4 1
+		COMPARE R4 R0
+		GOTO_IF_LESS_THAN sum
+	GOTO read
+
+done:
+	MOVE R0 R7
+	INTERUPT #0
+	MOVE R0 R6
+	INTERUPT #0
@@ -0,0 +1,11 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include "program.h"
+
+// Translates linked code to C, a block per instruction, which builds
+// against the VM's runtime into a program of its own. Returns 0 if it
+// can't be, as parallel loops and other VMs only run in the VM
+int aot_write(const char *path, const struct Options *options, const struct Program *program);
+
+#endif // AOT_H
@@ -7,6 +7,39 @@
 #define CONST_FLOAT	2
 #define CONST_STRING 	3
 
+// Registers, R0-R252 followed by the named registers, so every one
+// fits in a byte
+#define REGISTER_COUNT	253
+#define REGISTER_PC	(REGISTER_COUNT + 0)
+#define REGISTER_SP	(REGISTER_COUNT + 1)
+#define REGISTER_FP	(REGISTER_COUNT + 2)
+#define REGISTER_TOTAL	(REGISTER_COUNT + 3)
+
+// Interupts, channel ones take the channel in R1
+#define INT_PRINT 	0
+#define INT_SEND	1	// Send R0
+#define INT_RECV	2	// Receive into R0, null once closed
+#define INT_SEND_BATCH	3	// Send R3 values from memory at R2
+#define INT_RECV_BATCH	4	// Receive up to R3 values to memory at R2
+#define INT_CLOSE	5
+#define INT_MAP_READ	6	// Map the file named R1, R0 is its address, R3 its size
+#define INT_MAP_WRITE	7
+#define INT_UNMAP	8	// Unmap the file at R1
+#define INT_ALLOC	9	// Allocate R3 elements of type R2, R0 is the region
+#define INT_FREE	10	// Free the region or map at R1
+#define INT_READ_INT	11	// Read R0 from the input, R3 is 0 at its end
+#define INT_READ_FLOAT	12
+#define INT_READ_LINE	13
+#define INT_READ_BATCH	14	// Read up to R3 ints to memory at R2
+#define INT_COUNT	15
+
+// Types of the elements of typed regions
+#define ELEMENT_INT8	0
+#define ELEMENT_INT32	1
+#define ELEMENT_INT64	2
+#define ELEMENT_FLOAT32	3
+#define ELEMENT_FLOAT64	4
+
 // Argument codes:
 // 	R - Register
 // 	A - Address
@@ -14,52 +47,103 @@
 // 	I - Indirect
 // 		P - Plus constant
 // 		S - Sub constant
+// 	P - Pair of registers, packed into one byte
+// 	O - Offset from the next instruction, 8 or 16 bit
 
 #define BYTECODE(GEN) \
-	GEN(BC_HULT), \
-	GEN(BC_INT_A), \
-	GEN(BC_MOV_RR), \
-	GEN(BC_MOV_RC), \
+	GEN(HULT), \
+	GEN(INT_A), \
+	GEN(MOV_RR), \
+	GEN(MOV_P), \
+	GEN(MOV_RC), \
+	 \
+	GEN(MOV_AR), \
+	GEN(MOV_AC), \
+	GEN(MOV_IR), \
+	GEN(MOV_IPR), \
+	GEN(MOV_ISR), \
+	GEN(MOV_IC), \
+	GEN(MOV_IPC), \
+	GEN(MOV_ISC), \
+	 \
+	GEN(MOV_RA), \
+	GEN(MOV_RI), \
+	GEN(MOV_RIP), \
+	GEN(MOV_RIS), \
+	 \
+	GEN(CMP_RR), \
+	GEN(CMP_P), \
+	GEN(CMP_RC), \
+	 \
+	GEN(ADD_RRR), \
+	GEN(ADD_PR), \
+	GEN(ADD_RRC), \
+	GEN(SUB_RRR), \
+	GEN(SUB_PR), \
+	GEN(SUB_RRC), \
+	GEN(MUL_RRR), \
+	GEN(MUL_PR), \
+	GEN(MUL_RRC), \
+	GEN(DIV_RRR), \
+	GEN(DIV_PR), \
+	GEN(DIV_RRC), \
 	 \
-	GEN(BC_MOV_AR), \
-	GEN(BC_MOV_AC), \
-	GEN(BC_MOV_IR), \
-	GEN(BC_MOV_IPR), \
-	GEN(BC_MOV_ISR), \
-	GEN(BC_MOV_IC), \
-	GEN(BC_MOV_IPC), \
-	GEN(BC_MOV_ISC), \
+	GEN(PUSH_R), \
+	GEN(PUSH_C), \
+	GEN(POP_R), \
+	GEN(CALL_A), \
+	GEN(CALL_O8), \
+	GEN(CALL_O16), \
+	GEN(RET), \
+	GEN(ENTER_A), \
+	GEN(LEAVE), \
 	 \
-	GEN(BC_MOV_RA), \
-	GEN(BC_MOV_RI), \
-	GEN(BC_MOV_RIP), \
-	GEN(BC_MOV_RIS), \
+	GEN(B_A), \
+	GEN(BEQ_A), \
+	GEN(BNE_A), \
+	GEN(BGT_A), \
+	GEN(BLT_A), \
+	GEN(B_O8), \
+	GEN(BEQ_O8), \
+	GEN(BNE_O8), \
+	GEN(BGT_O8), \
+	GEN(BLT_O8), \
+	GEN(B_O16), \
+	GEN(BEQ_O16), \
+	GEN(BNE_O16), \
+	GEN(BGT_O16), \
+	GEN(BLT_O16), \
 	 \
-	GEN(BC_CMP_RR), \
-	GEN(BC_CMP_RC), \
+	GEN(PFOR_A), \
+	GEN(PSUM_A), \
+	GEN(PMIN_A), \
+	GEN(PMAX_A), \
 	 \
-	GEN(BC_ADD_RRR), \
-	GEN(BC_ADD_RRC), \
-	GEN(BC_SUB_RRR), \
-	GEN(BC_SUB_RRC), \
+	GEN(XADD_RIR), \
+	GEN(CAS_RIR), \
+	GEN(XCHG_RI), \
+	GEN(LDA_RI), \
+	GEN(STL_IR), \
 	 \
-	GEN(BC_PUSH_R), \
-	GEN(BC_PUSH_C), \
-	GEN(BC_POP_R), \
-	GEN(BC_CALL_A), \
-	GEN(BC_RET), \
+	GEN(LDB_RIR), \
+	GEN(STB_IRR), \
+	GEN(LDE_RIR), \
+	GEN(STE_IRR), \
 	 \
-	GEN(BC_B_A), \
-	GEN(BC_BEQ_A), \
-	GEN(BC_BNE_A), \
-	GEN(BC_BGT_A), \
-	GEN(BC_BLT_A), \
+	GEN(MAP_NEW_R), \
+	GEN(MAP_GET_RIR), \
+	GEN(MAP_SET_IRR), \
+	GEN(MAP_DEL_IR), \
+	GEN(MAP_NEXT_RIR), \
 	 \
-	GEN(BC_SET_LABEL), \
-	GEN(BC_GET_LABEL)
+	GEN(SET_LABEL), \
+	GEN(GET_LABEL)
 
+// The operands of each instruction, in the order they're encoded
+#define ARGS_HULT(GEN)
 #define ARGS_INT_A(GEN)		GEN(ADDR)
 #define ARGS_MOV_RR(GEN)	GEN(REG) GEN(REG)
+#define ARGS_MOV_P(GEN)		GEN(PAIR)
 #define ARGS_MOV_RC(GEN)	GEN(REG) GEN(CONST)
 
 #define ARGS_MOV_AR(GEN)	GEN(ADDR) GEN(REG)
@@ -71,32 +155,93 @@
 #define ARGS_MOV_IPC(GEN)	GEN(INDIRECT_PLUS) GEN(CONST)
 #define ARGS_MOV_ISC(GEN)	GEN(INDIRECT_SUB) GEN(CONST)
 
-#define ARGS_MOV_RA(GEN)	GEN(ADDR) GEN(REG)
+#define ARGS_MOV_RA(GEN)	GEN(REG) GEN(ADDR)
 #define ARGS_MOV_RI(GEN)	GEN(REG) GEN(INDIRECT)
 #define ARGS_MOV_RIP(GEN)	GEN(REG) GEN(INDIRECT_PLUS)
 #define ARGS_MOV_RIS(GEN)	GEN(REG) GEN(INDIRECT_SUB)
 
 #define ARGS_CMP_RR(GEN)	GEN(REG) GEN(REG)
+#define ARGS_CMP_P(GEN)		GEN(PAIR)
 #define ARGS_CMP_RC(GEN)	GEN(REG) GEN(CONST)
 
 #define ARGS_ADD_RRR(GEN)	GEN(REG) GEN(REG) GEN(REG)
+#define ARGS_ADD_PR(GEN)	GEN(PAIR) GEN(REG)
 #define ARGS_ADD_RRC(GEN)	GEN(REG) GEN(REG) GEN(CONST)
 #define ARGS_SUB_RRR(GEN)	GEN(REG) GEN(REG) GEN(REG)
+#define ARGS_SUB_PR(GEN)	GEN(PAIR) GEN(REG)
 #define ARGS_SUB_RRC(GEN)	GEN(REG) GEN(REG) GEN(CONST)
+#define ARGS_MUL_RRR(GEN)	GEN(REG) GEN(REG) GEN(REG)
+#define ARGS_MUL_PR(GEN)	GEN(PAIR) GEN(REG)
+#define ARGS_MUL_RRC(GEN)	GEN(REG) GEN(REG) GEN(CONST)
+#define ARGS_DIV_RRR(GEN)	GEN(REG) GEN(REG) GEN(REG)
+#define ARGS_DIV_PR(GEN)	GEN(PAIR) GEN(REG)
+#define ARGS_DIV_RRC(GEN)	GEN(REG) GEN(REG) GEN(CONST)
 
 #define ARGS_PUSH_R(GEN)	GEN(REG)
 #define ARGS_PUSH_C(GEN)	GEN(CONST)
 #define ARGS_POP_R(GEN)		GEN(REG)
 #define ARGS_CALL_A(GEN)	GEN(ADDR)
+#define ARGS_CALL_O8(GEN)	GEN(OFFSET8)
+#define ARGS_CALL_O16(GEN)	GEN(OFFSET16)
+#define ARGS_RET(GEN)
+#define ARGS_ENTER_A(GEN)	GEN(ADDR)
+#define ARGS_LEAVE(GEN)
 
 #define ARGS_B_A(GEN)		GEN(ADDR)
 #define ARGS_BEQ_A(GEN)		GEN(ADDR)
 #define ARGS_BNE_A(GEN)		GEN(ADDR)
 #define ARGS_BLT_A(GEN)		GEN(ADDR)
 #define ARGS_BGT_A(GEN)		GEN(ADDR)
+#define ARGS_B_O8(GEN)		GEN(OFFSET8)
+#define ARGS_BEQ_O8(GEN)	GEN(OFFSET8)
+#define ARGS_BNE_O8(GEN)	GEN(OFFSET8)
+#define ARGS_BLT_O8(GEN)	GEN(OFFSET8)
+#define ARGS_BGT_O8(GEN)	GEN(OFFSET8)
+#define ARGS_B_O16(GEN)		GEN(OFFSET16)
+#define ARGS_BEQ_O16(GEN)	GEN(OFFSET16)
+#define ARGS_BNE_O16(GEN)	GEN(OFFSET16)
+#define ARGS_BLT_O16(GEN)	GEN(OFFSET16)
+#define ARGS_BGT_O16(GEN)	GEN(OFFSET16)
+
+#define ARGS_PFOR_A(GEN)	GEN(ADDR) GEN(REG) GEN(REG)
+#define ARGS_PSUM_A(GEN)	GEN(ADDR) GEN(REG) GEN(REG)
+#define ARGS_PMIN_A(GEN)	GEN(ADDR) GEN(REG) GEN(REG)
+#define ARGS_PMAX_A(GEN)	GEN(ADDR) GEN(REG) GEN(REG)
+
+#define ARGS_XADD_RIR(GEN)	GEN(REG) GEN(INDIRECT) GEN(REG)
+#define ARGS_CAS_RIR(GEN)	GEN(REG) GEN(INDIRECT) GEN(REG)
+#define ARGS_XCHG_RI(GEN)	GEN(REG) GEN(INDIRECT)
+#define ARGS_LDA_RI(GEN)	GEN(REG) GEN(INDIRECT)
+#define ARGS_STL_IR(GEN)	GEN(INDIRECT) GEN(REG)
+
+#define ARGS_LDB_RIR(GEN)	GEN(REG) GEN(INDIRECT) GEN(REG)
+#define ARGS_STB_IRR(GEN)	GEN(INDIRECT) GEN(REG) GEN(REG)
+#define ARGS_LDE_RIR(GEN)	GEN(REG) GEN(INDIRECT) GEN(REG)
+#define ARGS_STE_IRR(GEN)	GEN(INDIRECT) GEN(REG) GEN(REG)
+
+#define ARGS_MAP_NEW_R(GEN)	GEN(REG)
+#define ARGS_MAP_GET_RIR(GEN)	GEN(REG) GEN(INDIRECT) GEN(REG)
+#define ARGS_MAP_SET_IRR(GEN)	GEN(INDIRECT) GEN(REG) GEN(REG)
+#define ARGS_MAP_DEL_IR(GEN)	GEN(INDIRECT) GEN(REG)
+#define ARGS_MAP_NEXT_RIR(GEN)	GEN(REG) GEN(INDIRECT) GEN(REG)
+
+// Labels are only in unlinked code, each followed by its name
+#define ARGS_SET_LABEL(GEN)
+#define ARGS_GET_LABEL(GEN)
+
+// Bytes each operand takes in linked code
+#define SIZE_REG		1
+#define SIZE_PAIR		1
+#define SIZE_CONST		2
+#define SIZE_ADDR		4
+#define SIZE_INDIRECT		1
+#define SIZE_INDIRECT_PLUS	2
+#define SIZE_INDIRECT_SUB	2
+#define SIZE_OFFSET8		1
+#define SIZE_OFFSET16		2
 
-#define GEN_ENUM(name) 		name
-#define GEN_STRING(name) 	#name
+#define GEN_ENUM(name) 		BC_##name
+#define GEN_STRING(name) 	"BC_" #name
 
 enum Bytecode { BYTECODE(GEN_ENUM) };
 static const char *bytecode_names[] = { BYTECODE(GEN_STRING) };
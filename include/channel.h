@@ -0,0 +1,29 @@
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include "register.h"
+
+// Single sender and receiver channels skip the atomic exchanges
+// shared ones need
+#define CHANNEL_SPSC	0
+#define CHANNEL_MPMC	1
+
+// Creates a bounded channel of registers between VMs, returns its id, 
+// or -1 if the capacity isn't positive. Channels are created by the 
+// host before any VM runs
+int channel_create(int capacity, int type);
+
+// Sends 'count' values, waiting for space, returns how many were sent 
+// before the channel was closed
+int channel_send(int id, const Register *values, int count);
+
+// Receives up to 'max_count' values, waiting for at least one, 
+// returns how many, or 0 once the channel is closed and empty, or 
+// straight away if 'max_count' is 0
+int channel_recv(int id, Register *values, int max_count);
+
+void channel_close(int id);
+void channel_free_all();
+
+#endif // CHANNEL_H
@@ -0,0 +1,57 @@
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "bytecode.h"
+#include "register.h"
+#include <stdio.h>
+
+// Operand types of linked code, one for each in the ARGS_ tables
+#define OPERAND_NONE		0
+#define OPERAND_REG		1
+#define OPERAND_PAIR		2
+#define OPERAND_CONST		3
+#define OPERAND_ADDR		4
+#define OPERAND_INDIRECT	5
+#define OPERAND_INDIRECT_PLUS	6
+#define OPERAND_INDIRECT_SUB	7
+#define OPERAND_OFFSET8		8
+#define OPERAND_OFFSET16	9
+
+#define OPERAND_MAX		4
+
+// The length and operands of every instruction, generated from the
+// ARGS_ tables, so linked code can be stepped through without decoding
+extern const unsigned char bytecode_lengths[];
+extern const char bytecode_operands[][OPERAND_MAX];
+extern const char operand_sizes[];
+
+// A register, constant index, address, or where an offset goes to.
+// Pairs decode to two registers, and indirect operands keep their
+// register and offset
+struct Operand
+{
+	char type;
+	int value, offset;
+};
+
+struct Decoded
+{
+	char bytecode;
+	int start, end;
+	int operand_count;
+	struct Operand operands[OPERAND_MAX];
+};
+
+// Decodes the linked instruction at 'p', returning 0 if it's not one
+// or it runs past 'len'
+int codec_decode(const char *code, int len, int p, struct Decoded *inst);
+
+// Encodes an instruction to 'out', with offsets from where it starts,
+// returning its length
+int codec_encode(const struct Decoded *inst, char *out);
+
+// Writes the instruction out as text, with the values of its constants
+void codec_print(FILE *out, const struct Decoded *inst, const Register *constants);
+
+#endif // CODEC_H
@@ -0,0 +1,8 @@
+
+#ifndef COMPILER_H
+#define COMPILER_H
+
+// Compiles a NEWBASIC source file into assembly, returns the text
+char *compiler_compile(const char *file_path);
+
+#endif // COMPILER_H
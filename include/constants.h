@@ -0,0 +1,27 @@
+
+#ifndef CONSTANTS_H
+#define CONSTANTS_H
+
+#include "register.h"
+
+// Linked code refers to its constants by index into a pool, built as
+// it's linked with each constant kept once. Constants are encoded as
+// their type then their value, strings as their length, their bytes
+// and a terminator
+#define CONSTANT_MAX	65536
+
+void constants_init();
+int constants_add(const char *encoded);
+int constants_add_int(int value);
+
+// The encoded constant at an index, until the next is added
+const char *constants_find(int index);
+const char *constants_pool(int *len);
+int constants_len(const char *encoded);
+void constants_close();
+
+// Decodes a pool into values once, as it's loaded. Strings point into
+// the pool, so it has to outlive them. Returns NULL if it's malformed
+Register *constants_load(const char *pool, int len, int *count);
+
+#endif // CONSTANTS_H
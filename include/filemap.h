@@ -0,0 +1,35 @@
+#ifndef FILEMAP_H
+#define FILEMAP_H
+
+#include <stddef.h>
+
+// Mapped files are bytes, each at its own guest address from 
+// FILEMAP_BASE, and are read by offset from there
+#define FILEMAP_BASE	0x50000000
+#define FILEMAP_MAX	64
+
+struct FileMap
+{
+	unsigned char *bytes;
+	unsigned size;
+	int is_writable;
+	int is_used;
+};
+
+extern struct FileMap filemap_table[FILEMAP_MAX];
+
+// Maps a file, returns its guest address or -1 and sets 'size'
+int filemap_open(const char *path, int is_writable, int *size);
+void filemap_unmap(int addr);
+void filemap_close();
+
+// The mapping at a guest address, NULL if it's not one. Unused ones 
+// are empty, so every offset into them is out of range. Inlined, as 
+// it's called for every byte read
+static inline struct FileMap *filemap_find(int addr)
+{
+	unsigned slot = (unsigned)addr - FILEMAP_BASE;
+	return slot < FILEMAP_MAX ? &filemap_table[slot] : NULL;
+}
+
+#endif // FILEMAP_H
@@ -0,0 +1,30 @@
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#define IMAGE_MAGIC 	"NBIM"
+#define IMAGE_VERSION 	6
+
+// Linked program, as 'header code constants symbols'. Constants are
+// the pool the code refers to, symbols are each an address followed
+// by a name, and the checksum covers everything after the header
+struct ImageHeader
+{
+	char magic[4];
+	int version;
+	int entry;
+	int code_offset, code_len;
+	int constant_offset, constant_len;
+	int symbol_offset, symbol_len, symbol_count;
+	unsigned int checksum;
+};
+
+int image_write(const char *path, const char *code, int len, 
+	const char *constants, int constant_len, int entry, 
+	const char *symbols, int symbol_len, int symbol_count);
+const char *image_map(const char *path, int *len, 
+	const char **constants, int *constant_len, int *entry);
+const char *image_find_symbol(int addr, int *offset);
+void image_close();
+
+#endif // IMAGE_H
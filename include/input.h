@@ -0,0 +1,27 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include "register.h"
+
+// Input is read from stdin, or the file opened with input_open, through
+// one large buffer. VMs share it, each read taking the next values
+#define INPUT_BUFFER	(1 << 20)
+
+// Returns 0 if the file can't be read
+int input_open(const char *path);
+void input_close();
+
+// Each returns 0 at the end of the input. Numbers are found by skipping
+// anything that can't start one, and end at the first character that
+// can't be part of one
+int input_read_int(int *value);
+int input_read_float(float *value);
+
+// Reads up to 'count' ints, returning how many were read
+int input_read_ints(Register *out, int count);
+
+// Returns the rest of the line, without its line break, or NULL at the
+// end of the input. Lines are kept until the input is closed
+char *input_read_line();
+
+#endif // INPUT_H
@@ -3,8 +3,13 @@
 
 void linker_init();
 void linker_add_code(const char *code, int len);
+void linker_export(const char *name);
+void linker_use_profile(const char *path);
 char *linker_link(int *len);
+int linker_is_relocatable();
 int linker_find_addr(const char *name);
+char *linker_symbols(int *len, int *count);
+void linker_write_profile(const char *path, const int *counts, const int *taken);
 void linker_close();
 
 #endif // LINKER_H
@@ -0,0 +1,56 @@
+#ifndef MAP_H
+#define MAP_H
+
+#include "register.h"
+#include <stddef.h>
+
+// Hash maps from registers to registers, each at its own guest address
+// from MAP_BASE. Keys can be ints, floats or strings, strings are kept
+// by pointer, as they live in the constant pool or are lines read from
+// the input, which are kept until input_close, after map_close
+#define MAP_BASE	0x70000000
+#define MAP_MAX		256
+
+// Slots are probed a group at a time, each with a control byte holding
+// 7 bits of its key's hash, or whether it's empty or deleted
+#define MAP_GROUP	16
+
+struct Entry
+{
+	Register key, value;
+};
+
+struct Map
+{
+	signed char *control;
+	struct Entry *entries;
+	unsigned capacity, count, used;
+	int is_used;
+};
+
+extern struct Map map_table[MAP_MAX];
+
+// Returns the map's guest address, or -1
+int map_create();
+void map_free(int addr);
+void map_close();
+
+// Lookups on anything that isn't a map, or with a null key, find
+// nothing, and changes to them are dropped
+Register map_get(int addr, Register key);
+void map_set(int addr, Register key, Register value);
+void map_delete(int addr, Register key);
+
+// Returns the key of the first entry in a slot at or after 'cursor',
+// moving it past that slot. Once there are none, it's null and the
+// cursor is -1
+Register map_next(int addr, int *cursor);
+
+// The map at a guest address, NULL if it's not one
+static inline struct Map *map_find(int addr)
+{
+	unsigned slot = (unsigned)addr - MAP_BASE;
+	return slot < MAP_MAX && map_table[slot].is_used ? &map_table[slot] : NULL;
+}
+
+#endif // MAP_H
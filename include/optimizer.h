@@ -0,0 +1,13 @@
+
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+// Optimizes linked code, returning the new code or NULL if it can't
+// be. Entry points are updated to where they've moved
+char *optimizer_run(const char *code, int len, int *entries, int entry_count, int *out_len);
+
+// Where an address in the original code has moved to, -1 if removed
+int optimizer_find_addr(int addr);
+void optimizer_close();
+
+#endif // OPTIMIZER_H
@@ -0,0 +1,15 @@
+
+#ifndef POOL_H
+#define POOL_H
+
+// Runs 'task' once on each thread of the pool, passing the index of 
+// the thread, and returns 1 when they've all finished. The pool runs 
+// one task at a time, if it's busy with another this returns 0 rather
+// than waiting, as that task could be waiting on the caller
+int pool_run(void (*task)(int worker, void *data), void *data);
+
+// Number of threads, starting the pool if it's not already
+int pool_size();
+void pool_close();
+
+#endif // POOL_H
@@ -0,0 +1,56 @@
+
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+// What a command line asks for, the flags are listed in program.c
+struct Options
+{
+	const char **files;
+	const char **exports;
+	const char **spawns;
+	int *channel_sizes;
+	int *channel_types;
+	int *segment_sizes;
+	int file_count, export_count, spawn_count;
+	int channel_count, segment_count;
+	int is_optimized;
+	int budget;
+	const char *profile_in;
+	const char *profile_out;
+	const char *image_out;
+	const char *aot_out;
+	const char *listing_out;
+	const char *input_path;
+};
+
+// Linked, and maybe optimized, code ready to run
+struct Program
+{
+	const char *code;
+	int len;
+	char *constants;
+	int constants_len;
+	int main_addr;
+	int *spawn_addrs;
+	int spawn_count;
+	char *optimized;
+};
+
+void program_parse(struct Options *options, int argc, char *argv[]);
+void program_free_options(struct Options *options);
+
+// Returns if the options ask for the code to be written out, as an
+// image, translated to C or listed, rather than run
+int program_writes_out(const struct Options *options);
+
+// Assembles, links and optimizes, then writes the image, C and listing
+// if asked to. Returns 0 if any was asked for but couldn't be written. The
+// linker stays open, for profiling, until the program is closed
+int program_build(const struct Options *options, struct Program *program);
+
+// Runs the program with the channels and segments it asks for,
+// returns 1 if it was stopped for going over its budget
+int program_run(const struct Options *options, const struct Program *program);
+void program_close(struct Program *program);
+
+#endif // PROGRAM_H
@@ -0,0 +1,35 @@
+#ifndef REGION_H
+#define REGION_H
+
+#include <stddef.h>
+
+// Typed regions are packed arrays, each at its own guest address
+// from REGION_BASE, and are read and written by element index
+#define REGION_BASE	0x60000000
+#define REGION_MAX	256
+
+struct Region
+{
+	void *data;
+	unsigned count;
+	int type;
+	int is_used;
+};
+
+extern struct Region region_table[REGION_MAX];
+
+// Allocates 'count' zeroed elements of an ELEMENT_ type, returns the
+// region's guest address or -1
+int region_create(int type, int count);
+void region_free(int addr);
+void region_close();
+
+// The region at a guest address, NULL if it's not one. Unused ones
+// are empty, so every index into them is out of range
+static inline struct Region *region_find(int addr)
+{
+	unsigned slot = (unsigned)addr - REGION_BASE;
+	return slot < REGION_MAX ? &region_table[slot] : NULL;
+}
+
+#endif // REGION_H
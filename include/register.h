@@ -0,0 +1,17 @@
+
+#ifndef REGISTER_H
+#define REGISTER_H
+
+// A value held in a register or memory
+typedef struct Register
+{
+	char type;
+	union
+	{
+		int i;
+		float f;
+		char *str;
+	};
+} Register;
+
+#endif // REGISTER_H
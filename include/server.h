@@ -0,0 +1,13 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+// Serves run requests on a Unix socket until asked to stop, keeping
+// the VM and its threads warm and linked programs cached
+int server_run(const char *socket_path);
+
+// Asks the server to run with the usual arguments, passing it this
+// process's directory and standard files. '--stats' prints the
+// server's statistics and '--stop' stops it. Returns its exit status
+int server_send(const char *socket_path, int argc, char *argv[]);
+
+#endif // SERVER_H
@@ -0,0 +1,21 @@
+#ifndef SHARED_H
+#define SHARED_H
+
+// Shared segments are ints mapped from a memfd, so other threads and
+// processes can map them too. Guest addresses from SHARED_BASE are in 
+// segment (addr - SHARED_BASE) >> SHARED_BITS
+#define SHARED_BASE	0x40000000
+#define SHARED_BITS	20
+#define SHARED_MAX	64
+
+// Creates a segment of 'size' ints, returns its guest address or -1
+int shared_create(int size);
+
+// The file a segment is mapped from, to map it elsewhere
+int shared_fd(int addr);
+
+// The int at a guest address, NULL if it's not in a segment
+int *shared_find(int addr);
+void shared_close();
+
+#endif // SHARED_H
@@ -2,6 +2,7 @@
 #define TOKENIZER_H
 
 void tokenizer_open(const char *file_path);
+int tokenizer_insert(const char *text);
 
 char tokenizer_next();
 void tokenizer_push_back(char c);
@@ -0,0 +1,14 @@
+
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+// Calls nest at most this deep, deeper ones abort
+#define FRAME_MAX	4096
+
+// Checks linked code is safe to run without checks, and only refers to
+// the constants in its pool. The memory it needs is written to
+// memory_size, or -1 if it can't be bounded
+int verifier_check(const char *code, int len, int constant_count,
+	int entry, int *memory_size);
+
+#endif // VERIFIER_H
@@ -1,10 +1,67 @@
 #ifndef VM_H
 #define VM_H
 
+#include "register.h"
+
 void vm_init();
+void vm_profile(int *counts, int *taken);
 void vm_load(int offset, const char *code, int len);
-void vm_run(int offset);
+void vm_map(const char *code, int len);
+
+// Loads the pool of constants the code refers to, which has to stay
+// where it is while the code runs. Returns 0 if it's malformed
+int vm_constants(const char *pool, int len);
+
+int vm_verify(int entry);
+
+// How a run ended
+#define VM_HALTED	0
+#define VM_SUSPENDED	1
+#define VM_ABORTED	2
+
+// What happens when the budget runs out
+#define VM_BUDGET_ABORT		0
+#define VM_BUDGET_SUSPEND	1
+#define VM_BUDGET_CALLBACK	2
+
+// Limits runs to 'limit' backward branches, calls and returns, 0 for
+// no limit. Spawned VMs and the threads of parallel loops each get
+// their own. Suspending returns from vm_run, to carry on with 
+// vm_resume on the same thread, but only yields the thread anywhere 
+// else. The callback, run on whichever thread ran out, returns how 
+// much more to allow, 0 to abort
+void vm_budget(int limit, int action, int (*callback)(void *data), void *data);
+int vm_run(int offset);
+int vm_resume();
+
+// Clears registers and memory, keeping the code and threads, so the
+// next program starts as if the VM were new
+void vm_reset();
+
+// Runs code from 'offset' on its own thread, with its own memory,
+// returns 0 if it can't be. Join waits for them all to halt
+int vm_spawn(int offset);
+void vm_join();
 void vm_close();
 
+// Flags set by compares
+#define FLAG_EQUAL 	0b100
+#define FLAG_LESS_THAN	0b010
+#define FLAG_MORE_THAN	0b001
+
+// What code translated to C ahead of time calls back into, for what 
+// it doesn't do inline. Interrupts work on R0-R3 of 'registers' and 
+// on the translated code's own memory. Compares return the flags as
+// they were if the values can't be compared, atomics get a NULL cell 
+// outside shared segments
+void vm_interrupt(int id, Register *registers, Register *memory, int memory_size);
+Register vm_operate(char bytecode, Register a, Register b);
+char vm_compare(char flags, Register a, Register b);
+int *vm_cell(int addr);
+int vm_load_byte(int file, unsigned offset);
+void vm_store_byte(int file, unsigned offset, int value);
+Register vm_load_element(int region, unsigned index);
+void vm_store_element(int region, unsigned index, Register value);
+
 #endif // VM_H
 
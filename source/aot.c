@@ -0,0 +1,556 @@
+#include "aot.h"
+#include "codec.h"
+#include "verifier.h"
+#include "constants.h"
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Memory for code whose use can't be known, as the VM gives it
+#define DEFAULT_MEMORY	100
+
+// A decoded instruction, always in its long form
+struct Inst
+{
+	char bytecode;
+	unsigned char regs[3];
+	int reg_count;
+	Register value;
+	int addr, offset;
+};
+
+// Registers are locals named after them, only those the code uses are
+// declared, along with R0-R3 that interrupts work on
+#define INTERRUPT_REGISTERS	4
+
+static char reg_names[REGISTER_TOTAL][8];
+static char is_reg_used[REGISTER_COUNT];
+
+// Code being translated, and the constants it refers to
+static const char *code;
+static int code_len;
+static Register *constants;
+static int constant_count;
+static FILE *out;
+
+// Where calls return to, each a case of the return switch
+static int *returns;
+static int return_count;
+
+// Addresses jumped to, the only ones that need a label
+static char *is_target;
+
+// Code whose memory use can't be known checks each address first
+static int is_checked;
+
+// Everything up to where the code starts, from the includes
+static const char *prelude =
+	"// Translated from NEWBASIC bytecode, build with\n"
+	"// gcc -O3 -Iinclude this.c libnewbasic.a -lpthread\n"
+	"#pragma GCC diagnostic ignored \"-Wunused-label\"\n"
+	"#pragma GCC diagnostic ignored \"-Wunused-variable\"\n"
+	"\n"
+	"#include \"vm.h\"\n"
+	"#include \"bytecode.h\"\n"
+	"#include \"channel.h\"\n"
+	"#include \"shared.h\"\n"
+	"#include \"filemap.h\"\n"
+	"#include \"region.h\"\n"
+	"#include \"map.h\"\n"
+	"#include \"input.h\"\n"
+	"#include <string.h>\n"
+	"#include <stdio.h>\n"
+	"\n";
+
+// The rest of what's written before the code, after the sizes
+static const char *runtime =
+	"#define INT(value)	((Register) { CONST_INT, { .i = (value) } })\n"
+	"#define STR(value)	((Register) { CONST_STRING, { .str = (char*)(value) } })\n"
+	"#define IS_INT(a, b)	((a).type == CONST_INT && (b).type == CONST_INT)\n"
+	"\n"
+	"// Ints are worked on inline, anything else by the VM\n"
+	"#define OPERATE(d, a, b, op, bytecode) \\\n"
+	"	d = IS_INT(a, b) ? INT((a).i op (b).i) : vm_operate(bytecode, a, b)\n"
+	"#define DIVIDE(d, a, b) \\\n"
+	"	d = IS_INT(a, b) ? INT((b).i == 0 ? 0 : (a).i / (b).i) : vm_operate(BC_DIV_RRR, a, b)\n"
+	"#define COMPARE(a, b) \\\n"
+	"	flags = !IS_INT(a, b) ? vm_compare(flags, a, b) : (a).i == (b).i ? FLAG_EQUAL : \\\n"
+	"		(a).i < (b).i ? FLAG_LESS_THAN : FLAG_MORE_THAN\n"
+	"\n"
+	"#define INTERRUPT(id) \\\n"
+	"	{ Register in[4] = { r0, r1, r2, r3 }; \\\n"
+	"	vm_interrupt(id, in, memory, MEMORY_SIZE); \\\n"
+	"	r0 = in[0]; r1 = in[1]; r2 = in[2]; r3 = in[3]; }\n"
+	"\n"
+	"// Atomics stop the run outside shared segments\n"
+	"#define CELL(a) \\\n"
+	"	int *cell = vm_cell(a); \\\n"
+	"	if (cell == NULL) goto abort\n"
+	"\n"
+	"// Stops at an address outside memory, as the VM does\n"
+	"#define CHECK(a, pc) \\\n"
+	"	if ((unsigned)(a) >= MEMORY_SIZE) { \\\n"
+	"		printf(\"Error: Memory access at %i, outside %i, at %i\\n\", a, MEMORY_SIZE, pc); \\\n"
+	"		goto abort; }\n"
+	"\n"
+	"// Calls keep where they return to, each a case of the switch at 'ret'\n"
+	"#define CALL(back, to) \\\n"
+	"	if (frame_count == FRAME_MAX) goto abort; \\\n"
+	"	frames[frame_count].pc = back; \\\n"
+	"	frames[frame_count++].fp = fp.i; \\\n"
+	"	fp.i = sp.i; \\\n"
+	"	goto to\n"
+	"\n"
+	"struct Frame\n"
+	"{\n"
+	"	int pc, fp;\n"
+	"};\n"
+	"\n"
+	"static Register memory[MEMORY_SIZE];\n"
+	"static struct Frame frames[FRAME_MAX];\n"
+	"\n"
+	"int main()\n"
+	"{\n"
+	"	Register sp = INT(0), fp = INT(0);\n"
+	"	int frame_count = 0, status = 0;\n"
+	"	char flags = 0;\n"
+	"\n";
+
+// Everything after the code
+static const char *epilogue =
+	"abort:\n"
+	"	status = 1;\n"
+	"halt:\n"
+	"	channel_free_all();\n"
+	"	shared_close();\n"
+	"	filemap_close();\n"
+	"	region_close();\n"
+	"	map_close();\n"
+	"	input_close();\n"
+	"	return status;\n"
+	"}\n";
+
+#define LONG(name, form)	case BC_##name: inst->bytecode = BC_##form; break
+
+// Decodes the instruction at 'p', returning the start of the next. The
+// code has been verified, so it's always valid
+static int decode(int p, struct Inst *inst)
+{
+	struct Decoded decoded;
+	int i;
+
+	memset(inst, 0, sizeof(struct Inst));
+	codec_decode(code, code_len, p, &decoded);
+	inst->bytecode = decoded.bytecode;
+	for (i = 0; i < decoded.operand_count; i++)
+	{
+		struct Operand *operand = &decoded.operands[i];
+		switch (operand->type)
+		{
+			case OPERAND_CONST: inst->value = constants[operand->value]; break;
+			case OPERAND_ADDR: case OPERAND_OFFSET8: case OPERAND_OFFSET16:
+				inst->addr = operand->value;
+				break;
+			case OPERAND_INDIRECT_PLUS: case OPERAND_INDIRECT_SUB:
+				inst->offset = operand->offset;
+				inst->regs[inst->reg_count++] = operand->value;
+				break;
+			default: inst->regs[inst->reg_count++] = operand->value; break;
+		}
+	}
+
+	switch (inst->bytecode)
+	{
+		LONG(MOV_P, MOV_RR); LONG(CMP_P, CMP_RR);
+		LONG(ADD_PR, ADD_RRR); LONG(SUB_PR, SUB_RRR);
+		LONG(MUL_PR, MUL_RRR); LONG(DIV_PR, DIV_RRR);
+		LONG(CALL_O8, CALL_A); LONG(CALL_O16, CALL_A);
+		LONG(B_O8, B_A); LONG(B_O16, B_A);
+		LONG(BEQ_O8, BEQ_A); LONG(BEQ_O16, BEQ_A);
+		LONG(BNE_O8, BNE_A); LONG(BNE_O16, BNE_A);
+		LONG(BLT_O8, BLT_A); LONG(BLT_O16, BLT_A);
+		LONG(BGT_O8, BGT_A); LONG(BGT_O16, BGT_A);
+	}
+	return decoded.end;
+}
+
+static int is_parallel(char bytecode)
+{
+	return bytecode == BC_PFOR_A || bytecode == BC_PSUM_A ||
+		bytecode == BC_PMIN_A || bytecode == BC_PMAX_A;
+}
+
+// Finds where calls return to, and checks everything can be translated
+static int scan()
+{
+	struct Inst inst;
+	int i, p, next;
+
+	for (p = 0; p < code_len; p = next)
+	{
+		next = decode(p, &inst);
+		if (is_parallel(inst.bytecode))
+		{
+			ERROR("Parallel loop at %i only runs in the VM", p);
+			return 0;
+		}
+
+		// PC moves as each instruction is decoded, there's no such
+		// thing once they're translated
+		for (i = 0; i < inst.reg_count; i++)
+		{
+			if (inst.regs[i] < REGISTER_COUNT)
+				is_reg_used[inst.regs[i]] = 1;
+			if (inst.regs[i] == REGISTER_PC)
+			{
+				ERROR("PC is read at %i", p);
+				return 0;
+			}
+		}
+
+		switch (inst.bytecode)
+		{
+			case BC_CALL_A:
+				returns[return_count++] = next;
+				is_target[next] = 1;
+				is_target[inst.addr] = 1;
+				break;
+			case BC_B_A: case BC_BEQ_A: case BC_BNE_A:
+			case BC_BLT_A: case BC_BGT_A:
+				is_target[inst.addr] = 1;
+				break;
+		}
+	}
+
+	return 1;
+}
+
+// Names the registers and declares the ones that are used, a few to
+// a line
+static void write_registers()
+{
+	int r, count = 0;
+
+	for (r = 0; r < REGISTER_COUNT; r++)
+	{
+		sprintf(reg_names[r], "r%i", r);
+		if (!is_reg_used[r] && r >= INTERRUPT_REGISTERS)
+			continue;
+
+		fprintf(out, count % 5 == 0 ? "	Register %s = { 0 }" : ", %s = { 0 }", reg_names[r]);
+		if (++count % 5 == 0)
+			fprintf(out, ";\n");
+	}
+	if (count % 5 != 0)
+		fprintf(out, ";\n");
+	fprintf(out, "\n");
+
+	strcpy(reg_names[REGISTER_PC], "pc");
+	strcpy(reg_names[REGISTER_SP], "sp");
+	strcpy(reg_names[REGISTER_FP], "fp");
+}
+
+// Strings are written out byte by byte, so nothing in them can end
+// the literal early
+static void write_string(const char *str)
+{
+	fputc('"', out);
+	for (; *str != '\0'; str++)
+		fprintf(out, "\\%03o", (unsigned char)*str);
+	fputc('"', out);
+}
+
+static void write_const(struct Inst *inst)
+{
+	switch (inst->value.type)
+	{
+		case CONST_INT: fprintf(out, "INT(%i)", inst->value.i); break;
+		case CONST_STRING:
+			fprintf(out, "STR(");
+			write_string(inst->value.str);
+			fprintf(out, ")");
+			break;
+
+		// Anything else keeps the bits it has in the pool
+		default:
+			fprintf(out, "((Register) { %i, { .i = %i } })", 
+				inst->value.type, inst->value.i);
+			break;
+	}
+}
+
+#define A	reg_names[inst->regs[0]]
+#define B	reg_names[inst->regs[1]]
+#define C	reg_names[inst->regs[2]]
+
+static void write_operation(struct Inst *inst, const char *op, char bytecode)
+{
+	int is_const = inst->reg_count == 2;
+
+	if (bytecode == BC_DIV_RRR)
+		fprintf(out, "DIVIDE(%s, %s, ", A, B);
+	else
+		fprintf(out, "OPERATE(%s, %s, ", A, B);
+
+	if (is_const)
+		write_const(inst);
+	else
+		fprintf(out, "%s", C);
+
+	if (bytecode == BC_DIV_RRR)
+		fprintf(out, ");\n");
+	else
+		fprintf(out, ", %s, %s);\n", op, bytecode_names[(int)bytecode]);
+}
+
+static void write_check(const char *at, int start)
+{
+	if (is_checked)
+		fprintf(out, "CHECK(%s, %i); ", at, start);
+}
+
+// Stores to memory, the value being a register or a constant
+static void write_store(struct Inst *inst, const char *at, int start)
+{
+	write_check(at, start);
+	fprintf(out, "memory[%s] = ", at);
+	if (inst->reg_count == 2)
+		fprintf(out, "%s;\n", B);
+	else
+		write_const(inst);
+	if (inst->reg_count != 2)
+		fprintf(out, ";\n");
+}
+
+static void write_load(struct Inst *inst, const char *at, int start)
+{
+	write_check(at, start);
+	fprintf(out, "%s = memory[%s];\n", A, at);
+}
+
+static void write_inst(struct Inst *inst, int start, int next)
+{
+	char at[32];
+
+	switch (inst->bytecode)
+	{
+		case BC_HULT: fprintf(out, "goto halt;\n"); break;
+		case BC_INT_A: fprintf(out, "INTERRUPT(%i);\n", inst->addr); break;
+
+		case BC_MOV_RR: fprintf(out, "%s = %s;\n", A, B); break;
+		case BC_MOV_RC: fprintf(out, "%s = ", A); write_const(inst); fprintf(out, ";\n"); break;
+
+		case BC_MOV_AR:
+			sprintf(at, "%i", inst->addr);
+			write_check(at, start);
+			fprintf(out, "memory[%s] = %s;\n", at, A);
+			break;
+		case BC_MOV_AC:
+			sprintf(at, "%i", inst->addr);
+			write_check(at, start);
+			fprintf(out, "memory[%s] = ", at); write_const(inst); fprintf(out, ";\n");
+			break;
+		case BC_MOV_IR: case BC_MOV_IC:
+			sprintf(at, "%s.i", A);
+			write_store(inst, at, start);
+			break;
+		case BC_MOV_IPR: case BC_MOV_IPC:
+			sprintf(at, "%s.i + %i", A, inst->offset);
+			write_store(inst, at, start);
+			break;
+		case BC_MOV_ISR: case BC_MOV_ISC:
+			sprintf(at, "%s.i - %i", A, inst->offset);
+			write_store(inst, at, start);
+			break;
+
+		case BC_MOV_RA:
+			sprintf(at, "%i", inst->addr);
+			write_load(inst, at, start);
+			break;
+		case BC_MOV_RI:
+			sprintf(at, "%s.i", B);
+			write_load(inst, at, start);
+			break;
+		case BC_MOV_RIP:
+			sprintf(at, "%s.i + %i", B, inst->offset);
+			write_load(inst, at, start);
+			break;
+		case BC_MOV_RIS:
+			sprintf(at, "%s.i - %i", B, inst->offset);
+			write_load(inst, at, start);
+			break;
+
+		case BC_CMP_RR: fprintf(out, "COMPARE(%s, %s);\n", A, B); break;
+		case BC_CMP_RC: fprintf(out, "COMPARE(%s, ", A); write_const(inst); fprintf(out, ");\n"); break;
+
+		case BC_ADD_RRR: case BC_ADD_RRC: write_operation(inst, "+", BC_ADD_RRR); break;
+		case BC_SUB_RRR: case BC_SUB_RRC: write_operation(inst, "-", BC_SUB_RRR); break;
+		case BC_MUL_RRR: case BC_MUL_RRC: write_operation(inst, "*", BC_MUL_RRR); break;
+		case BC_DIV_RRR: case BC_DIV_RRC: write_operation(inst, "/", BC_DIV_RRR); break;
+
+		case BC_PUSH_R: write_check("sp.i", start); fprintf(out, "memory[sp.i] = %s; sp.i++;\n", A); break;
+		case BC_PUSH_C:
+			write_check("sp.i", start);
+			fprintf(out, "memory[sp.i] = "); write_const(inst); fprintf(out, "; sp.i++;\n");
+			break;
+		case BC_POP_R: write_check("sp.i - 1", start); fprintf(out, "sp.i--; %s = memory[sp.i];\n", A); break;
+		case BC_CALL_A: fprintf(out, "CALL(%i, L%i);\n", next, inst->addr); break;
+		case BC_RET: fprintf(out, "goto ret;\n"); break;
+		case BC_ENTER_A:
+			if (inst->addr > 0)
+			{
+				sprintf(at, "sp.i + %i", inst->addr - 1);
+				write_check("sp.i", start);
+				write_check(at, start);
+			}
+			fprintf(out, "memset(memory + sp.i, 0, sizeof(Register) * %i); sp.i += %i;\n",
+				inst->addr, inst->addr);
+			break;
+		case BC_LEAVE: fprintf(out, "sp.i = fp.i;\n"); break;
+
+		case BC_B_A: fprintf(out, "goto L%i;\n", inst->addr); break;
+		case BC_BEQ_A: fprintf(out, "if (flags & FLAG_EQUAL) goto L%i;\n", inst->addr); break;
+		case BC_BNE_A: fprintf(out, "if (!(flags & FLAG_EQUAL)) goto L%i;\n", inst->addr); break;
+		case BC_BLT_A: fprintf(out, "if (flags & FLAG_LESS_THAN) goto L%i;\n", inst->addr); break;
+		case BC_BGT_A: fprintf(out, "if (flags & FLAG_MORE_THAN) goto L%i;\n", inst->addr); break;
+
+		case BC_XADD_RIR:
+			fprintf(out, "{ CELL(%s.i); %s = INT(__atomic_fetch_add(cell, %s.i, __ATOMIC_SEQ_CST)); }\n", B, A, C);
+			break;
+		case BC_CAS_RIR:
+			fprintf(out, "{ CELL(%s.i); int old = %s.i; flags = __atomic_compare_exchange_n(cell, &old, %s.i, 0, "
+				"__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ? FLAG_EQUAL : 0; %s = INT(old); }\n", B, A, C, A);
+			break;
+		case BC_XCHG_RI:
+			fprintf(out, "{ CELL(%s.i); %s = INT(__atomic_exchange_n(cell, %s.i, __ATOMIC_SEQ_CST)); }\n", B, A, A);
+			break;
+		case BC_LDA_RI: fprintf(out, "{ CELL(%s.i); %s = INT(__atomic_load_n(cell, __ATOMIC_ACQUIRE)); }\n", B, A); break;
+		case BC_STL_IR: fprintf(out, "{ CELL(%s.i); __atomic_store_n(cell, %s.i, __ATOMIC_RELEASE); }\n", A, B); break;
+
+		case BC_LDB_RIR: fprintf(out, "%s = INT(vm_load_byte(%s.i, %s.i));\n", A, B, C); break;
+		case BC_STB_IRR: fprintf(out, "vm_store_byte(%s.i, %s.i, %s.i);\n", A, B, C); break;
+		case BC_LDE_RIR: fprintf(out, "%s = vm_load_element(%s.i, %s.i);\n", A, B, C); break;
+		case BC_STE_IRR: fprintf(out, "vm_store_element(%s.i, %s.i, %s);\n", A, B, C); break;
+
+		case BC_MAP_NEW_R: fprintf(out, "%s = INT(map_create());\n", A); break;
+		case BC_MAP_GET_RIR: fprintf(out, "%s = map_get(%s.i, %s);\n", A, B, C); break;
+		case BC_MAP_SET_IRR: fprintf(out, "map_set(%s.i, %s, %s);\n", A, B, C); break;
+		case BC_MAP_DEL_IR: fprintf(out, "map_delete(%s.i, %s);\n", A, B); break;
+		case BC_MAP_NEXT_RIR:
+			fprintf(out, "{ int cursor = %s.i; %s = map_next(%s.i, &cursor); %s = INT(cursor); }\n", C, A, B, C);
+			break;
+	}
+}
+
+// Returns go back to the instruction after their call
+static void write_returns()
+{
+	int i;
+
+	fprintf(out, "ret:\n");
+	fprintf(out, "	frame_count--;\n");
+	fprintf(out, "	fp.i = frames[frame_count].fp;\n");
+	fprintf(out, "	switch (frames[frame_count].pc)\n");
+	fprintf(out, "	{\n");
+	for (i = 0; i < return_count; i++)
+		fprintf(out, "		case %i: goto L%i;\n", returns[i], returns[i]);
+	fprintf(out, "	}\n");
+}
+
+static void free_translation()
+{
+	free(returns);
+	free(is_target);
+	free(constants);
+}
+
+int aot_write(const char *path, const struct Options *options, const struct Program *program)
+{
+	struct Inst inst;
+	int i, p, next, memory_size;
+
+	if (options->spawn_count > 0)
+	{
+		ERROR("Other VMs only run in the VM");
+		return 0;
+	}
+
+	if (options->budget > 0)
+		LOG("Translated code runs without a budget\n");
+
+	// Only verified code is translated. Where its memory use can't be
+	// known, each access is checked as the VM's checked loop does
+	constants = constants_load(program->constants, program->constants_len, &constant_count);
+	if (constants == NULL || !verifier_check(program->code, program->len,
+		constant_count, program->main_addr, &memory_size))
+	{
+		free(constants);
+		return 0;
+	}
+	is_checked = memory_size == -1;
+	if (is_checked)
+		memory_size = DEFAULT_MEMORY;
+	if (memory_size < 1)
+		memory_size = 1;
+
+	code = program->code;
+	code_len = program->len;
+	returns = malloc(sizeof(int) * (code_len + 1));
+	is_target = calloc(code_len + 1, 1);
+	is_target[program->main_addr] = 1;
+	return_count = 0;
+	memset(is_reg_used, 0, sizeof(is_reg_used));
+	if (!scan())
+	{
+		free_translation();
+		return 0;
+	}
+
+	out = fopen(path, "w");
+	if (out == NULL)
+	{
+		ERROR("Can't write '%.48s'", path);
+		free_translation();
+		return 0;
+	}
+
+	fputs(prelude, out);
+	fprintf(out, "#define MEMORY_SIZE	%i\n", memory_size);
+	fprintf(out, "#define FRAME_MAX	%i\n\n", FRAME_MAX);
+	fputs(runtime, out);
+	write_registers();
+
+	// The channels and segments it was built to run with
+	for (i = 0; i < options->channel_count; i++)
+		fprintf(out, "	channel_create(%i, %i);\n",
+			options->channel_sizes[i], options->channel_types[i]);
+	for (i = 0; i < options->segment_count; i++)
+		fprintf(out, "	shared_create(%i);\n", options->segment_sizes[i]);
+	fprintf(out, "	goto L%i;\n\n", program->main_addr);
+
+	// The instructions in the order they're laid out, so falling
+	// through works as it does in the VM, with a label on each one
+	// that's jumped or returned to
+	for (p = 0; p < code_len; p = next)
+	{
+		next = decode(p, &inst);
+		if (is_target[p])
+			fprintf(out, "L%i:\n", p);
+		fprintf(out, "	");
+		write_inst(&inst, p, next);
+	}
+	if (is_target[code_len])
+		fprintf(out, "L%i:\n	goto halt;\n", code_len);
+
+	fprintf(out, "\n");
+	write_returns();
+	fputs(epilogue, out);
+
+	int is_written = !ferror(out);
+	fclose(out);
+	free_translation();
+
+	LOG("Translated %i bytes of code to '%s'\n", code_len, path);
+	return is_written;
+}
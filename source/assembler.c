@@ -27,6 +27,29 @@
 #define INST_POP	14
 #define INST_CALL	15
 #define INST_RET	16
+#define INST_MACRO	17
+#define INST_MUL	18
+#define INST_DIV	19
+#define INST_PFOR	20
+#define INST_PSUM	21
+#define INST_PMIN	22
+#define INST_PMAX	23
+#define INST_XADD	24
+#define INST_CAS	25
+#define INST_XCHG	26
+#define INST_LDA	27
+#define INST_STL	28
+#define INST_LDB	29
+#define INST_STB	30
+#define INST_LDE	31
+#define INST_STE	32
+#define INST_ENTER	33
+#define INST_LEAVE	34
+#define INST_MAP_NEW	35
+#define INST_MAP_GET	36
+#define INST_MAP_SET	37
+#define INST_MAP_DEL	38
+#define INST_MAP_NEXT	39
 
 // Arg types
 #define ARG_REG			0
@@ -39,7 +62,7 @@
 // Named registers
 static char *named_registers[] = 
 {
-	"PC", "SP"
+	"PC", "SP", "FP"
 };
 
 // Assembly data
@@ -47,6 +70,43 @@ static char 	*code;
 static int 	pointer;
 static int 	len;
 
+// Register aliases, defined by 'LET x = RX'
+struct Alias
+{
+	char name[80];
+	int reg_id;
+};
+static struct Alias 	*aliases;
+static int 		alias_count;
+
+// Named constants, defined by 'LET x = <expression>'. If the 
+// expression refers to a label, the value is an offset from it
+struct Value
+{
+	int value;
+	char label[80];
+};
+
+struct Constant
+{
+	char name[80];
+	struct Value value;
+};
+static struct Constant 	*constants;
+static int 		constant_count;
+
+// Macros, defined by 'MACRO name args...' up to 'END_MACRO'
+struct Macro
+{
+	char name[80];
+	char params[8][80];
+	int param_count;
+	char *body;
+};
+static struct Macro 	*macros;
+static int 		macro_count;
+static int 		expansion_count;
+
 // Arg data
 struct Arg
 {
@@ -82,6 +142,8 @@ static char read_instruction()
 	if (!strcmp(name, "COMPARE")) return INST_CMP;
 	if (!strcmp(name, "ADD")) return INST_ADD;
 	if (!strcmp(name, "SUB")) return INST_SUB;
+	if (!strcmp(name, "MUL")) return INST_MUL;
+	if (!strcmp(name, "DIV")) return INST_DIV;
 	if (!strcmp(name, "GOTO"))   return INST_B;
 	if (!strcmp(name, "GOTO_IF_EQUAL")) return INST_BEQ;
 	if (!strcmp(name, "GOTO_IF_NOT_EQUAL")) return INST_BNE;
@@ -94,6 +156,27 @@ static char read_instruction()
 	if (!strcmp(name, "POP")) return INST_POP;
 	if (!strcmp(name, "CALL")) return INST_CALL;
 	if (!strcmp(name, "RETURN")) return INST_RET;
+	if (!strcmp(name, "ENTER")) return INST_ENTER;
+	if (!strcmp(name, "LEAVE")) return INST_LEAVE;
+	if (!strcmp(name, "MACRO")) return INST_MACRO;
+	if (!strcmp(name, "PARALLEL_FOR")) return INST_PFOR;
+	if (!strcmp(name, "PARALLEL_SUM")) return INST_PSUM;
+	if (!strcmp(name, "PARALLEL_MIN")) return INST_PMIN;
+	if (!strcmp(name, "PARALLEL_MAX")) return INST_PMAX;
+	if (!strcmp(name, "ATOMIC_ADD")) return INST_XADD;
+	if (!strcmp(name, "CAS")) return INST_CAS;
+	if (!strcmp(name, "XCHG")) return INST_XCHG;
+	if (!strcmp(name, "LOAD_ACQUIRE")) return INST_LDA;
+	if (!strcmp(name, "STORE_RELEASE")) return INST_STL;
+	if (!strcmp(name, "LOAD_BYTE")) return INST_LDB;
+	if (!strcmp(name, "STORE_BYTE")) return INST_STB;
+	if (!strcmp(name, "LOAD_ELEMENT")) return INST_LDE;
+	if (!strcmp(name, "STORE_ELEMENT")) return INST_STE;
+	if (!strcmp(name, "MAP_NEW")) return INST_MAP_NEW;
+	if (!strcmp(name, "MAP_GET")) return INST_MAP_GET;
+	if (!strcmp(name, "MAP_SET")) return INST_MAP_SET;
+	if (!strcmp(name, "MAP_DEL")) return INST_MAP_DEL;
+	if (!strcmp(name, "MAP_NEXT")) return INST_MAP_NEXT;
 	return INST_ERROR;
 }
 
@@ -102,141 +185,402 @@ static int get_named_reg(const char *name)
 	int i;
 	for (i = 0; i < sizeof(named_registers) / sizeof(char*); i++)
 		if (!strcmp(name, named_registers[i]))
-			return 10 + i;
+			return REGISTER_COUNT + i;
 	
 	return 0;
 }
 
-static struct Arg read_constant(char c)
+static struct Alias *find_alias(const char *name)
 {
-	struct Arg arg;
-	char buffer[80];
-	int buffer_pointer = 0;
-	arg.type = ARG_CONST;
+	int i;
+	for (i = 0; i < alias_count; i++)
+		if (!strcmp(aliases[i].name, name))
+			return &aliases[i];
+
+	return NULL;
+}
+
+static struct Constant *find_constant(const char *name)
+{
+	int i;
+	for (i = 0; i < constant_count; i++)
+		if (!strcmp(constants[i].name, name))
+			return &constants[i];
+
+	return NULL;
+}
+
+static struct Macro *find_macro(const char *name)
+{
+	int i;
+	for (i = 0; i < macro_count; i++)
+		if (!strcmp(macros[i].name, name))
+			return &macros[i];
+
+	return NULL;
+}
+
+// Returns the register id of 'RX', a named register or 
+// an alias, or -1 if the name is not a register
+static int parse_register(const char *name)
+{
+	int i;
 
-	if (isdigit(c))
+	if (name[0] == 'R' && isdigit(name[1]))
 	{
-		// Read number
-		while (isdigit(c) && tokenizer_has_next())
+		for (i = 1; name[i] != '\0'; i++)
+			if (!isdigit(name[i]))
+				return -1;
+
+		// More than three digits can't be a register, or fit an int
+		int reg = i > 4 ? REGISTER_COUNT : atoi(name + 1);
+		if (reg >= REGISTER_COUNT)
 		{
-			buffer[buffer_pointer++] = c;
-			c = tokenizer_next();
+			ERROR("Uknown register '%s'", name);
+			return 0;
 		}
-		tokenizer_push_back(c);
-		buffer[buffer_pointer] = '\0';
+		return reg;
+	}
 
-		arg.const_type = CONST_INT;
-		arg.const_i = atoi(buffer);
+	int reg = get_named_reg(name);
+	if (reg)
+		return reg;
+
+	struct Alias *alias = find_alias(name);
+	if (alias != NULL)
+		return alias->reg_id;
+
+	return -1;
+}
+
+// Constant expressions
+static const char *expr;
+
+static struct Value parse_expression();
+
+static void expr_skip_white_space()
+{
+	while (isspace(*expr))
+		expr++;
+}
+
+static struct Value make_value(int value)
+{
+	struct Value out;
+	out.value = value;
+	out.label[0] = '\0';
+	return out;
+}
+
+static struct Value parse_primary()
+{
+	char buffer[80];
+	int buffer_pointer = 0;
+
+	expr_skip_white_space();
+	if (*expr == '(')
+	{
+		expr++;
+		struct Value value = parse_expression();
+		expr_skip_white_space();
+		if (*expr++ != ')')
+			ERROR("Expected ')'");
+		return value;
 	}
-	else if (isalpha(c))
+
+	if (*expr == '-')
 	{
-		// Read label
-		while ((isdigit(c) || isalpha(c) || c == '_') && tokenizer_has_next())
-		{
-			buffer[buffer_pointer++] = c;
-			c = tokenizer_next();
-		}
-		tokenizer_push_back(c);
+		expr++;
+		struct Value value = parse_primary();
+		if (value.label[0] != '\0')
+			ERROR("Can't negate label '%s'", value.label);
+		return make_value(-value.value);
+	}
+
+	if (isdigit(*expr))
+	{
+		while (isdigit(*expr))
+			buffer[buffer_pointer++] = *expr++;
 		buffer[buffer_pointer] = '\0';
+		return make_value(atoi(buffer));
+	}
 
-		int reg = get_named_reg(buffer);
-		if (reg)
-		{
-			arg.reg_id = reg;
-			arg.type = ARG_REG;
-		}
-		else
+	if (isalpha(*expr) || *expr == '_')
+	{
+		while ((isalpha(*expr) || isdigit(*expr) || *expr == '_') && buffer_pointer < 79)
+			buffer[buffer_pointer++] = *expr++;
+		buffer[buffer_pointer] = '\0';
+
+		struct Constant *constant = find_constant(buffer);
+		if (constant != NULL)
+			return constant->value;
+
+		if (parse_register(buffer) != -1)
 		{
-			arg.is_addr_label = 1;
-			strcpy(arg.addr_label, buffer);
-			arg.type = ARG_ADDR;
+			ERROR("Register '%s' in constant expression", buffer);
+			return make_value(0);
 		}
+
+		// Anything else is a label, resolved by the linker
+		struct Value value = make_value(0);
+		strcpy(value.label, buffer);
+		return value;
+	}
+
+	ERROR("Invalid constant expression");
+	return make_value(0);
+}
+
+static struct Value apply_operator(char op, struct Value a, struct Value b)
+{
+	// Labels may only be offset by a constant
+	if (op == '+' && a.label[0] == '\0')
+	{
+		strcpy(a.label, b.label);
+		b.label[0] = '\0';
 	}
-	else if (c == '"')
+	else if (b.label[0] != '\0' || (a.label[0] != '\0' && op != '+' && op != '-'))
 	{
-		// Read string constant
-		while ((c = tokenizer_next()) != '"' && tokenizer_has_next())
-			buffer[buffer_pointer++] = c;
-		buffer[buffer_pointer] = '\0';
-		
-		arg.const_type = CONST_STRING;
-		strcpy(arg.const_str, buffer);
+		ERROR("Invalid operation on label in constant expression");
+		return make_value(0);
 	}
 
-	LOG("%s, ", buffer);
-	return arg;
+	switch (op)
+	{
+		case '+': a.value += b.value; break;
+		case '-': a.value -= b.value; break;
+		case '*': a.value *= b.value; break;
+		case '<': a.value <<= b.value; break;
+		case '>': a.value >>= b.value; break;
+		case '/':
+			if (b.value == 0)
+			{
+				ERROR("Division by zero in constant expression");
+				return make_value(0);
+			}
+			a.value /= b.value; 
+			break;
+	}
+
+	return a;
 }
 
-static struct Arg read_addr()
+static struct Value parse_term()
+{
+	struct Value value = parse_primary();
+
+	expr_skip_white_space();
+	while (*expr == '*' || *expr == '/')
+	{
+		char op = *expr++;
+		value = apply_operator(op, value, parse_primary());
+		expr_skip_white_space();
+	}
+
+	return value;
+}
+
+static struct Value parse_sum()
+{
+	struct Value value = parse_term();
+
+	expr_skip_white_space();
+	while (*expr == '+' || *expr == '-')
+	{
+		char op = *expr++;
+		value = apply_operator(op, value, parse_term());
+		expr_skip_white_space();
+	}
+
+	return value;
+}
+
+static struct Value parse_expression()
+{
+	struct Value value = parse_sum();
+
+	expr_skip_white_space();
+	while ((expr[0] == '<' && expr[1] == '<') || (expr[0] == '>' && expr[1] == '>'))
+	{
+		char op = expr[0];
+		expr += 2;
+		value = apply_operator(op, value, parse_sum());
+		expr_skip_white_space();
+	}
+
+	return value;
+}
+
+static struct Value evaluate(const char *str)
+{
+	expr = str;
+	struct Value value = parse_expression();
+
+	expr_skip_white_space();
+	if (*expr != '\0')
+		ERROR("Unexpected '%c' in constant expression", *expr);
+
+	return value;
+}
+
+// Read a single argument as text, up to white space 
+// outside of brackets and strings
+static void read_arg_text(char c, char *out)
+{
+	int buffer_pointer = 0;
+	int depth = 0, in_string = 0;
+
+	while (c != '\n' && tokenizer_has_next() && buffer_pointer < 79)
+	{
+		if (isspace(c) && depth == 0 && !in_string)
+			break;
+
+		if (c == '"') in_string = !in_string;
+		if (!in_string && (c == '(' || c == '[')) depth++;
+		if (!in_string && (c == ')' || c == ']')) depth--;
+
+		out[buffer_pointer++] = c;
+		c = tokenizer_next();
+	}
+	tokenizer_push_back(c);
+	out[buffer_pointer] = '\0';
+}
+
+static struct Arg value_arg(struct Value value)
 {
 	struct Arg arg;
-	arg.type = ARG_ADDR;
-	arg.is_addr_label = 0;
-	arg.addr = tokenizer_read_int();
 
-	LOG("#%i, ", arg.addr);
+	if (value.label[0] != '\0')
+	{
+		arg.type = ARG_ADDR;
+		arg.is_addr_label = 1;
+		arg.addr = value.value;
+		strcpy(arg.addr_label, value.label);
+	}
+	else
+	{
+		arg.type = ARG_CONST;
+		arg.const_type = CONST_INT;
+		arg.const_i = value.value;
+	}
+
 	return arg;
 }
 
-static struct Arg read_register()
+static struct Arg read_string()
 {
 	struct Arg arg;
-	arg.type = ARG_REG;
-	arg.reg_id = tokenizer_next() - '0';
+	char c, buffer[80];
+	int buffer_pointer = 0;
+
+	// Read string constant
+	while ((c = tokenizer_next()) != '"' && tokenizer_has_next() && buffer_pointer < 79)
+		buffer[buffer_pointer++] = c;
+	buffer[buffer_pointer] = '\0';
+	
+	arg.type = ARG_CONST;
+	arg.const_type = CONST_STRING;
+	strcpy(arg.const_str, buffer);
 
-	LOG("R%i, ", arg.reg_id);
+	LOG("\"%s\", ", buffer);
 	return arg;
 }
 
-static int read_indirect_reg()
+static struct Arg read_value(char c)
 {
-	char c;
+	struct Arg arg;
 	char buffer[80];
-	int reg = 0;
+	read_arg_text(c, buffer);
 
-	tokenizer_skip_white_space();
-	c = tokenizer_next();
-
-	// If it starts with 'R', it's a register
-	if (c == 'R')
+	int reg = parse_register(buffer);
+	if (reg != -1)
 	{
-		reg = tokenizer_next() - '0';
+		arg.type = ARG_REG;
+		arg.reg_id = reg;
+		LOG("R%i, ", arg.reg_id);
+		return arg;
 	}
-	else
-	{
-		// Otherwise, check named registers
-		buffer[0] = c;
-		tokenizer_word(buffer + 1);
-		reg = get_named_reg(buffer);
 
-		// If it's not a named register, then it 
-		// can't be an indirect
-		if (reg == 0)
-		{
-			ERROR("Uknown register '%s'", buffer);
-		}
+	arg = value_arg(evaluate(buffer));
+	LOG("%s, ", buffer);
+	return arg;
+}
+
+static struct Arg read_addr()
+{
+	struct Arg arg;
+	char buffer[80];
+	read_arg_text(tokenizer_next(), buffer);
+
+	struct Value value = evaluate(buffer);
+	arg = value_arg(value);
+	arg.type = ARG_ADDR;
+	if (value.label[0] == '\0')
+	{
+		arg.is_addr_label = 0;
+		arg.addr = value.value;
 	}
 
-	return reg;
+	LOG("#%s, ", buffer);
+	return arg;
 }
 
 static struct Arg read_indirect()
 {
 	struct Arg arg;
+	char buffer[80];
+	int i = 0;
+
+	// Read up to the closing bracket
+	read_arg_text('[', buffer);
+	if (buffer[strlen(buffer) - 1] != ']')
+	{
+		ERROR("Expected ']'");
+		arg.type = ARG_INDIRECT;
+		arg.reg_id = 0;
+		return arg;
+	}
+	buffer[strlen(buffer) - 1] = '\0';
+
+	// Split into the register and an optional offset
+	char *reg_name = buffer + 1;
+	while (isspace(*reg_name))
+		reg_name++;
+	while (isalpha(reg_name[i]) || isdigit(reg_name[i]) || reg_name[i] == '_')
+		i++;
+	
+	char *offset = reg_name + i;
+	while (isspace(*offset))
+		offset++;
+	
+	char operation = *offset;
+	reg_name[i] = '\0';
+
 	arg.type = ARG_INDIRECT;
-	arg.reg_id = read_indirect_reg();
+	arg.reg_id = parse_register(reg_name);
+	if (arg.reg_id == -1)
+	{
+		// If it's not a register, then it can't be an indirect
+		ERROR("Uknown register '%s'", reg_name);
+		arg.reg_id = 0;
+	}
 	LOG("[R%i", arg.reg_id);
 	
-	tokenizer_skip_white_space();
-	char operation = tokenizer_next();
 	if (operation == '+' || operation == '-')
 	{
+		struct Value value = evaluate(offset + 1);
+		if (value.label[0] != '\0' || value.value < 0 || value.value > 127)
+			ERROR("Indirect offset must be a constant from 0 to 127");
+
 		arg.type = (operation == '+' ? ARG_INDIRECT_PLUS : ARG_INDIRECT_SUB);
-		arg.op_const = (char) tokenizer_read_int();
-		tokenizer_next(); // Skip ]
+		arg.op_const = (char) value.value;
 
 		LOG(" %c %i", operation, arg.op_const);
 	}
+	else if (operation != '\0')
+	{
+		ERROR("Unexpected '%c' in indirect", operation);
+	}
 
 	LOG("]");
 	return arg;
@@ -246,10 +590,10 @@ static struct Arg read_arg(char c)
 {
 	switch (c)
 	{
-		case 'R': return read_register();
 		case '#': return read_addr();
 		case '[': return read_indirect();
-		default: return read_constant(c);
+		case '"': return read_string();
+		default: return read_value(c);
 	}
 }
 
@@ -313,9 +657,8 @@ static void write_reg(struct Arg arg)
 
 static void write_const(struct Arg arg)
 {
-	int i;
+	// Written out whole, the linker moves it into the constant pool
 	write_byte((char)arg.const_type);
-
 	switch (arg.const_type)
 	{
 		case CONST_INT: write_int(arg.const_i); break;
@@ -327,8 +670,10 @@ static void write_addr(struct Arg arg)
 {
 	if (arg.is_addr_label)
 	{
+		// The address is the label plus a constant offset
 		write_byte(BC_GET_LABEL);
 		write_string(arg.addr_label);
+		write_int(arg.addr);
 	}
 	else
 	{
@@ -369,12 +714,212 @@ static void read_label()
 	write_string(name);
 }
 
+static void read_rest_of_line(char *out, int max_len)
+{
+	char c;
+	int buffer_pointer = 0;
+
+	while ((c = tokenizer_next()) != '\n' && tokenizer_has_next())
+		if (buffer_pointer < max_len - 1)
+			out[buffer_pointer++] = c;
+	out[buffer_pointer] = '\0';
+}
+
 static void read_let()
 {
-	char name[80];
+	char name[80], value[80];
 	tokenizer_word(name);
 
+	tokenizer_skip_white_space();
+	if (tokenizer_next() != '=')
+	{
+		ERROR("Expected '=' after 'LET %s'", name);
+		read_rest_of_line(value, sizeof(value));
+		return;
+	}
+
+	tokenizer_skip_white_space();
+	read_rest_of_line(value, sizeof(value));
+
+	// Trim trailing white space
+	int i = strlen(value);
+	while (i > 0 && isspace(value[i - 1]))
+		value[--i] = '\0';
+
+	int reg = parse_register(value);
+	if (reg != -1)
+	{
+		// Define a register alias
+		struct Alias *alias = find_alias(name);
+		if (alias == NULL)
+		{
+			aliases = realloc(aliases, sizeof(struct Alias) * (alias_count + 1));
+			alias = &aliases[alias_count++];
+			strcpy(alias->name, name);
+		}
+		alias->reg_id = reg;
+
+		LOG("LET %s = R%i\n", name, reg);
+		return;
+	}
+
+	// Otherwise, it's a named constant
+	struct Value result = evaluate(value);
+	struct Constant *constant = find_constant(name);
+	if (constant == NULL)
+	{
+		constants = realloc(constants, sizeof(struct Constant) * (constant_count + 1));
+		constant = &constants[constant_count++];
+		strcpy(constant->name, name);
+	}
+	constant->value = result;
 
+	LOG("LET %s = %s%s%i\n", name, result.label, 
+		result.label[0] != '\0' ? " + " : "", result.value);
+}
+
+static void append_text(char **out, int *out_len, int *out_max_len, const char *text, int text_len)
+{
+	while (*out_len + text_len + 1 >= *out_max_len)
+	{
+		*out_max_len += CHUNK_SIZE;
+		*out = realloc(*out, *out_max_len);
+	}
+
+	memcpy(*out + *out_len, text, text_len);
+	*out_len += text_len;
+	(*out)[*out_len] = '\0';
+}
+
+static void read_macro()
+{
+	char c, line[80];
+	struct Macro macro;
+	macro.param_count = 0;
+	tokenizer_word(macro.name);
+
+	// Read parameter names up to the end of the line
+	while ((c = tokenizer_next()) != '\n' && tokenizer_has_next())
+	{
+		if (isspace(c))
+			continue;
+
+		tokenizer_push_back(c);
+		if (macro.param_count >= 8)
+		{
+			ERROR("Too many parameters in macro '%s'", macro.name);
+			tokenizer_word(line);
+			continue;
+		}
+		tokenizer_word(macro.params[macro.param_count++]);
+	}
+
+	// Store the raw body text, up to 'END_MACRO'
+	int body_len = 0, body_max_len = CHUNK_SIZE;
+	macro.body = malloc(body_max_len);
+	macro.body[0] = '\0';
+	for (;;)
+	{
+		if (!tokenizer_has_next())
+		{
+			ERROR("Missing 'END_MACRO' in macro '%s'", macro.name);
+			break;
+		}
+
+		read_rest_of_line(line, sizeof(line));
+		char *start = line;
+		while (isspace(*start))
+			start++;
+
+		if (!strncmp(start, "END_MACRO", 9) && (isspace(start[9]) || start[9] == '\0'))
+			break;
+
+		append_text(&macro.body, &body_len, &body_max_len, line, strlen(line));
+		append_text(&macro.body, &body_len, &body_max_len, "\n", 1);
+	}
+
+	macros = realloc(macros, sizeof(struct Macro) * (macro_count + 1));
+	macros[macro_count++] = macro;
+	LOG("MACRO %s (%i args)\n", macro.name, macro.param_count);
+}
+
+static void expand_macro(struct Macro *macro)
+{
+	char c, arg_values[8][80];
+	char buffer[80];
+	int arg_value_count = 0;
+
+	// Read the arguments as raw text
+	while ((c = tokenizer_next()) != '\n' && tokenizer_has_next())
+	{
+		if (isspace(c))
+			continue;
+
+		read_arg_text(c, buffer);
+		if (arg_value_count < 8)
+			strcpy(arg_values[arg_value_count], buffer);
+		arg_value_count++;
+	}
+
+	if (arg_value_count != macro->param_count)
+	{
+		ERROR("Macro '%s' takes %i arguments, got %i", 
+			macro->name, macro->param_count, arg_value_count);
+		return;
+	}
+
+	// Substitute arguments for parameter names, and '\\@' for 
+	// a number unique to this expansion
+	int out_len = 0, out_max_len = CHUNK_SIZE;
+	char *out = malloc(out_max_len);
+	const char *body = macro->body;
+	int in_string = 0;
+	out[0] = '\0';
+	expansion_count++;
+
+	while (*body != '\0')
+	{
+		if (*body == '"')
+			in_string = !in_string;
+
+		if (!in_string && body[0] == '\\' && body[1] == '@')
+		{
+			sprintf(buffer, "%i", expansion_count);
+			append_text(&out, &out_len, &out_max_len, buffer, strlen(buffer));
+			body += 2;
+			continue;
+		}
+
+		if (!in_string && (isalpha(*body) || *body == '_'))
+		{
+			int i, word_len = 0;
+			while (isalpha(body[word_len]) || isdigit(body[word_len]) || body[word_len] == '_')
+				word_len++;
+
+			const char *word = body;
+			for (i = 0; i < macro->param_count; i++)
+			{
+				if (strlen(macro->params[i]) == word_len && 
+					!strncmp(macro->params[i], body, word_len))
+				{
+					word = arg_values[i];
+					break;
+				}
+			}
+
+			append_text(&out, &out_len, &out_max_len, word, 
+				word == body ? word_len : strlen(word));
+			body += word_len;
+			continue;
+		}
+
+		append_text(&out, &out_len, &out_max_len, body++, 1);
+	}
+
+	LOG("Expanding macro '%s'\n", macro->name);
+	if (!tokenizer_insert(out))
+		ERROR("Macro '%s' nested too deeply", macro->name);
+	free(out);
 }
 
 struct Instruction
@@ -411,6 +956,8 @@ struct InstructionGroup instruction_groups[] =
 	{ INST_CMP, 2, { INSTRUCTION(CMP_RC), INSTRUCTION(CMP_RR) } },
 	{ INST_ADD, 2, { INSTRUCTION(ADD_RRC), INSTRUCTION(ADD_RRR) } },
 	{ INST_SUB, 2, { INSTRUCTION(SUB_RRC), INSTRUCTION(SUB_RRR) } },
+	{ INST_MUL, 2, { INSTRUCTION(MUL_RRC), INSTRUCTION(MUL_RRR) } },
+	{ INST_DIV, 2, { INSTRUCTION(DIV_RRC), INSTRUCTION(DIV_RRR) } },
 	{ INST_B, 1, INSTRUCTION(B_A) },
 	{ INST_BEQ, 1, INSTRUCTION(BEQ_A) },
 	{ INST_BNE, 1, INSTRUCTION(BNE_A) },
@@ -421,11 +968,57 @@ struct InstructionGroup instruction_groups[] =
 	{ INST_PUSH, 2, { INSTRUCTION(PUSH_R), INSTRUCTION(PUSH_C) } },
 	{ INST_POP, 1, INSTRUCTION(POP_R) },
 	{ INST_CALL, 1, INSTRUCTION(CALL_A) },
-	{ INST_RET, 1, { BC_RET, 0 } }
+	{ INST_RET, 1, { BC_RET, 0 } },
+	{ INST_ENTER, 1, INSTRUCTION(ENTER_A) },
+	{ INST_LEAVE, 1, { BC_LEAVE, 0 } },
+	{ INST_PFOR, 1, INSTRUCTION(PFOR_A) },
+	{ INST_PSUM, 1, INSTRUCTION(PSUM_A) },
+	{ INST_PMIN, 1, INSTRUCTION(PMIN_A) },
+	{ INST_PMAX, 1, INSTRUCTION(PMAX_A) },
+	{ INST_XADD, 1, INSTRUCTION(XADD_RIR) },
+	{ INST_CAS, 1, INSTRUCTION(CAS_RIR) },
+	{ INST_XCHG, 1, INSTRUCTION(XCHG_RI) },
+	{ INST_LDA, 1, INSTRUCTION(LDA_RI) },
+	{ INST_STL, 1, INSTRUCTION(STL_IR) },
+	{ INST_LDB, 1, INSTRUCTION(LDB_RIR) },
+	{ INST_STB, 1, INSTRUCTION(STB_IRR) },
+	{ INST_LDE, 1, INSTRUCTION(LDE_RIR) },
+	{ INST_STE, 1, INSTRUCTION(STE_IRR) },
+	{ INST_MAP_NEW, 1, INSTRUCTION(MAP_NEW_R) },
+	{ INST_MAP_GET, 1, INSTRUCTION(MAP_GET_RIR) },
+	{ INST_MAP_SET, 1, INSTRUCTION(MAP_SET_IRR) },
+	{ INST_MAP_DEL, 1, INSTRUCTION(MAP_DEL_IR) },
+	{ INST_MAP_NEXT, 1, INSTRUCTION(MAP_NEXT_RIR) }
 };
 
 #define INSTRUCTION_GROUP_SIZE sizeof(instruction_groups) / sizeof(instruction_groups[0])
 
+// Writes the short form of register only instructions, with the 
+// first two registers packed into one byte, if they fit
+static int write_packed(char bytecode)
+{
+	char packed;
+	switch (bytecode)
+	{
+		case BC_MOV_RR: packed = BC_MOV_P; break;
+		case BC_CMP_RR: packed = BC_CMP_P; break;
+		case BC_ADD_RRR: packed = BC_ADD_PR; break;
+		case BC_SUB_RRR: packed = BC_SUB_PR; break;
+		case BC_MUL_RRR: packed = BC_MUL_PR; break;
+		case BC_DIV_RRR: packed = BC_DIV_PR; break;
+		default: return 0;
+	}
+
+	if (args[0].reg_id > 15 || args[1].reg_id > 15)
+		return 0;
+
+	write_byte(packed);
+	write_byte(args[0].reg_id << 4 | args[1].reg_id);
+	if (arg_count > 2)
+		write_reg(args[2]);
+	return 1;
+}
+
 static void parse_instruction_group(struct InstructionGroup group)
 {
 	int i, j;
@@ -459,6 +1052,9 @@ static void parse_instruction_group(struct InstructionGroup group)
 	}
 
 	LOG("%s\n", bytecode_names[bytecode]);
+	if (write_packed(bytecode))
+		return;
+
 	write_byte(bytecode);
 	write_args();
 }
@@ -474,6 +1070,13 @@ static void read_line()
 			return;
 		}
 
+		struct Macro *macro = find_macro(instruction_name);
+		if (macro != NULL)
+		{
+			expand_macro(macro);
+			return;
+		}
+
 		if (strlen(instruction_name) > 0)
 			ERROR("Uknown instruction '%s'", instruction_name);
 		return;
@@ -483,6 +1086,11 @@ static void read_line()
 		read_let();
 		return;
 	}
+	else if (inst == INST_MACRO)
+	{
+		read_macro();
+		return;
+	}
 
 	LOG("%s [", instruction_name);
 	read_all_args();
@@ -507,9 +1115,24 @@ char *assemble(int *out_len)
 	len = CHUNK_SIZE;
 	pointer = 0;
 
+	aliases = NULL;
+	constants = NULL;
+	macros = NULL;
+	alias_count = 0;
+	constant_count = 0;
+	macro_count = 0;
+
 	while (tokenizer_has_next())	
 		read_line();
 	write_byte(BC_HULT);
+
+	// Clean up definitions, they only apply to this file
+	int i;
+	for (i = 0; i < macro_count; i++)
+		free(macros[i].body);
+	free(aliases);
+	free(constants);
+	free(macros);
 	
 	*out_len = pointer;
 	return code;
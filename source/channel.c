@@ -0,0 +1,235 @@
+#include "channel.h"
+#include "debug.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#define CACHE_LINE	64
+
+// Each cell's sequence says whose turn it is, the sender's when it
+// equals the send position, the receiver's when it's one past it
+struct Cell
+{
+	unsigned seq;
+	Register value;
+};
+
+// Positions are kept apart so senders and receivers don't share
+// a cache line. 'items' and 'spaces' are bumped after each send and
+// receive, and are what blocked threads park on
+struct Channel
+{
+	struct Cell *cells;
+	unsigned mask;
+	int type;
+
+	_Alignas(CACHE_LINE) unsigned head;
+	_Alignas(CACHE_LINE) unsigned tail;
+	_Alignas(CACHE_LINE) unsigned items;
+	unsigned spaces;
+	int receivers_waiting;
+	int senders_waiting;
+	int is_closed;
+};
+
+static struct Channel **channels;
+static int channel_count;
+
+static void park(unsigned *word, unsigned seen)
+{
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+static void wake(unsigned *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+int channel_create(int capacity, int type)
+{
+	unsigned i, size = 1;
+	if (capacity < 1)
+	{
+		ERROR("Can't create a channel of %i", capacity);
+		return -1;
+	}
+
+	// A single cell's sequence can't tell full from empty, so there 
+	// are always at least two
+	while (size < capacity || size < 2)
+		size *= 2;
+
+	struct Channel *channel = aligned_alloc(CACHE_LINE, sizeof(struct Channel));
+	*channel = (struct Channel) { 0 };
+	channel->cells = malloc(sizeof(struct Cell) * size);
+	channel->mask = size - 1;
+	channel->type = type;
+	for (i = 0; i < size; i++)
+		channel->cells[i].seq = i;
+
+	channels = realloc(channels, sizeof(struct Channel*) * (channel_count + 1));
+	channels[channel_count] = channel;
+	return channel_count++;
+}
+
+static struct Channel *find_channel(int id)
+{
+	if (id < 0 || id >= channel_count)
+		return NULL;
+	return channels[id];
+}
+
+static int try_send(struct Channel *channel, Register value)
+{
+	unsigned pos = __atomic_load_n(&channel->head, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		struct Cell *cell = &channel->cells[pos & channel->mask];
+		int diff = (int)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff < 0)
+			return 0;
+
+		if (diff == 0)
+		{
+			// Only one sender, so the position is ours
+			if (channel->type == CHANNEL_SPSC)
+			{
+				__atomic_store_n(&channel->head, pos + 1, __ATOMIC_RELAXED);
+			}
+			else if (!__atomic_compare_exchange_n(&channel->head, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				continue;
+			}
+
+			cell->value = value;
+			__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+			return 1;
+		}
+
+		pos = __atomic_load_n(&channel->head, __ATOMIC_RELAXED);
+	}
+}
+
+static int try_recv(struct Channel *channel, Register *value)
+{
+	unsigned pos = __atomic_load_n(&channel->tail, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		struct Cell *cell = &channel->cells[pos & channel->mask];
+		int diff = (int)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (diff < 0)
+			return 0;
+
+		if (diff == 0)
+		{
+			if (channel->type == CHANNEL_SPSC)
+			{
+				__atomic_store_n(&channel->tail, pos + 1, __ATOMIC_RELAXED);
+			}
+			else if (!__atomic_compare_exchange_n(&channel->tail, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				continue;
+			}
+
+			*value = cell->value;
+			__atomic_store_n(&cell->seq, pos + channel->mask + 1, __ATOMIC_RELEASE);
+			return 1;
+		}
+
+		pos = __atomic_load_n(&channel->tail, __ATOMIC_RELAXED);
+	}
+}
+
+// Bumps the word others are parked on, and wakes them if there are any
+static void signal(unsigned *word, int *waiting)
+{
+	__atomic_fetch_add(word, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) > 0)
+		wake(word);
+}
+
+static void wait_on(unsigned *word, int *waiting, unsigned seen)
+{
+	__atomic_fetch_add(waiting, 1, __ATOMIC_SEQ_CST);
+	park(word, seen);
+	__atomic_fetch_sub(waiting, 1, __ATOMIC_SEQ_CST);
+}
+
+int channel_send(int id, const Register *values, int count)
+{
+	struct Channel *channel = find_channel(id);
+	int sent = 0;
+	if (channel == NULL)
+		return 0;
+
+	while (sent < count && !__atomic_load_n(&channel->is_closed, __ATOMIC_ACQUIRE))
+	{
+		unsigned seen = __atomic_load_n(&channel->spaces, __ATOMIC_SEQ_CST);
+		int before = sent;
+		while (sent < count && try_send(channel, values[sent]))
+			sent++;
+
+		// Park until a receiver makes space
+		if (sent == before)
+			wait_on(&channel->spaces, &channel->senders_waiting, seen);
+		else
+			signal(&channel->items, &channel->receivers_waiting);
+	}
+
+	return sent;
+}
+
+int channel_recv(int id, Register *values, int max_count)
+{
+	struct Channel *channel = find_channel(id);
+	int count = 0;
+	if (channel == NULL || max_count < 1)
+		return 0;
+
+	while (count == 0)
+	{
+		unsigned seen = __atomic_load_n(&channel->items, __ATOMIC_SEQ_CST);
+		int is_closed = __atomic_load_n(&channel->is_closed, __ATOMIC_ACQUIRE);
+		while (count < max_count && try_recv(channel, &values[count]))
+			count++;
+
+		// Everything sent before closing has been received
+		if (count == 0 && is_closed)
+			return 0;
+
+		if (count == 0)
+			wait_on(&channel->items, &channel->receivers_waiting, seen);
+	}
+
+	signal(&channel->spaces, &channel->senders_waiting);
+	return count;
+}
+
+void channel_close(int id)
+{
+	struct Channel *channel = find_channel(id);
+	if (channel == NULL)
+		return;
+
+	__atomic_store_n(&channel->is_closed, 1, __ATOMIC_RELEASE);
+	signal(&channel->items, &channel->receivers_waiting);
+	signal(&channel->spaces, &channel->senders_waiting);
+}
+
+void channel_free_all()
+{
+	int i;
+	for (i = 0; i < channel_count; i++)
+	{
+		free(channels[i]->cells);
+		free(channels[i]);
+	}
+
+	free(channels);
+	channels = NULL;
+	channel_count = 0;
+}
@@ -0,0 +1,175 @@
+#include "codec.h"
+#include <string.h>
+
+#define GEN_SIZE(type)		+ SIZE_##type
+#define GEN_LENGTH(name)	1 ARGS_##name(GEN_SIZE)
+#define GEN_TYPE(type)		OPERAND_##type,
+#define GEN_OPERANDS(name)	{ ARGS_##name(GEN_TYPE) OPERAND_NONE }
+
+const unsigned char bytecode_lengths[] = { BYTECODE(GEN_LENGTH) };
+const char bytecode_operands[][OPERAND_MAX] = { BYTECODE(GEN_OPERANDS) };
+
+// Bytes taken by each operand type
+const char operand_sizes[] =
+{
+	0, SIZE_REG, SIZE_PAIR, SIZE_CONST, SIZE_ADDR,
+	SIZE_INDIRECT, SIZE_INDIRECT_PLUS, SIZE_INDIRECT_SUB,
+	SIZE_OFFSET8, SIZE_OFFSET16
+};
+
+static const char *named_registers[] =
+{
+	"PC", "SP", "FP"
+};
+
+int codec_decode(const char *code, int len, int p, struct Decoded *inst)
+{
+	int i;
+	short s;
+	unsigned short index;
+	unsigned char bytecode = code[p];
+
+	// Labels only appear before the code is linked
+	if (bytecode >= BC_SET_LABEL || p + bytecode_lengths[bytecode] > len)
+		return 0;
+
+	const char *types = bytecode_operands[bytecode];
+	inst->bytecode = bytecode;
+	inst->start = p;
+	inst->end = p + bytecode_lengths[bytecode];
+	inst->operand_count = 0;
+	p++;
+
+	for (i = 0; types[i] != OPERAND_NONE; p += operand_sizes[(int)types[i++]])
+	{
+		struct Operand *operand = &inst->operands[inst->operand_count++];
+		operand->type = types[i];
+		operand->offset = 0;
+
+		switch (types[i])
+		{
+			case OPERAND_REG: case OPERAND_INDIRECT:
+				operand->value = (unsigned char)code[p];
+				break;
+			case OPERAND_PAIR:
+				operand->type = OPERAND_REG;
+				operand->value = (unsigned char)code[p] >> 4;
+				inst->operands[inst->operand_count++] =
+					(struct Operand) { OPERAND_REG, code[p] & 15, 0 };
+				break;
+			case OPERAND_CONST:
+				memcpy(&index, code + p, sizeof(short));
+				operand->value = index;
+				break;
+			case OPERAND_ADDR:
+				memcpy(&operand->value, code + p, sizeof(int));
+				break;
+			case OPERAND_INDIRECT_PLUS: case OPERAND_INDIRECT_SUB:
+				operand->value = (unsigned char)code[p];
+				operand->offset = (unsigned char)code[p + 1];
+				break;
+
+			// Offsets are always last, from the next instruction
+			case OPERAND_OFFSET8:
+				operand->value = inst->end + (signed char)code[p];
+				break;
+			case OPERAND_OFFSET16:
+				memcpy(&s, code + p, sizeof(short));
+				operand->value = inst->end + s;
+				break;
+		}
+	}
+
+	return 1;
+}
+
+int codec_encode(const struct Decoded *inst, char *out)
+{
+	int i, p = 1, o = 0;
+	short s;
+	unsigned short index;
+	unsigned char bytecode = inst->bytecode;
+	const char *types = bytecode_operands[bytecode];
+	int end = inst->start + bytecode_lengths[bytecode];
+
+	out[0] = bytecode;
+	for (i = 0; types[i] != OPERAND_NONE; p += operand_sizes[(int)types[i++]])
+	{
+		const struct Operand *operand = &inst->operands[o++];
+		switch (types[i])
+		{
+			case OPERAND_REG: case OPERAND_INDIRECT:
+				out[p] = operand->value;
+				break;
+			case OPERAND_PAIR:
+				out[p] = (operand->value << 4) | inst->operands[o++].value;
+				break;
+			case OPERAND_CONST:
+				index = operand->value;
+				memcpy(out + p, &index, sizeof(short));
+				break;
+			case OPERAND_ADDR:
+				memcpy(out + p, &operand->value, sizeof(int));
+				break;
+			case OPERAND_INDIRECT_PLUS: case OPERAND_INDIRECT_SUB:
+				out[p] = operand->value;
+				out[p + 1] = operand->offset;
+				break;
+			case OPERAND_OFFSET8:
+				out[p] = operand->value - end;
+				break;
+			case OPERAND_OFFSET16:
+				s = operand->value - end;
+				memcpy(out + p, &s, sizeof(short));
+				break;
+		}
+	}
+
+	return p;
+}
+
+static void print_const(FILE *out, Register value)
+{
+	switch (value.type)
+	{
+		case CONST_INT: fprintf(out, "%i", value.i); break;
+		case CONST_FLOAT: fprintf(out, "%g", value.f); break;
+		case CONST_STRING: fprintf(out, "\"%s\"", value.str); break;
+		default: fprintf(out, "null"); break;
+	}
+}
+
+void codec_print(FILE *out, const struct Decoded *inst, const Register *constants)
+{
+	char reg[16];
+	int i;
+
+	const char *name = bytecode_names[(int)inst->bytecode] + 3;
+	fprintf(out, inst->operand_count > 0 ? "%6i  %-10s" : "%6i  %s", inst->start, name);
+	for (i = 0; i < inst->operand_count; i++)
+	{
+		const struct Operand *operand = &inst->operands[i];
+		if (operand->value < REGISTER_COUNT)
+			sprintf(reg, "R%i", operand->value);
+		else
+			strcpy(reg, operand->value < REGISTER_TOTAL ?
+				named_registers[operand->value - REGISTER_COUNT] : "R?");
+
+		fprintf(out, i == 0 ? " " : ", ");
+		switch (operand->type)
+		{
+			case OPERAND_REG: fprintf(out, "%s", reg); break;
+			case OPERAND_INDIRECT: fprintf(out, "[%s]", reg); break;
+			case OPERAND_INDIRECT_PLUS: fprintf(out, "[%s + %i]", reg, operand->offset); break;
+			case OPERAND_INDIRECT_SUB: fprintf(out, "[%s - %i]", reg, operand->offset); break;
+			case OPERAND_CONST:
+				if (constants != NULL)
+					print_const(out, constants[operand->value]);
+				else
+					fprintf(out, "#%i", operand->value);
+				break;
+			default: fprintf(out, "%i", operand->value); break;
+		}
+	}
+	fprintf(out, "\n");
+}
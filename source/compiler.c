@@ -0,0 +1,1607 @@
+#include "compiler.h"
+#include "tokenizer.h"
+#include "debug.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+#define NAME_SIZE	32
+#define MAX_ARGS	16
+
+// Registers, R0 holds what's printed and what's returned, the rest
+// hold variables, as many as fit the allocator's bit sets. If any are
+// spilled onto the stack, the last two are kept back for loading them
+#define FIRST_REG	1
+#define REG_COUNT	31
+#define SCRATCH_A	30
+#define SCRATCH_B	31
+
+// Tokens
+#define TOKEN_END	0
+#define TOKEN_LINE	1
+#define TOKEN_NAME	2
+#define TOKEN_NUMBER	3
+#define TOKEN_STRING	4
+#define TOKEN_SYMBOL	5
+
+// What ended a block of statements
+#define BLOCK_NONE		0
+#define BLOCK_EOF		1
+#define BLOCK_ELSE		2
+#define BLOCK_NEXT		3
+#define BLOCK_WEND		4
+#define BLOCK_END_IF		5
+#define BLOCK_END_FUNCTION	6
+#define BLOCK_END_SUB		7
+
+// Operations on virtual registers
+#define IR_CONST	0
+#define IR_MOVE		1
+#define IR_ADD		2
+#define IR_SUB		3
+#define IR_MUL		4
+#define IR_DIV		5
+#define IR_CMP		6
+#define IR_BRANCH	7
+#define IR_LABEL	8
+#define IR_PRINT	9
+#define IR_PARAM	10
+#define IR_CALL		11
+#define IR_RETURN	12
+#define IR_HALT		13
+
+// Branch conditions
+#define COND_ALWAYS	0
+#define COND_EQUAL	1
+#define COND_NOT_EQUAL	2
+#define COND_GREATER	3
+#define COND_LESS	4
+
+static const char *branch_names[] =
+{
+	"GOTO", "GOTO_IF_EQUAL", "GOTO_IF_NOT_EQUAL",
+	"GOTO_IF_GREATER_THAN", "GOTO_IF_LESS_THAN"
+};
+
+static const char *op_names[] =
+{
+	"MOVE", "MOVE", "ADD", "SUB", "MUL", "DIV", "COMPARE"
+};
+
+static const char *keywords[] =
+{
+	"LET", "PRINT", "IF", "THEN", "ELSE", "END", "FOR", "TO", "STEP",
+	"NEXT", "WHILE", "WEND", "GOSUB", "RETURN", "FUNCTION", "SUB", "REM"
+};
+
+#define KEYWORD_COUNT sizeof(keywords) / sizeof(keywords[0])
+
+struct Token
+{
+	int type;
+	int value;
+	int line;
+	char text[80];
+};
+
+// Either a virtual register, or a constant if 'reg' is -1
+struct Operand
+{
+	int reg;
+	int value;
+	char *str;
+};
+
+// An operation, the second operand is a constant if 'is_const'
+// is set. 'value' is the branch condition, param index or call
+struct Op
+{
+	int type;
+	int dst, a, b;
+	int is_const;
+	int value;
+	char *str;
+	int label;
+};
+
+struct Variable
+{
+	char name[NAME_SIZE];
+	int reg;
+};
+
+struct Call
+{
+	char name[NAME_SIZE];
+	int first_arg, arg_count;
+};
+
+struct Function
+{
+	char name[NAME_SIZE];
+	int param_count;
+	int has_result;
+
+	struct Op *ops;
+	int op_count, op_max;
+	struct Variable *variables;
+	int variable_count;
+	struct Call *calls;
+	int call_count;
+	struct Operand *args;
+	int arg_count;
+
+	int reg_count;
+	int label_count;
+};
+
+// Functions defined and called in this file, to check the arguments
+struct Definition
+{
+	char name[NAME_SIZE];
+	int arg_count, line;
+};
+static struct Definition 	*definitions;
+static int 			definition_count;
+static struct Definition 	*uses;
+static int 			use_count;
+
+// Parser state
+static struct Token 	token;
+static int 		line;
+static int 		error_line;
+static char 		next_name[NAME_SIZE];
+static struct Function 	main_function;
+static struct Function 	*current;
+
+// Generated assembly
+static char 	*out;
+static int 	out_len;
+static int 	out_max_len;
+
+// Register allocation for the function being compiled, where each
+// virtual register lives is a register number, or a stack slot if
+// it's been spilled
+static int 		*locations;
+static int 		*starts, *ends;
+static int 		*label_positions;
+static unsigned 	*live_in, *live_out;
+static int 		words;
+static int 		slot_count;
+static int 		depth;
+
+#define IS_SPILLED(reg)		(locations[reg] < 0)
+#define SLOT(reg)		(-locations[reg] - 1)
+#define BIT_SET(set, bit)	((set)[(bit) / 32] |= 1u << ((bit) % 32))
+#define BIT_TEST(set, bit)	((set)[(bit) / 32] >> ((bit) % 32) & 1)
+
+static void emit(const char *format, ...)
+{
+	char buffer[256];
+	va_list args;
+
+	va_start(args, format);
+	int len = vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+
+	if (out_len + len + 1 > out_max_len)
+	{
+		out_max_len = (out_len + len + 1) * 2;
+		out = realloc(out, out_max_len);
+	}
+
+	memcpy(out + out_len, buffer, len + 1);
+	out_len += len;
+}
+
+static void syntax_error(const char *message)
+{
+	// Only report the first error on each line
+	if (token.line == error_line)
+		return;
+
+	ERROR("Line %i: %s", token.line, message);
+	error_line = token.line;
+}
+
+static char *copy_string(const char *str)
+{
+	char *copy = malloc(strlen(str) + 1);
+	strcpy(copy, str);
+	return copy;
+}
+
+static void skip_comment()
+{
+	char c;
+	while ((c = tokenizer_next()) != '\n' && tokenizer_has_next())
+		continue;
+	tokenizer_push_back(c);
+}
+
+static void next_token()
+{
+	char c;
+	int i = 0;
+
+	// Skip spaces and comments, but not the ends of lines
+	while ((c = tokenizer_next()) == ' ' || c == '\t' || c == '\r' || c == '\'')
+		if (c == '\'')
+			skip_comment();
+
+	token.line = line;
+	token.text[0] = '\0';
+	if (!tokenizer_has_next())
+	{
+		token.type = TOKEN_END;
+		return;
+	}
+
+	if (c == '\n')
+	{
+		token.type = TOKEN_LINE;
+		line++;
+		return;
+	}
+
+	if (isdigit(c))
+	{
+		token.type = TOKEN_NUMBER;
+		token.value = 0;
+		for (; isdigit(c); c = tokenizer_next())
+			token.value = token.value * 10 + c - '0';
+		tokenizer_push_back(c);
+		return;
+	}
+
+	if (isalpha(c))
+	{
+		token.type = TOKEN_NAME;
+		for (; isalpha(c) || isdigit(c) || c == '_'; c = tokenizer_next())
+			if (i < NAME_SIZE - 1)
+				token.text[i++] = c;
+		token.text[i] = '\0';
+		tokenizer_push_back(c);
+
+		// Remarks go to the end of the line
+		if (!strcmp(token.text, "REM"))
+		{
+			skip_comment();
+			next_token();
+		}
+		return;
+	}
+
+	if (c == '"')
+	{
+		token.type = TOKEN_STRING;
+		while ((c = tokenizer_next()) != '"' && c != '\n' && tokenizer_has_next())
+			if (i < 79)
+				token.text[i++] = c;
+		token.text[i] = '\0';
+
+		if (c != '"')
+		{
+			syntax_error("Unterminated string");
+			tokenizer_push_back(c);
+		}
+		return;
+	}
+
+	// Symbols, with '<>', '<=' and '>=' as one
+	token.type = TOKEN_SYMBOL;
+	token.text[0] = c;
+	token.text[1] = '\0';
+	if (c == '<' || c == '>')
+	{
+		char next = tokenizer_next();
+		if (next == '=' || (c == '<' && next == '>'))
+		{
+			token.text[1] = next;
+			token.text[2] = '\0';
+		}
+		else
+		{
+			tokenizer_push_back(next);
+		}
+	}
+}
+
+static int is_symbol(const char *symbol)
+{
+	return token.type == TOKEN_SYMBOL && !strcmp(token.text, symbol);
+}
+
+static int is_keyword(const char *keyword)
+{
+	return token.type == TOKEN_NAME && !strcmp(token.text, keyword);
+}
+
+static int is_reserved(const char *name)
+{
+	int i;
+	for (i = 0; i < KEYWORD_COUNT; i++)
+		if (!strcmp(name, keywords[i]))
+			return 1;
+	return 0;
+}
+
+static int is_end_of_line()
+{
+	return token.type == TOKEN_LINE || token.type == TOKEN_END;
+}
+
+static void skip_line()
+{
+	while (!is_end_of_line())
+		next_token();
+}
+
+static int expect_symbol(const char *symbol)
+{
+	char message[80];
+	if (is_symbol(symbol))
+	{
+		next_token();
+		return 1;
+	}
+
+	sprintf(message, "Expected '%s'", symbol);
+	syntax_error(message);
+	return 0;
+}
+
+static int expect_keyword(const char *keyword)
+{
+	char message[80];
+	if (is_keyword(keyword))
+	{
+		next_token();
+		return 1;
+	}
+
+	sprintf(message, "Expected %s", keyword);
+	syntax_error(message);
+	return 0;
+}
+
+static int expect_name(char *out)
+{
+	if (token.type != TOKEN_NAME || is_reserved(token.text))
+	{
+		syntax_error("Expected a name");
+		return 0;
+	}
+
+	strcpy(out, token.text);
+	next_token();
+	return 1;
+}
+
+static void add_definition(struct Definition **list, int *count, const char *name, int arg_count)
+{
+	*list = realloc(*list, sizeof(struct Definition) * (*count + 1));
+	strcpy((*list)[*count].name, name);
+	(*list)[*count].arg_count = arg_count;
+	(*list)[*count].line = token.line;
+	(*count)++;
+}
+
+static struct Op *add_op(int type)
+{
+	struct Function *f = current;
+	if (f->op_count >= f->op_max)
+	{
+		f->op_max = f->op_max * 2 + 16;
+		f->ops = realloc(f->ops, sizeof(struct Op) * f->op_max);
+	}
+
+	struct Op *op = &f->ops[f->op_count++];
+	memset(op, 0, sizeof(struct Op));
+	op->type = type;
+	op->dst = op->a = op->b = -1;
+	return op;
+}
+
+static int new_reg()
+{
+	return current->reg_count++;
+}
+
+static int new_label()
+{
+	return current->label_count++;
+}
+
+static void add_label(int label)
+{
+	add_op(IR_LABEL)->label = label;
+}
+
+static void add_branch(int condition, int label)
+{
+	struct Op *op = add_op(IR_BRANCH);
+	op->value = condition;
+	op->label = label;
+}
+
+static struct Operand constant(int value)
+{
+	struct Operand operand = { -1, value, NULL };
+	return operand;
+}
+
+static struct Operand in_reg(int reg)
+{
+	struct Operand operand = { reg, 0, NULL };
+	return operand;
+}
+
+// Sets the first operand of 'op', or the constant in its place
+static void set_operand(struct Op *op, struct Operand operand)
+{
+	if (operand.reg == -1)
+	{
+		op->is_const = 1;
+		op->value = operand.value;
+		op->str = operand.str;
+	}
+	else
+	{
+		op->a = operand.reg;
+	}
+}
+
+// Puts an operand in a register, loading it if it's a constant
+static int to_reg(struct Operand operand)
+{
+	if (operand.reg != -1)
+		return operand.reg;
+
+	struct Op *op = add_op(IR_CONST);
+	op->dst = new_reg();
+	op->value = operand.value;
+	op->str = operand.str;
+	return op->dst;
+}
+
+static int find_variable(const char *name)
+{
+	int i;
+	for (i = 0; i < current->variable_count; i++)
+		if (!strcmp(current->variables[i].name, name))
+			return current->variables[i].reg;
+	return -1;
+}
+
+static int is_variable(int reg)
+{
+	int i;
+	for (i = 0; i < current->variable_count; i++)
+		if (current->variables[i].reg == reg)
+			return 1;
+	return 0;
+}
+
+// Finds a variable, creating it the first time it's assigned
+static int variable_reg(const char *name)
+{
+	struct Function *f = current;
+	int reg = find_variable(name);
+	if (reg != -1)
+		return reg;
+
+	f->variables = realloc(f->variables, sizeof(struct Variable) * (f->variable_count + 1));
+	strcpy(f->variables[f->variable_count].name, name);
+	f->variables[f->variable_count].reg = new_reg();
+	return f->variables[f->variable_count++].reg;
+}
+
+static void assign(int reg, struct Operand value)
+{
+	struct Function *f = current;
+	struct Op *last = f->op_count > 0 ? &f->ops[f->op_count - 1] : NULL;
+
+	// If the value was just worked out, write it straight to the variable
+	if (value.reg != -1 && last != NULL && last->dst == value.reg && !is_variable(value.reg))
+	{
+		last->dst = reg;
+		return;
+	}
+
+	struct Op *op = add_op(value.reg == -1 ? IR_CONST : IR_MOVE);
+	op->dst = reg;
+	set_operand(op, value);
+}
+
+static int fold(int type, int a, int b)
+{
+	switch (type)
+	{
+		case IR_ADD: return a + b;
+		case IR_SUB: return a - b;
+		case IR_MUL: return a * b;
+		case IR_DIV: return b == 0 ? 0 : a / b;
+	}
+	return 0;
+}
+
+static struct Operand binary(int type, struct Operand a, struct Operand b)
+{
+	if (a.str != NULL || b.str != NULL)
+	{
+		syntax_error("Strings can't be used in arithmetic");
+		return constant(0);
+	}
+
+	if (a.reg == -1 && b.reg == -1)
+		return constant(fold(type, a.value, b.value));
+
+	// Constants go second, where the order doesn't matter
+	if (a.reg == -1 && (type == IR_ADD || type == IR_MUL))
+	{
+		struct Operand temp = a;
+		a = b;
+		b = temp;
+	}
+
+	int reg = to_reg(a);
+	struct Op *op = add_op(type);
+	op->a = reg;
+	op->dst = new_reg();
+	if (b.reg == -1)
+	{
+		op->is_const = 1;
+		op->value = b.value;
+	}
+	else
+	{
+		op->b = b.reg;
+	}
+
+	return in_reg(op->dst);
+}
+
+static struct Operand parse_sum();
+
+// Calls a function, the result is only kept if it's used
+static struct Operand parse_call(const char *name, int is_used)
+{
+	struct Function *f = current;
+	struct Operand args[MAX_ARGS];
+	int i, arg_count = 0;
+
+	// Arguments are all worked out before being added, as they may
+	// make calls of their own
+	if (is_symbol("("))
+	{
+		next_token();
+		while (!is_symbol(")") && !is_end_of_line())
+		{
+			struct Operand arg = parse_sum();
+			if (arg_count < MAX_ARGS)
+				args[arg_count++] = arg;
+			else
+				syntax_error("Too many arguments");
+
+			if (!is_symbol(","))
+				break;
+			next_token();
+		}
+		expect_symbol(")");
+	}
+
+	f->calls = realloc(f->calls, sizeof(struct Call) * (f->call_count + 1));
+	f->args = realloc(f->args, sizeof(struct Operand) * (f->arg_count + arg_count));
+	struct Call *call = &f->calls[f->call_count];
+	strcpy(call->name, name);
+	call->first_arg = f->arg_count;
+	call->arg_count = arg_count;
+	for (i = 0; i < arg_count; i++)
+		f->args[f->arg_count++] = args[i];
+	add_definition(&uses, &use_count, name, arg_count);
+
+	struct Op *op = add_op(IR_CALL);
+	op->value = f->call_count++;
+	if (is_used)
+		op->dst = new_reg();
+	return in_reg(op->dst);
+}
+
+static struct Operand parse_primary()
+{
+	struct Operand operand = constant(0);
+	char name[NAME_SIZE], message[80];
+
+	if (token.type == TOKEN_NUMBER)
+	{
+		operand.value = token.value;
+		next_token();
+		return operand;
+	}
+
+	if (token.type == TOKEN_STRING)
+	{
+		operand.str = copy_string(token.text);
+		next_token();
+		return operand;
+	}
+
+	if (is_symbol("("))
+	{
+		next_token();
+		operand = parse_sum();
+		expect_symbol(")");
+		return operand;
+	}
+
+	if (is_symbol("-"))
+	{
+		next_token();
+		return binary(IR_SUB, constant(0), parse_primary());
+	}
+
+	if (token.type == TOKEN_NAME && !is_reserved(token.text))
+	{
+		strcpy(name, token.text);
+		next_token();
+		if (is_symbol("("))
+			return parse_call(name, 1);
+
+		operand.reg = find_variable(name);
+		if (operand.reg == -1)
+		{
+			sprintf(message, "Unknown variable '%s'", name);
+			syntax_error(message);
+			return constant(0);
+		}
+		return operand;
+	}
+
+	syntax_error("Expected a value");
+	return operand;
+}
+
+static struct Operand parse_term()
+{
+	struct Operand operand = parse_primary();
+	while (is_symbol("*") || is_symbol("/"))
+	{
+		int type = is_symbol("*") ? IR_MUL : IR_DIV;
+		next_token();
+		operand = binary(type, operand, parse_primary());
+	}
+
+	return operand;
+}
+
+static struct Operand parse_sum()
+{
+	struct Operand operand = parse_term();
+	while (is_symbol("+") || is_symbol("-"))
+	{
+		int type = is_symbol("+") ? IR_ADD : IR_SUB;
+		next_token();
+		operand = binary(type, operand, parse_term());
+	}
+
+	return operand;
+}
+
+// Compiles a condition, jumping to 'false_label' if it doesn't hold.
+// Without a comparison, it holds if the value isn't 0
+static void parse_condition(int false_label)
+{
+	static const char *relations[] = { "=", "<>", "<", ">", "<=", ">=" };
+	static const int mirrored[] = { 0, 1, 3, 2, 5, 4 };
+	struct Operand a = parse_sum(), b = constant(0);
+	int i, relation = 1;
+
+	for (i = 0; i < 6; i++)
+	{
+		if (is_symbol(relations[i]))
+		{
+			next_token();
+			relation = i;
+			b = parse_sum();
+			break;
+		}
+	}
+
+	if (a.str != NULL || b.str != NULL)
+	{
+		syntax_error("Strings can't be compared");
+		return;
+	}
+
+	if (a.reg == -1 && b.reg == -1)
+	{
+		int holds[] = { a.value == b.value, a.value != b.value, a.value < b.value,
+			a.value > b.value, a.value <= b.value, a.value >= b.value };
+		if (!holds[relation])
+			add_branch(COND_ALWAYS, false_label);
+		return;
+	}
+
+	// Constants go second, so mirror the comparison
+	if (a.reg == -1)
+	{
+		struct Operand temp = a;
+		a = b;
+		b = temp;
+		relation = mirrored[relation];
+	}
+
+	struct Op *op = add_op(IR_CMP);
+	op->a = a.reg;
+	if (b.reg == -1)
+	{
+		op->is_const = 1;
+		op->value = b.value;
+	}
+	else
+	{
+		op->b = b.reg;
+	}
+
+	switch (relation)
+	{
+		case 0: add_branch(COND_NOT_EQUAL, false_label); break;
+		case 1: add_branch(COND_EQUAL, false_label); break;
+		case 2: add_branch(COND_GREATER, false_label); add_branch(COND_EQUAL, false_label); break;
+		case 3: add_branch(COND_LESS, false_label); add_branch(COND_EQUAL, false_label); break;
+		case 4: add_branch(COND_GREATER, false_label); break;
+		case 5: add_branch(COND_LESS, false_label); break;
+	}
+}
+
+static int parse_block();
+static int parse_statement();
+
+static void expect_end(int end, int expected, const char *name)
+{
+	char message[80];
+	if (end == expected)
+		return;
+
+	sprintf(message, "Expected %s", name);
+	syntax_error(message);
+}
+
+static void parse_assignment(const char *name)
+{
+	if (!expect_symbol("="))
+		return;
+
+	// The variable is only made after its value, so it can't be used in it
+	struct Operand value = parse_sum();
+	assign(variable_reg(name), value);
+}
+
+static void parse_print()
+{
+	do
+	{
+		next_token();
+		struct Operand value = parse_sum();
+		set_operand(add_op(IR_PRINT), value);
+	} while (is_symbol(","));
+}
+
+static void parse_if()
+{
+	int else_label = new_label();
+	int end_label, end;
+
+	next_token();
+	parse_condition(else_label);
+	if (!expect_keyword("THEN"))
+		return;
+
+	// 'IF c THEN statement [ELSE statement]' on one line
+	if (!is_end_of_line())
+	{
+		if (parse_statement() != BLOCK_NONE)
+			syntax_error("Expected a statement");
+
+		if (is_keyword("ELSE"))
+		{
+			next_token();
+			end_label = new_label();
+			add_branch(COND_ALWAYS, end_label);
+			add_label(else_label);
+			if (parse_statement() != BLOCK_NONE)
+				syntax_error("Expected a statement");
+			add_label(end_label);
+			return;
+		}
+
+		add_label(else_label);
+		return;
+	}
+
+	end = parse_block();
+	if (end == BLOCK_ELSE)
+	{
+		end_label = new_label();
+		add_branch(COND_ALWAYS, end_label);
+		add_label(else_label);
+		end = parse_block();
+		add_label(end_label);
+	}
+	else
+	{
+		add_label(else_label);
+	}
+
+	expect_end(end, BLOCK_END_IF, "END IF");
+}
+
+static void parse_for()
+{
+	char name[NAME_SIZE];
+	int step = 1;
+
+	next_token();
+	if (!expect_name(name) || !expect_symbol("="))
+		return;
+
+	struct Operand start = parse_sum();
+	if (!expect_keyword("TO"))
+		return;
+
+	struct Operand limit = parse_sum();
+	if (is_keyword("STEP"))
+	{
+		next_token();
+		struct Operand value = parse_sum();
+		if (value.reg != -1 || value.str != NULL || value.value == 0)
+			syntax_error("STEP must be a constant other than 0");
+		else
+			step = value.value;
+	}
+
+	if (start.str != NULL || limit.str != NULL)
+	{
+		syntax_error("Strings can't be used in FOR");
+		return;
+	}
+
+	int counter = variable_reg(name);
+	assign(counter, start);
+
+	// The limit is only worked out once
+	if (limit.reg != -1 && is_variable(limit.reg))
+	{
+		struct Op *op = add_op(IR_MOVE);
+		op->a = limit.reg;
+		op->dst = limit.reg = new_reg();
+	}
+
+	int top = new_label(), exit = new_label();
+	add_label(top);
+	struct Op *op = add_op(IR_CMP);
+	op->a = counter;
+	if (limit.reg == -1)
+	{
+		op->is_const = 1;
+		op->value = limit.value;
+	}
+	else
+	{
+		op->b = limit.reg;
+	}
+	add_branch(step > 0 ? COND_GREATER : COND_LESS, exit);
+
+	int end = parse_block();
+	expect_end(end, BLOCK_NEXT, "NEXT");
+	if (end == BLOCK_NEXT && next_name[0] != '\0' && strcmp(next_name, name))
+		syntax_error("NEXT doesn't match FOR");
+
+	op = add_op(IR_ADD);
+	op->dst = op->a = counter;
+	op->is_const = 1;
+	op->value = step;
+	add_branch(COND_ALWAYS, top);
+	add_label(exit);
+}
+
+static void parse_while()
+{
+	int top = new_label(), exit = new_label();
+
+	next_token();
+	add_label(top);
+	parse_condition(exit);
+	expect_end(parse_block(), BLOCK_WEND, "WEND");
+	add_branch(COND_ALWAYS, top);
+	add_label(exit);
+}
+
+static void parse_return()
+{
+	struct Function *f = current;
+
+	next_token();
+	if (f == &main_function)
+	{
+		syntax_error("RETURN outside of a FUNCTION or SUB");
+		skip_line();
+		return;
+	}
+
+	if (!is_end_of_line() && !is_keyword("ELSE"))
+	{
+		struct Operand value = parse_sum();
+		if (!f->has_result)
+			syntax_error("A SUB can't return a value");
+		set_operand(add_op(IR_RETURN), value);
+		return;
+	}
+
+	// Functions return 0 if not given a value
+	set_operand(add_op(IR_RETURN), f->has_result ? constant(0) : in_reg(-1));
+}
+
+static void compile_function(struct Function *f);
+static void free_function(struct Function *f);
+
+static void parse_function(int has_result)
+{
+	struct Function function;
+	char params[MAX_ARGS][NAME_SIZE];
+	int i;
+
+	next_token();
+	if (current != &main_function)
+	{
+		syntax_error("Functions can't be nested");
+		skip_line();
+		return;
+	}
+
+	memset(&function, 0, sizeof(struct Function));
+	function.has_result = has_result;
+	if (!expect_name(function.name))
+	{
+		skip_line();
+		return;
+	}
+
+	if (is_symbol("("))
+	{
+		next_token();
+		while (token.type == TOKEN_NAME && function.param_count < MAX_ARGS)
+		{
+			expect_name(params[function.param_count++]);
+			if (!is_symbol(","))
+				break;
+			next_token();
+		}
+		expect_symbol(")");
+	}
+	add_definition(&definitions, &definition_count, function.name, function.param_count);
+
+	// Parameters are copied out of the caller's stack
+	current = &function;
+	for (i = 0; i < function.param_count; i++)
+	{
+		struct Op *op = add_op(IR_PARAM);
+		op->dst = variable_reg(params[i]);
+		op->value = i;
+	}
+
+	int end = parse_block();
+	if (has_result)
+		expect_end(end, BLOCK_END_FUNCTION, "END FUNCTION");
+	else
+		expect_end(end, BLOCK_END_SUB, "END SUB");
+	set_operand(add_op(IR_RETURN), has_result ? constant(0) : in_reg(-1));
+
+	compile_function(&function);
+	free_function(&function);
+	current = &main_function;
+}
+
+// Parses one statement, or returns what ended the block it's in
+static int parse_statement()
+{
+	char name[NAME_SIZE], message[80];
+
+	if (token.type != TOKEN_NAME)
+	{
+		syntax_error("Expected a statement");
+		skip_line();
+		return BLOCK_NONE;
+	}
+
+	if (is_keyword("LET"))
+	{
+		next_token();
+		if (expect_name(name))
+			parse_assignment(name);
+	}
+	else if (is_keyword("PRINT")) parse_print();
+	else if (is_keyword("IF")) parse_if();
+	else if (is_keyword("FOR")) parse_for();
+	else if (is_keyword("WHILE")) parse_while();
+	else if (is_keyword("RETURN")) parse_return();
+	else if (is_keyword("FUNCTION")) parse_function(1);
+	else if (is_keyword("SUB")) parse_function(0);
+	else if (is_keyword("GOSUB"))
+	{
+		next_token();
+		if (expect_name(name))
+			parse_call(name, 0);
+	}
+	else if (is_keyword("ELSE"))
+	{
+		next_token();
+		return BLOCK_ELSE;
+	}
+	else if (is_keyword("WEND"))
+	{
+		next_token();
+		return BLOCK_WEND;
+	}
+	else if (is_keyword("NEXT"))
+	{
+		next_token();
+		next_name[0] = '\0';
+		if (token.type == TOKEN_NAME)
+			expect_name(next_name);
+		return BLOCK_NEXT;
+	}
+	else if (is_keyword("END"))
+	{
+		// 'END' on its own stops the program
+		next_token();
+		if (is_keyword("IF") || is_keyword("FUNCTION") || is_keyword("SUB"))
+		{
+			int end = is_keyword("IF") ? BLOCK_END_IF :
+				is_keyword("FUNCTION") ? BLOCK_END_FUNCTION : BLOCK_END_SUB;
+			next_token();
+			return end;
+		}
+		add_op(IR_HALT);
+	}
+	else if (is_reserved(token.text))
+	{
+		sprintf(message, "Unexpected %s", token.text);
+		syntax_error(message);
+		skip_line();
+	}
+	else
+	{
+		strcpy(name, token.text);
+		next_token();
+		if (is_symbol("("))
+			parse_call(name, 0);
+		else
+			parse_assignment(name);
+	}
+
+	return BLOCK_NONE;
+}
+
+static int parse_block()
+{
+	for (;;)
+	{
+		while (token.type == TOKEN_LINE)
+			next_token();
+		if (token.type == TOKEN_END)
+			return BLOCK_EOF;
+
+		int end = parse_statement();
+		if (end != BLOCK_NONE)
+			return end;
+
+		if (!is_end_of_line())
+		{
+			syntax_error("Expected the end of the line");
+			skip_line();
+		}
+	}
+}
+
+// Virtual registers read by an operation, returns how many
+static int op_uses(struct Function *f, struct Op *op, int *out)
+{
+	int i, count = 0;
+
+	if (op->a != -1)
+		out[count++] = op->a;
+	if (op->b != -1)
+		out[count++] = op->b;
+
+	if (op->type == IR_CALL)
+	{
+		struct Call *call = &f->calls[op->value];
+		for (i = 0; i < call->arg_count; i++)
+			if (f->args[call->first_arg + i].reg != -1)
+				out[count++] = f->args[call->first_arg + i].reg;
+	}
+
+	return count;
+}
+
+// Operations that can run after the one at 'i', returns how many
+static int op_successors(struct Function *f, int i, int *out)
+{
+	struct Op *op = &f->ops[i];
+	int count = 0;
+
+	switch (op->type)
+	{
+		case IR_RETURN: case IR_HALT:
+			return 0;
+		case IR_BRANCH:
+			out[count++] = label_positions[op->label];
+			if (op->value == COND_ALWAYS)
+				return count;
+			break;
+	}
+
+	if (i + 1 < f->op_count)
+		out[count++] = i + 1;
+	return count;
+}
+
+static void extend_interval(int reg, int i)
+{
+	if (starts[reg] == -1 || i < starts[reg])
+		starts[reg] = i;
+	if (i > ends[reg])
+		ends[reg] = i;
+}
+
+// Works out which virtual registers are live before and after each
+// operation, then the range of operations each one is live over
+static void find_live_ranges(struct Function *f)
+{
+	int i, j, k, is_changed = 1;
+	int uses[MAX_ARGS + 2], next[2];
+	unsigned *in = malloc(sizeof(unsigned) * words);
+
+	live_in = calloc(f->op_count * words, sizeof(unsigned));
+	live_out = calloc(f->op_count * words, sizeof(unsigned));
+	while (is_changed)
+	{
+		is_changed = 0;
+		for (i = f->op_count - 1; i >= 0; i--)
+		{
+			struct Op *op = &f->ops[i];
+			unsigned *op_out = live_out + i * words;
+			int next_count = op_successors(f, i, next);
+
+			for (j = 0; j < words; j++)
+			{
+				op_out[j] = 0;
+				for (k = 0; k < next_count; k++)
+					op_out[j] |= live_in[next[k] * words + j];
+			}
+
+			// Live in is what's read, and what's live out that isn't written
+			memcpy(in, op_out, sizeof(unsigned) * words);
+			if (op->dst != -1)
+				in[op->dst / 32] &= ~(1u << (op->dst % 32));
+
+			int use_count = op_uses(f, op, uses);
+			for (j = 0; j < use_count; j++)
+				BIT_SET(in, uses[j]);
+
+			if (memcmp(in, live_in + i * words, sizeof(unsigned) * words))
+			{
+				memcpy(live_in + i * words, in, sizeof(unsigned) * words);
+				is_changed = 1;
+			}
+		}
+	}
+
+	for (i = 0; i < f->reg_count; i++)
+		starts[i] = ends[i] = -1;
+
+	for (i = 0; i < f->op_count; i++)
+	{
+		for (j = 0; j < words; j++)
+		{
+			unsigned bits = live_in[i * words + j] | live_out[i * words + j];
+			while (bits)
+			{
+				extend_interval(j * 32 + __builtin_ctz(bits), i);
+				bits &= bits - 1;
+			}
+		}
+
+		if (f->ops[i].dst != -1)
+			extend_interval(f->ops[i].dst, i);
+	}
+
+	free(in);
+}
+
+static int compare_starts(const void *a, const void *b)
+{
+	return starts[*(const int*)a] - starts[*(const int*)b];
+}
+
+// Gives each virtual register one of 'count' registers by linear
+// scan, spilling the one live the longest when they run out. Returns
+// how many were spilled
+static int allocate_registers(struct Function *f, int count)
+{
+	int *order = malloc(sizeof(int) * (f->reg_count + 1));
+	int active[REG_COUNT], active_count = 0;
+	unsigned free_regs = (1u << count) - 1;
+	int i, j, order_count = 0, spilled = 0;
+
+	for (i = 0; i < f->reg_count; i++)
+	{
+		locations[i] = 0;
+		if (starts[i] != -1)
+			order[order_count++] = i;
+	}
+	qsort(order, order_count, sizeof(int), compare_starts);
+
+	slot_count = 0;
+	for (i = 0; i < order_count; i++)
+	{
+		int reg = order[i];
+
+		// Free the registers of anything no longer live
+		for (j = 0; j < active_count;)
+		{
+			if (ends[active[j]] < starts[reg])
+			{
+				free_regs |= 1u << (locations[active[j]] - FIRST_REG);
+				active[j] = active[--active_count];
+				continue;
+			}
+			j++;
+		}
+
+		if (active_count < count)
+		{
+			int free_reg = __builtin_ctz(free_regs);
+			free_regs &= ~(1u << free_reg);
+			locations[reg] = FIRST_REG + free_reg;
+			active[active_count++] = reg;
+			continue;
+		}
+
+		int last = 0;
+		for (j = 1; j < active_count; j++)
+			if (ends[active[j]] > ends[active[last]])
+				last = j;
+
+		if (ends[active[last]] > ends[reg])
+		{
+			locations[reg] = locations[active[last]];
+			locations[active[last]] = -(++slot_count);
+			active[last] = reg;
+		}
+		else
+		{
+			locations[reg] = -(++slot_count);
+		}
+		spilled++;
+	}
+
+	free(order);
+	return spilled;
+}
+
+static int stack_offset(int offset)
+{
+	if (offset > 127)
+	{
+		ERROR("Too many variables spilled to the stack");
+		return 127;
+	}
+	return offset;
+}
+
+// Offset from SP to a spilled register's slot
+static int slot_offset(int reg)
+{
+	return stack_offset(depth - SLOT(reg));
+}
+
+// Returns the register holding 'reg', loading it into 'scratch' if
+// it's been spilled
+static int load(int reg, int scratch)
+{
+	if (!IS_SPILLED(reg))
+		return locations[reg];
+
+	emit("\tMOVE R%i [SP-%i]\n", scratch, slot_offset(reg));
+	return scratch;
+}
+
+// Returns the register to write 'reg' to, store it after
+static int target(int reg, int scratch)
+{
+	return IS_SPILLED(reg) ? scratch : locations[reg];
+}
+
+static void store(int reg, int from)
+{
+	if (IS_SPILLED(reg))
+		emit("\tMOVE [SP-%i] R%i\n", slot_offset(reg), from);
+}
+
+static void constant_text(char *out, int value, const char *str)
+{
+	if (str != NULL)
+		sprintf(out, "\"%s\"", str);
+	else
+		sprintf(out, "%i", value);
+}
+
+// Moves an operation's first operand into R0
+static void emit_r0(struct Op *op)
+{
+	char text[96];
+	if (op->is_const)
+	{
+		constant_text(text, op->value, op->str);
+		emit("\tMOVE R0 %s\n", text);
+	}
+	else if (op->a != -1)
+	{
+		int a = load(op->a, 0);
+		if (a != 0)
+			emit("\tMOVE R0 R%i\n", a);
+	}
+}
+
+// Saves the registers still needed after the call, then pushes the
+// arguments. The callee finds them just below its FP
+static void emit_call(struct Function *f, int i)
+{
+	struct Op *op = &f->ops[i];
+	struct Call *call = &f->calls[op->value];
+	unsigned *op_out = live_out + i * words;
+	unsigned saved = 0;
+	char text[96];
+	int j;
+
+	for (j = 0; j < f->reg_count; j++)
+		if (BIT_TEST(op_out, j) && j != op->dst && locations[j] > 0)
+			saved |= 1u << locations[j];
+
+	for (j = 0; j <= REG_COUNT; j++)
+	{
+		if (saved >> j & 1)
+		{
+			emit("\tPUSH R%i\n", j);
+			depth++;
+		}
+	}
+
+	for (j = 0; j < call->arg_count; j++)
+	{
+		struct Operand arg = f->args[call->first_arg + j];
+		if (arg.reg == -1)
+		{
+			constant_text(text, arg.value, arg.str);
+			emit("\tPUSH %s\n", text);
+		}
+		else
+		{
+			emit("\tPUSH R%i\n", load(arg.reg, SCRATCH_A));
+		}
+		depth++;
+	}
+
+	emit("\tCALL %s\n", call->name);
+	if (op->dst != -1)
+	{
+		if (IS_SPILLED(op->dst))
+			store(op->dst, 0);
+		else
+			emit("\tMOVE R%i R0\n", locations[op->dst]);
+	}
+
+	for (j = 0; j < call->arg_count; j++, depth--)
+		emit("\tPOP R0\n");
+	for (j = REG_COUNT; j >= 0; j--)
+	{
+		if (saved >> j & 1)
+		{
+			emit("\tPOP R%i\n", j);
+			depth--;
+		}
+	}
+}
+
+static void emit_op(struct Function *f, int i)
+{
+	struct Op *op = &f->ops[i];
+	char text[96];
+	int a, b, d;
+
+	switch (op->type)
+	{
+		case IR_LABEL:
+			emit("_%s_%i:\n", f->name, op->label);
+			break;
+
+		case IR_BRANCH:
+			emit("\t%s _%s_%i\n", branch_names[op->value], f->name, op->label);
+			break;
+
+		case IR_CONST:
+			constant_text(text, op->value, op->str);
+			if (IS_SPILLED(op->dst))
+				emit("\tMOVE [SP-%i] %s\n", slot_offset(op->dst), text);
+			else
+				emit("\tMOVE R%i %s\n", locations[op->dst], text);
+			break;
+
+		case IR_MOVE:
+			a = load(op->a, SCRATCH_A);
+			if (IS_SPILLED(op->dst))
+				store(op->dst, a);
+			else if (locations[op->dst] != a)
+				emit("\tMOVE R%i R%i\n", locations[op->dst], a);
+			break;
+
+		case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV:
+			a = load(op->a, SCRATCH_A);
+			if (op->is_const)
+			{
+				d = target(op->dst, SCRATCH_A);
+				emit("\t%s R%i R%i %i\n", op_names[op->type], d, a, op->value);
+			}
+			else
+			{
+				b = load(op->b, SCRATCH_B);
+				d = target(op->dst, SCRATCH_A);
+				emit("\t%s R%i R%i R%i\n", op_names[op->type], d, a, b);
+			}
+			store(op->dst, d);
+			break;
+
+		case IR_CMP:
+			a = load(op->a, SCRATCH_A);
+			if (op->is_const)
+				emit("\tCOMPARE R%i %i\n", a, op->value);
+			else
+				emit("\tCOMPARE R%i R%i\n", a, load(op->b, SCRATCH_B));
+			break;
+
+		case IR_PRINT:
+			emit_r0(op);
+			emit("\tINTERUPT #0\n");
+			break;
+
+		case IR_PARAM:
+			d = target(op->dst, SCRATCH_A);
+			emit("\tMOVE R%i [FP-%i]\n", d,
+				stack_offset(f->param_count - op->value));
+			store(op->dst, d);
+			break;
+
+		case IR_CALL:
+			emit_call(f, i);
+			break;
+
+		case IR_RETURN:
+			emit_r0(op);
+			if (slot_count > 0)
+				emit("\tLEAVE\n");
+			emit("\tRETURN\n");
+			break;
+
+		case IR_HALT:
+			emit("\tHULT\n");
+			break;
+	}
+}
+
+static void compile_function(struct Function *f)
+{
+	int i;
+
+	label_positions = malloc(sizeof(int) * (f->label_count + 1));
+	for (i = 0; i < f->op_count; i++)
+		if (f->ops[i].type == IR_LABEL)
+			label_positions[f->ops[i].label] = i;
+
+	words = f->reg_count / 32 + 1;
+	locations = malloc(sizeof(int) * (f->reg_count + 1));
+	starts = malloc(sizeof(int) * (f->reg_count + 1));
+	ends = malloc(sizeof(int) * (f->reg_count + 1));
+	find_live_ranges(f);
+
+	// If anything is spilled, keep back registers for loading it
+	int spilled = allocate_registers(f, REG_COUNT);
+	if (spilled > 0)
+		spilled = allocate_registers(f, SCRATCH_A - FIRST_REG);
+	LOG("Compiled '%s', %i values, %i spilled\n", f->name, f->reg_count, spilled);
+
+	// Make room for the spilled values, then the code
+	emit("%s:\n", f->name);
+	if (slot_count > 0)
+		emit("\tENTER #%i\n", slot_count);
+	depth = slot_count;
+	for (i = 0; i < f->op_count; i++)
+		emit_op(f, i);
+	emit("\n");
+
+	free(label_positions);
+	free(locations);
+	free(starts);
+	free(ends);
+	free(live_in);
+	free(live_out);
+}
+
+static void free_function(struct Function *f)
+{
+	int i;
+	for (i = 0; i < f->op_count; i++)
+		free(f->ops[i].str);
+	for (i = 0; i < f->arg_count; i++)
+		free(f->args[i].str);
+
+	free(f->ops);
+	free(f->variables);
+	free(f->calls);
+	free(f->args);
+}
+
+// Checks calls to functions in this file have the right arguments
+static void check_calls()
+{
+	int i, j;
+	for (i = 0; i < use_count; i++)
+	{
+		for (j = 0; j < definition_count; j++)
+		{
+			if (!strcmp(uses[i].name, definitions[j].name) &&
+				uses[i].arg_count != definitions[j].arg_count)
+			{
+				ERROR("Line %i: '%s' takes %i arguments", uses[i].line,
+					definitions[j].name, definitions[j].arg_count);
+			}
+		}
+	}
+}
+
+char *compiler_compile(const char *file_path)
+{
+	out = NULL;
+	out_len = 0;
+	out_max_len = 0;
+	emit("");
+
+	definitions = NULL;
+	uses = NULL;
+	definition_count = 0;
+	use_count = 0;
+	line = 1;
+	error_line = 0;
+
+	// Statements outside of functions are the program's entry point
+	memset(&main_function, 0, sizeof(struct Function));
+	strcpy(main_function.name, "start");
+	current = &main_function;
+
+	tokenizer_open(file_path);
+	next_token();
+	while (parse_block() != BLOCK_EOF)
+		syntax_error("Unexpected end of block");
+	add_op(IR_HALT);
+	compile_function(&main_function);
+	tokenizer_close();
+
+	check_calls();
+	free_function(&main_function);
+	free(definitions);
+	free(uses);
+	return out;
+}
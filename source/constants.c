@@ -0,0 +1,205 @@
+#include "constants.h"
+#include "bytecode.h"
+#include "debug.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TABLE_START_SIZE 64
+
+// The pool being built, each constant encoded after the last
+static char *pool;
+static int pool_len;
+static int pool_max_len;
+
+// Where each constant starts in the pool, by index
+static int *offsets;
+static int count;
+static int max_count;
+
+// Open addressed table of indices, -1 where a slot is empty
+static int *table;
+static int table_size;
+
+int constants_len(const char *encoded)
+{
+	switch (encoded[0])
+	{
+		case CONST_INT: return 1 + sizeof(int);
+		case CONST_FLOAT: return 1 + sizeof(float);
+		case CONST_STRING: return (unsigned char)encoded[1] + 3;
+	}
+
+	return 1;
+}
+
+static unsigned int hash_constant(const char *encoded, int len)
+{
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char)encoded[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int *find_slot(const char *encoded, int len)
+{
+	unsigned int mask = table_size - 1;
+	unsigned int i = hash_constant(encoded, len) & mask;
+
+	// Linear probe until the constant or an empty slot is found
+	while (table[i] != -1)
+	{
+		const char *at = pool + offsets[table[i]];
+		if (constants_len(at) == len && !memcmp(at, encoded, len))
+			break;
+
+		i = (i + 1) & mask;
+	}
+	return &table[i];
+}
+
+static void grow_table()
+{
+	int i;
+
+	free(table);
+	table_size = table_size == 0 ? TABLE_START_SIZE : table_size * 2;
+	table = malloc(sizeof(int) * table_size);
+	memset(table, -1, sizeof(int) * table_size);
+
+	// Constants are all different, so each lands in an empty slot
+	for (i = 0; i < count; i++)
+		*find_slot(pool + offsets[i], constants_len(pool + offsets[i])) = i;
+}
+
+void constants_init()
+{
+	constants_close();
+	grow_table();
+}
+
+// Returns the index of the constant, adding it to the pool if it's not
+// already there
+int constants_add(const char *encoded)
+{
+	int len = constants_len(encoded);
+	int *slot = find_slot(encoded, len);
+	if (*slot != -1)
+		return *slot;
+
+	if (count == CONSTANT_MAX)
+	{
+		ERROR("More than %i constants", CONSTANT_MAX);
+		return 0;
+	}
+
+	if (pool_len + len > pool_max_len)
+	{
+		pool_max_len = (pool_len + len) * 2;
+		pool = realloc(pool, pool_max_len);
+	}
+
+	if (count == max_count)
+	{
+		max_count = max_count == 0 ? 64 : max_count * 2;
+		offsets = realloc(offsets, sizeof(int) * max_count);
+	}
+
+	int index = count++;
+	memcpy(pool + pool_len, encoded, len);
+	offsets[index] = pool_len;
+	pool_len += len;
+	*slot = index;
+
+	// Keep the table at most half full
+	if (count * 2 > table_size)
+		grow_table();
+	return index;
+}
+
+int constants_add_int(int value)
+{
+	char encoded[1 + sizeof(int)];
+	encoded[0] = CONST_INT;
+	memcpy(encoded + 1, &value, sizeof(int));
+	return constants_add(encoded);
+}
+
+const char *constants_find(int index)
+{
+	return pool + offsets[index];
+}
+
+const char *constants_pool(int *len)
+{
+	*len = pool_len;
+	return pool;
+}
+
+void constants_close()
+{
+	free(pool);
+	free(offsets);
+	free(table);
+	pool = NULL;
+	offsets = NULL;
+	table = NULL;
+	pool_len = 0;
+	pool_max_len = 0;
+	count = 0;
+	max_count = 0;
+	table_size = 0;
+}
+
+// Returns the length of the constant at 'p', or 0 if it runs past the
+// end of the pool
+static int check_constant(const char *in_pool, int len, int p)
+{
+	int size;
+
+	switch (in_pool[p])
+	{
+		case CONST_NULL: return 1;
+		case CONST_INT: case CONST_FLOAT: size = 1 + sizeof(int); break;
+		case CONST_STRING:
+			if (p + 2 > len)
+				return 0;
+			size = (unsigned char)in_pool[p + 1] + 3;
+			if (p + size > len || in_pool[p + size - 1] != '\0')
+				return 0;
+			break;
+		default: return 0;
+	}
+
+	return p + size <= len ? size : 0;
+}
+
+Register *constants_load(const char *in_pool, int len, int *out_count)
+{
+	int i, p, size, total = 0;
+
+	for (p = 0; p < len; p += size, total++)
+		if (!(size = check_constant(in_pool, len, p)))
+			return NULL;
+
+	Register *values = malloc(sizeof(Register) * (total + 1));
+	for (i = 0, p = 0; i < total; i++, p += constants_len(in_pool + p))
+	{
+		Register *value = &values[i];
+		*value = (Register) { in_pool[p] };
+		switch (value->type)
+		{
+			case CONST_INT: memcpy(&value->i, in_pool + p + 1, sizeof(int)); break;
+			case CONST_FLOAT: memcpy(&value->f, in_pool + p + 1, sizeof(float)); break;
+			case CONST_STRING: value->str = (char*)in_pool + p + 2; break;
+		}
+	}
+
+	*out_count = total;
+	return values;
+}
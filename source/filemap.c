@@ -0,0 +1,85 @@
+#include "filemap.h"
+#include "debug.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+
+// Any VM can map files, so changes to the table are locked
+struct FileMap filemap_table[FILEMAP_MAX];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Guest code checks for -1, so failing to map isn't an error
+int filemap_open(const char *path, int is_writable, int *size)
+{
+	struct stat info;
+	int fd = open(path, is_writable ? O_RDWR : O_RDONLY);
+	if (fd == -1 || fstat(fd, &info) == -1 || info.st_size > INT_MAX)
+	{
+		LOG("Can't map '%s'\n", path);
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+
+	// Empty files can't be mapped, but are still valid to read
+	unsigned char *bytes = NULL;
+	if (info.st_size > 0)
+	{
+		int prot = PROT_READ | (is_writable ? PROT_WRITE : 0);
+		bytes = mmap(NULL, info.st_size, prot, MAP_SHARED, fd, 0);
+		if (bytes == MAP_FAILED)
+		{
+			LOG("Can't map '%s'\n", path);
+			close(fd);
+			return -1;
+		}
+
+		// Input is usually parsed front to back, so read ahead 
+		// aggressively and drop pages once they're passed
+		madvise(bytes, info.st_size, MADV_SEQUENTIAL);
+	}
+
+	// The mapping keeps the file open
+	close(fd);
+
+	int slot;
+	pthread_mutex_lock(&lock);
+	for (slot = 0; slot < FILEMAP_MAX && filemap_table[slot].is_used; slot++);
+	if (slot < FILEMAP_MAX)
+		filemap_table[slot] = (struct FileMap) { bytes, info.st_size, is_writable, 1 };
+	pthread_mutex_unlock(&lock);
+
+	if (slot == FILEMAP_MAX)
+	{
+		LOG("Too many mapped files\n");
+		if (bytes != NULL)
+			munmap(bytes, info.st_size);
+		return -1;
+	}
+
+	*size = info.st_size;
+	return FILEMAP_BASE + slot;
+}
+
+void filemap_unmap(int addr)
+{
+	pthread_mutex_lock(&lock);
+	struct FileMap *map = filemap_find(addr);
+	if (map != NULL && map->is_used)
+	{
+		if (map->bytes != NULL)
+			munmap(map->bytes, map->size);
+		*map = (struct FileMap) { 0 };
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void filemap_close()
+{
+	int i;
+	for (i = 0; i < FILEMAP_MAX; i++)
+		filemap_unmap(FILEMAP_BASE + i);
+}
@@ -0,0 +1,174 @@
+#include "image.h"
+#include "debug.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Mapped image data
+static char *image = NULL;
+static int image_len;
+static const struct ImageHeader *header;
+
+#define CHECKSUM_START 2166136261u
+
+static unsigned int checksum(unsigned int hash, const char *data, int len)
+{
+	// FNV-1a
+	int i;
+
+	for (i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+int image_write(const char *path, const char *code, int len, 
+	const char *constants, int constant_len, int entry, 
+	const char *symbols, int symbol_len, int symbol_count)
+{
+	struct ImageHeader out_header;
+	memcpy(out_header.magic, IMAGE_MAGIC, 4);
+	out_header.version = IMAGE_VERSION;
+	out_header.entry = entry;
+	out_header.code_offset = sizeof(struct ImageHeader);
+	out_header.code_len = len;
+	out_header.constant_offset = out_header.code_offset + len;
+	out_header.constant_len = constant_len;
+	out_header.symbol_offset = out_header.constant_offset + constant_len;
+	out_header.symbol_len = symbol_len;
+	out_header.symbol_count = symbol_count;
+
+	// The checksum runs on over the code, constants and symbols
+	unsigned int hash = checksum(CHECKSUM_START, code, len);
+	hash = checksum(hash, constants, constant_len);
+	out_header.checksum = checksum(hash, symbols, symbol_len);
+
+	FILE *out = fopen(path, "wb");
+	if (out == NULL)
+	{
+		ERROR("Could not write image");
+		return 0;
+	}
+
+	fwrite(&out_header, sizeof(struct ImageHeader), 1, out);
+	fwrite(code, 1, len, out);
+	fwrite(constants, 1, constant_len, out);
+	fwrite(symbols, 1, symbol_len, out);
+	fclose(out);
+
+	LOG("Wrote image, %i bytes of code, %i of constants and %i symbols\n", 
+		len, constant_len, symbol_count);
+	return 1;
+}
+
+const char *image_map(const char *path, int *len, 
+	const char **constants, int *constant_len, int *entry)
+{
+	struct stat info;
+	image_close();
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &info) == -1)
+	{
+		ERROR("Could not open image");
+		if (fd != -1) close(fd);
+		return NULL;
+	}
+
+	// Map the file read only, the code runs straight from the mapping
+	image_len = info.st_size;
+	image = mmap(NULL, image_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+	{
+		image = NULL;
+		ERROR("Could not map image");
+		return NULL;
+	}
+
+	header = (const struct ImageHeader*)image;
+	if (image_len < sizeof(struct ImageHeader) || memcmp(header->magic, IMAGE_MAGIC, 4))
+	{
+		ERROR("Not an image");
+		image_close();
+		return NULL;
+	}
+
+	if (header->version != IMAGE_VERSION)
+	{
+		ERROR("Image version %i, expected %i", header->version, IMAGE_VERSION);
+		image_close();
+		return NULL;
+	}
+
+	if (header->code_offset < sizeof(struct ImageHeader) || header->code_len < 0 ||
+		header->constant_offset != header->code_offset + header->code_len ||
+		header->constant_len < 0 ||
+		header->symbol_offset != header->constant_offset + header->constant_len ||
+		header->symbol_len < 0 || header->symbol_offset + header->symbol_len != image_len ||
+		header->entry < 0 || header->entry > header->code_len)
+	{
+		ERROR("Image is malformed");
+		image_close();
+		return NULL;
+	}
+
+	int data_len = image_len - header->code_offset;
+	if (checksum(CHECKSUM_START, image + header->code_offset, data_len) != header->checksum)
+	{
+		ERROR("Image checksum doesn't match");
+		image_close();
+		return NULL;
+	}
+
+	*len = header->code_len;
+	*constants = image + header->constant_offset;
+	*constant_len = header->constant_len;
+	*entry = header->entry;
+	return image + header->code_offset;
+}
+
+const char *image_find_symbol(int addr, int *offset)
+{
+	const char *best = NULL;
+	int best_addr = -1;
+	int i, pointer = 0;
+
+	if (image == NULL)
+		return NULL;
+
+	// Find the closest symbol at or before the address
+	const char *symbols = image + header->symbol_offset;
+	for (i = 0; i < header->symbol_count && pointer < header->symbol_len; i++)
+	{
+		int symbol_addr;
+		memcpy(&symbol_addr, symbols + pointer, sizeof(int));
+		const char *name = symbols + pointer + sizeof(int);
+
+		if (symbol_addr <= addr && symbol_addr > best_addr)
+		{
+			best = name;
+			best_addr = symbol_addr;
+		}
+		pointer += sizeof(int) + strlen(name) + 1;
+	}
+
+	if (best != NULL)
+		*offset = addr - best_addr;
+	return best;
+}
+
+void image_close()
+{
+	if (image != NULL)
+	{
+		munmap(image, image_len);
+		image = NULL;
+	}
+}
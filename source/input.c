@@ -0,0 +1,254 @@
+#include "input.h"
+#include "bytecode.h"
+#include "debug.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Numbers are parsed straight from the buffer, so it's refilled once
+// fewer than this many bytes are left, and a number never runs off it
+#define INPUT_MARGIN	64
+
+#define IS_DIGIT(c)	((unsigned)((c) - '0') < 10)
+
+static int fd = STDIN_FILENO;
+static char *buffer;
+static int pos, len, is_end;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Lines read, freed when the input is closed
+static char **lines;
+static int line_count;
+
+static const double powers_of_ten[] =
+{
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+	1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+int input_open(const char *path)
+{
+	int file = open(path, O_RDONLY);
+	if (file == -1)
+	{
+		ERROR("Can't read '%.48s'", path);
+		return 0;
+	}
+
+	input_close();
+	fd = file;
+	return 1;
+}
+
+void input_close()
+{
+	int i;
+
+	for (i = 0; i < line_count; i++)
+		free(lines[i]);
+	free(lines);
+	free(buffer);
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	fd = STDIN_FILENO;
+	buffer = NULL;
+	lines = NULL;
+	line_count = 0;
+	pos = 0;
+	len = 0;
+	is_end = 0;
+}
+
+// Moves what's left to the start of the buffer and reads after it,
+// until there's at least the margin or the input ends. The buffer is
+// always terminated, so parsing stops at its end
+static void refill()
+{
+	if (buffer == NULL)
+		buffer = malloc(INPUT_BUFFER + 1);
+
+	memmove(buffer, buffer + pos, len - pos);
+	len -= pos;
+	pos = 0;
+
+	while (!is_end && len < INPUT_MARGIN)
+	{
+		ssize_t count = read(fd, buffer + len, INPUT_BUFFER - len);
+		if (count <= 0)
+			is_end = 1;
+		else
+			len += count;
+	}
+	buffer[len] = '\0';
+}
+
+// Moves to the start of the next number, returns 0 if there isn't one
+static int next_number(int is_float)
+{
+	for (;;)
+	{
+		if (len - pos < INPUT_MARGIN && !is_end)
+			refill();
+		if (pos >= len)
+			return 0;
+
+		const char *p = buffer + pos;
+		if (*p == '-' || *p == '+')
+			p++;
+		if (IS_DIGIT(*p) || (is_float && *p == '.' && IS_DIGIT(p[1])))
+			return 1;
+		pos++;
+	}
+}
+
+static int parse_int()
+{
+	const char *p = buffer + pos;
+	int is_negative = *p == '-';
+	unsigned value = 0;
+
+	if (*p == '-' || *p == '+')
+		p++;
+	while (IS_DIGIT(*p))
+		value = value * 10 + (*p++ - '0');
+
+	pos = p - buffer;
+	return is_negative ? -value : value;
+}
+
+static float parse_float()
+{
+	const char *p = buffer + pos;
+	int is_negative = *p == '-';
+	unsigned long long mantissa = 0;
+	int exponent = 0, digit_count = 0;
+
+	if (*p == '-' || *p == '+')
+		p++;
+
+	// Digits past what the mantissa holds only scale it
+	for (; IS_DIGIT(*p); p++)
+	{
+		if (digit_count++ < 19)
+			mantissa = mantissa * 10 + (*p - '0');
+		else
+			exponent++;
+	}
+
+	if (*p == '.')
+	{
+		for (p++; IS_DIGIT(*p); p++)
+		{
+			if (digit_count++ < 19)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				exponent--;
+			}
+		}
+	}
+
+	if ((*p == 'e' || *p == 'E') && (IS_DIGIT(p[1]) ||
+		((p[1] == '-' || p[1] == '+') && IS_DIGIT(p[2]))))
+	{
+		int is_exponent_negative = *++p == '-';
+		int value = 0;
+		if (*p == '-' || *p == '+')
+			p++;
+		while (IS_DIGIT(*p))
+		{
+			if (value < 10000)
+				value = value * 10 + (*p - '0');
+			p++;
+		}
+		exponent += is_exponent_negative ? -value : value;
+	}
+	pos = p - buffer;
+
+	double result = mantissa;
+	for (; exponent > 22; exponent -= 22)
+		result *= 1e22;
+	for (; exponent < -22; exponent += 22)
+		result /= 1e22;
+	result = exponent < 0 ? result / powers_of_ten[-exponent] : result * powers_of_ten[exponent];
+	return is_negative ? -result : result;
+}
+
+int input_read_int(int *value)
+{
+	pthread_mutex_lock(&lock);
+	int is_read = next_number(0);
+	if (is_read)
+		*value = parse_int();
+	pthread_mutex_unlock(&lock);
+	return is_read;
+}
+
+int input_read_float(float *value)
+{
+	pthread_mutex_lock(&lock);
+	int is_read = next_number(1);
+	if (is_read)
+		*value = parse_float();
+	pthread_mutex_unlock(&lock);
+	return is_read;
+}
+
+int input_read_ints(Register *out, int count)
+{
+	int i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < count && next_number(0); i++)
+		out[i] = (Register) { CONST_INT, { .i = parse_int() } };
+	pthread_mutex_unlock(&lock);
+	return i;
+}
+
+char *input_read_line()
+{
+	char *line = NULL;
+	int line_len = 0;
+
+	pthread_mutex_lock(&lock);
+	for (;;)
+	{
+		if (pos >= len)
+		{
+			refill();
+			if (pos >= len)
+				break;
+		}
+
+		// Lines can be longer than the buffer, so are built up a
+		// buffer at a time
+		char *end = memchr(buffer + pos, '\n', len - pos);
+		int count = (end != NULL ? end - buffer : len) - pos;
+		line = realloc(line, line_len + count + 1);
+		memcpy(line + line_len, buffer + pos, count);
+		line_len += count;
+		pos += count;
+
+		if (end != NULL)
+		{
+			pos++;
+			break;
+		}
+	}
+
+	if (line != NULL)
+	{
+		if (line_len > 0 && line[line_len - 1] == '\r')
+			line_len--;
+		line[line_len] = '\0';
+
+		// Grow the list each time its size doubles
+		if ((line_count & (line_count - 1)) == 0)
+			lines = realloc(lines, sizeof(char*) * (line_count == 0 ? 1 : line_count * 2));
+		lines[line_count++] = line;
+	}
+	pthread_mutex_unlock(&lock);
+	return line;
+}
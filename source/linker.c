@@ -1,36 +1,109 @@
 #include "linker.h"
 #include "bytecode.h"
+#include "codec.h"
+#include "constants.h"
 #include "debug.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #define CHUNK_SIZE 80
+#define TABLE_START_SIZE 256
 
 // Label data
 struct Label
 {
-	char name[80];
-	int refs[80];
-	int ref_count, addr;
+	int name, addr;
 };
 
 static struct Label *labels;
 static int label_count;
 static int label_max_len;
 
+// References to labels, in the order they appear in the code
+struct Ref
+{
+	int pos, label;
+};
+
+static struct Ref *refs;
+static int ref_count;
+static int ref_max_len;
+
+// Interned label names, stored one after another
+static char *names;
+static int name_pointer;
+static int name_max_len;
+
+// Open addressing hash table. Slots keep the hash and name so 
+// a lookup only touches the table and the name, label is -1 if empty
+struct Slot
+{
+	unsigned int hash;
+	int name, label;
+};
+
+static struct Slot *label_table;
+static int table_size;
+
+// Label lookups are queued, so the table and names can be 
+// prefetched while the following code is read
+#define LOOKAHEAD 16
+
+struct Lookup
+{
+	const char *name;
+	unsigned int hash;
+	int len, pos, is_set;
+};
+
+static struct Lookup lookups[LOOKAHEAD];
+static int lookup_count;
+
+// Labels kept along with the entry point, even if nothing refers to them
+static char **exports;
+static int export_count;
+
+// Execution profile used to lay out the code, if any
+static char *profile_path;
+
+// Blocks of code, starting at each label and after each branch
+struct Block
+{
+	int start, end, last, shift;
+	int first_ref, label, base_label;
+	int is_live, count, taken;
+	char last_bytecode;
+};
+
+static struct Block *blocks;
+static int block_count;
+
+// Links between blocks, used to lay out the code
+#define EDGE_FALL	0
+#define EDGE_JUMP	1
+#define EDGE_INVERT	2
+#define EDGE_CALL	3
+
+struct Edge
+{
+	int from, to, weight, type;
+};
+
 // Output code
 static char *out_code;
 static int code_pointer;
 static int code_max_len;
 
 // Helper functions
-#define REG 		out_code[code_pointer++] = code[i++]
-#define CONST		i += copy_len(code, i, skip_const(code, i))
-#define ADDR		i += skip_addr(code, i)
-#define INDIRECT 	REG
-#define INDIRECT_PLUS	i += copy_len(code, i, 2)
-#define INDIRECT_SUB	INDIRECT_PLUS
+#define LABEL_NAME(label) (names + (label)->name)
+
+static void clear_table()
+{
+	int i;
+	for (i = 0; i < table_size; i++)
+		label_table[i].label = -1;
+}
 
 void linker_init()
 {
@@ -38,38 +111,212 @@ void linker_init()
 	label_max_len = CHUNK_SIZE;
 	label_count = 0;
 
+	refs = malloc(sizeof(struct Ref) * CHUNK_SIZE);
+	ref_max_len = CHUNK_SIZE;
+	ref_count = 0;
+
+	names = malloc(CHUNK_SIZE);
+	name_max_len = CHUNK_SIZE;
+	name_pointer = 0;
+
+	table_size = TABLE_START_SIZE;
+	label_table = malloc(sizeof(struct Slot) * table_size);
+	clear_table();
+
 	out_code = NULL;
 	code_pointer = 0;
 	code_max_len = 0;
+	lookup_count = 0;
+
+	exports = NULL;
+	export_count = 0;
+	profile_path = NULL;
+	blocks = NULL;
+	block_count = 0;
+	constants_init();
+}
+
+void linker_use_profile(const char *path)
+{
+	profile_path = realloc(profile_path, strlen(path) + 1);
+	strcpy(profile_path, path);
+}
+
+void linker_export(const char *name)
+{
+	exports = realloc(exports, sizeof(char*) * (export_count + 1));
+	exports[export_count] = malloc(strlen(name) + 1);
+	strcpy(exports[export_count++], name);
+}
+
+static unsigned int hash_name(const char *name, int len)
+{
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+
+	// Mix the high bits down, as the table only uses the low bits
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	return hash;
+}
+
+static struct Slot *find_slot(const char *name, int len, unsigned int hash)
+{
+	unsigned int mask = table_size - 1;
+	unsigned int i = hash & mask;
+
+	// Linear probe until the name or an empty slot is found
+	while (label_table[i].label != -1)
+	{
+		struct Slot *slot = &label_table[i];
+		if (slot->hash == hash)
+		{
+			const char *slot_name = names + slot->name;
+			if (!memcmp(slot_name, name, len) && slot_name[len] == '\0')
+				break;
+		}
+
+		i = (i + 1) & mask;
+	}
+	return &label_table[i];
 }
 
-static struct Label *find_label(const char *name)
+static void grow_table()
 {
 	int i;
+	struct Slot *old_table = label_table;
+	int old_size = table_size;
+
+	table_size *= 2;
+	label_table = malloc(sizeof(struct Slot) * table_size);
+	clear_table();
+
+	// Re-insert all labels, without needing to compare names
+	for (i = 0; i < old_size; i++)
+	{
+		struct Slot slot = old_table[i];
+		if (slot.label == -1)
+			continue;
+
+		unsigned int j = slot.hash & (table_size - 1);
+		while (label_table[j].label != -1)
+			j = (j + 1) & (table_size - 1);
+		label_table[j] = slot;
+	}
+	free(old_table);
+}
+
+static int find_label(const char *name, int len, unsigned int hash)
+{
+	struct Slot *slot = find_slot(name, len, hash);
 
 	// Find label if it exists
-	for (i = 0; i < label_count; i++)
-		if (!strcmp(labels[i].name, name))
-			return &labels[i];
+	if (slot->label != -1)
+		return slot->label;
 	
 	// Otherwise, create a new one
-	struct Label *label = &labels[label_count++];
-	strcpy(label->name, name);
-	label->addr = -1;
-	label->ref_count = 0;
-	return label;
+	if (label_count >= label_max_len)
+	{
+		label_max_len *= 2;
+		labels = realloc(labels, sizeof(struct Label) * label_max_len);
+	}
+
+	// Intern the name
+	while (name_pointer + len + 1 > name_max_len)
+	{
+		name_max_len *= 2;
+		names = realloc(names, name_max_len);
+	}
+	memcpy(names + name_pointer, name, len);
+	names[name_pointer + len] = '\0';
+
+	int index = label_count++;
+	labels[index].name = name_pointer;
+	labels[index].addr = -1;
+	slot->hash = hash;
+	slot->name = name_pointer;
+	slot->label = index;
+	name_pointer += len + 1;
+
+	// Keep the table at most half full
+	if (label_count * 2 > table_size)
+		grow_table();
+	return index;
 }
 
-int skip_const(const char *code, int i)
+static void add_ref(int label, int pos)
 {
-	char type = code[i];
-	switch (type)
+	if (ref_count >= ref_max_len)
 	{
-		case CONST_INT: memcpy(out_code + code_pointer, code + i, 5);  return 5;
-		case CONST_STRING: return code[i + 1] + 3;
+		ref_max_len *= 2;
+		refs = realloc(refs, sizeof(struct Ref) * ref_max_len);
 	}
 
-	return 0;
+	refs[ref_count].pos = pos;
+	refs[ref_count].label = label;
+	ref_count++;
+}
+
+static void resolve_lookup(struct Lookup *lookup)
+{
+	int label = find_label(lookup->name, lookup->len, lookup->hash);
+	if (lookup->is_set)
+		labels[label].addr = lookup->pos;
+	else
+		add_ref(label, lookup->pos);
+}
+
+static void queue_lookup(const char *name, int len, int pos, int is_set)
+{
+	struct Lookup *lookup = &lookups[lookup_count % LOOKAHEAD];
+	unsigned int mask = table_size - 1;
+
+	// Resolve the oldest lookup to make room
+	if (lookup_count >= LOOKAHEAD)
+		resolve_lookup(lookup);
+
+	lookup->name = name;
+	lookup->len = len;
+	lookup->pos = pos;
+	lookup->is_set = is_set;
+	lookup->hash = hash_name(name, len);
+	__builtin_prefetch(&label_table[lookup->hash & mask]);
+
+	// By halfway through the queue, the slot is loaded, so fetch its name
+	if (lookup_count >= LOOKAHEAD / 2)
+	{
+		struct Lookup *half = &lookups[(lookup_count - LOOKAHEAD / 2) % LOOKAHEAD];
+		struct Slot *slot = &label_table[half->hash & mask];
+		if (slot->label != -1)
+			__builtin_prefetch(names + slot->name);
+	}
+
+	lookup_count++;
+}
+
+static void flush_lookups()
+{
+	int i = lookup_count > LOOKAHEAD ? lookup_count - LOOKAHEAD : 0;
+	for (; i < lookup_count; i++)
+		resolve_lookup(&lookups[i % LOOKAHEAD]);
+	lookup_count = 0;
+}
+
+// Moves a constant into the pool, leaving its index in the code
+static int add_const(const char *code, int i)
+{
+	unsigned short index = constants_add(code + i);
+	memcpy(out_code + code_pointer, &index, sizeof(short));
+	code_pointer += sizeof(short);
+	return constants_len(code + i);
 }
 
 int copy_len(const char * code, int i, int len)
@@ -88,17 +335,13 @@ int skip_addr(const char *code, int i)
 	return copy_len(code, i, 4);
 }
 
-#define GEN_SKIP(type) type;
-#define SKIP(name) case BC_##name: ARGS_##name(GEN_SKIP); break
-
 int set_addr(const char *code, int i)
 {
 	int len = code[i];
 	const char *name = code + i + 1;
 
 	// Set the labels address
-	struct Label *label = find_label(name);
-	label->addr = code_pointer;
+	queue_lookup(name, len, code_pointer, 1);
 
 	return len + 2;
 }
@@ -109,82 +352,1226 @@ int get_addr(const char *code, int i)
 	const char *name = code + i + 1;
 
 	// Store the ref
-	struct Label *label = find_label(name);
-	label->refs[label->ref_count++] = code_pointer;
+	queue_lookup(name, len, code_pointer, 0);
 
-	// Allocate space for the ref
+	// Allocate space for the ref, holding the offset 
+	// from the label until it's linked
+	memcpy(out_code + code_pointer, code + i + len + 2, sizeof(int));
 	code_pointer += 4;
 
-	return len + 2;
+	return len + 2 + sizeof(int);
 }
 
 void linker_add_code(const char *code, int len)
 {
-	// If no code exists, allocate space for the new code
-	if (out_code == NULL)
+	int j;
+
+	// Make sure there's space for the new code, linked 
+	// code is never longer than the input
+	if (code_pointer + len > code_max_len)
 	{
-		out_code = malloc(len);
-		code_max_len = len;
+		code_max_len = code_pointer + len;
+		out_code = realloc(out_code, code_max_len);
 	}
 
 	int i = 0;
 	while (i < len)
 	{
 		char bytecode = code[i++];
+		if (bytecode == BC_SET_LABEL)
+		{
+			// Labels take no space in the linked code
+			i += set_addr(code, i);
+			continue;
+		}
+
 		out_code[code_pointer++] = bytecode;
+		if ((unsigned char)bytecode >= BC_SET_LABEL)
+			continue;
 
-		switch (bytecode)
+		// Operands are copied as they are, apart from constants,
+		// which go to the pool, and addresses, which may be labels
+		const char *types = bytecode_operands[(unsigned char)bytecode];
+		for (j = 0; types[j] != OPERAND_NONE; j++)
 		{
-			SKIP(MOV_RR); SKIP(MOV_RC);
-			SKIP(MOV_AR); SKIP(MOV_AC); 
-			SKIP(MOV_IR); SKIP(MOV_IPR); SKIP(MOV_ISR); 
-			SKIP(MOV_IC); SKIP(MOV_IPC); SKIP(MOV_ISC);
-			SKIP(MOV_RA); SKIP(MOV_RI); SKIP(MOV_RIP); SKIP(MOV_RIS);
-			SKIP(CMP_RC); SKIP(CMP_RR);
-			SKIP(ADD_RRC); SKIP(ADD_RRR);
-			SKIP(SUB_RRC); SKIP(SUB_RRR);
-			SKIP(PUSH_R); SKIP(PUSH_C); SKIP(POP_R);
-			SKIP(CALL_A);
-			SKIP(B_A); SKIP(BEQ_A); SKIP(BNE_A); SKIP(BLT_A); SKIP(BGT_A);
-			SKIP(INT_A);
+			switch (types[j])
+			{
+				case OPERAND_CONST: i += add_const(code, i); break;
+				case OPERAND_ADDR: i += skip_addr(code, i); break;
+				default: i += copy_len(code, i, operand_sizes[(int)types[j]]); break;
+			}
+		}
+	}
+
+	flush_lookups();
+}
+
+// Returns the start of the next instruction in the linked code
+static int next_instruction(const char *code, int i)
+{
+	return i + bytecode_lengths[(unsigned char)code[i]];
+}
 
-			case BC_SET_LABEL: i += set_addr(code, i); break;
+static int is_branch(char bytecode)
+{
+	switch (bytecode)
+	{
+		case BC_CALL_A: case BC_B_A: case BC_BEQ_A:
+		case BC_BNE_A: case BC_BLT_A: case BC_BGT_A:
+			return 1;
+	}
+
+	return 0;
+}
+
+// Each branch, with its 8 and 16 bit offset forms
+static const char branch_forms[][3] = 
+{
+	{ BC_CALL_A, BC_CALL_O8, BC_CALL_O16 },
+	{ BC_B_A, BC_B_O8, BC_B_O16 },
+	{ BC_BEQ_A, BC_BEQ_O8, BC_BEQ_O16 },
+	{ BC_BNE_A, BC_BNE_O8, BC_BNE_O16 },
+	{ BC_BLT_A, BC_BLT_O8, BC_BLT_O16 },
+	{ BC_BGT_A, BC_BGT_O8, BC_BGT_O16 },
+};
+
+// Returns the form of a branch that's 'size' bytes long
+static char branch_form(char bytecode, int size)
+{
+	int i;
+	for (i = 0; i < sizeof(branch_forms) / sizeof(branch_forms[0]); i++)
+	{
+		if (branch_forms[i][0] != bytecode)
+			continue;
+
+		switch (size)
+		{
+			case 2: return branch_forms[i][1];
+			case 3: return branch_forms[i][2];
 		}
 	}
+
+	return bytecode;
+}
+
+// Parallel loops call a routine, like a call that can't be shortened
+static int is_parallel(char bytecode)
+{
+	return bytecode == BC_PFOR_A || bytecode == BC_PSUM_A || 
+		bytecode == BC_PMIN_A || bytecode == BC_PMAX_A;
+}
+
+static int is_short_branch(char bytecode)
+{
+	return (bytecode >= BC_B_O8 && bytecode <= BC_BLT_O16) || 
+		bytecode == BC_CALL_O8 || bytecode == BC_CALL_O16;
+}
+
+static int ends_block(char bytecode)
+{
+	return ((is_branch(bytecode) || is_short_branch(bytecode)) && 
+			bytecode != BC_CALL_A && bytecode != BC_CALL_O8 && bytecode != BC_CALL_O16) || 
+		bytecode == BC_RET || bytecode == BC_HULT;
+}
+
+static int falls_through(char bytecode)
+{
+	return bytecode != BC_B_A && bytecode != BC_B_O8 && bytecode != BC_B_O16 && 
+		bytecode != BC_RET && bytecode != BC_HULT;
+}
+
+static int compare_int(const void *a, const void *b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+static int find_block(int addr)
+{
+	int low = 0, high = block_count - 1;
+
+	// Find the last block starting at or before the address
+	while (low < high)
+	{
+		int mid = (low + high + 1) / 2;
+		if (blocks[mid].start <= addr)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	return low;
+}
+
+// Code can only be moved if every branch is to a label, 
+// and no refs are offset from their label
+static int is_movable()
+{
+	int i, ref = 0;
+
+	for (i = 0; i < ref_count; i++)
+	{
+		int offset;
+		memcpy(&offset, out_code + refs[i].pos, sizeof(int));
+		if (offset != 0)
+			return 0;
+	}
+
+	for (i = 0; i < code_pointer; i = next_instruction(out_code, i))
+	{
+		while (ref < ref_count && refs[ref].pos <= i)
+			ref++;
+		if (is_branch(out_code[i]) && (ref >= ref_count || refs[ref].pos != i + 1))
+			return 0;
+	}
+
+	return 1;
+}
+
+static void build_blocks()
+{
+	int i, j, count = 0, max_count = label_count + CHUNK_SIZE;
+	int *starts = malloc(sizeof(int) * max_count);
+
+	// Split the code at each label, and after each branch
+	starts[count++] = 0;
+	for (i = 0; i < label_count; i++)
+		if (labels[i].addr != -1 && labels[i].addr < code_pointer)
+			starts[count++] = labels[i].addr;
+
+	for (i = 0; i < code_pointer; )
+	{
+		int next = next_instruction(out_code, i);
+		if (ends_block(out_code[i]) && next < code_pointer)
+		{
+			if (count >= max_count)
+			{
+				max_count *= 2;
+				starts = realloc(starts, sizeof(int) * max_count);
+			}
+			starts[count++] = next;
+		}
+		i = next;
+	}
+	qsort(starts, count, sizeof(int), compare_int);
+
+	free(blocks);
+	blocks = malloc(sizeof(struct Block) * count);
+	for (i = 0, j = 0; i < count; i++)
+	{
+		if (j > 0 && blocks[j - 1].start == starts[i])
+			continue;
+
+		struct Block *block = &blocks[j++];
+		memset(block, 0, sizeof(struct Block));
+		block->start = starts[i];
+		block->label = -1;
+		block->last_bytecode = BC_HULT;
+	}
+	block_count = j;
+	free(starts);
+
+	// Find the label at the start of each block, and the label it follows
+	for (i = 0; i < label_count; i++)
+	{
+		if (labels[i].addr == -1 || labels[i].addr >= code_pointer)
+			continue;
+
+		struct Block *block = &blocks[find_block(labels[i].addr)];
+		if (block->label == -1)
+			block->label = i;
+	}
+
+	int base_label = -1;
+	for (i = 0; i < block_count; i++)
+	{
+		if (blocks[i].label != -1)
+			base_label = blocks[i].label;
+		blocks[i].base_label = base_label;
+	}
+
+	// Find the end of each block, its refs, and how it ends
+	int block = 0, ref = 0;
+	blocks[0].first_ref = 0;
+	for (i = 0; i < code_pointer; i = next_instruction(out_code, i))
+	{
+		while (block + 1 < block_count && blocks[block + 1].start <= i)
+		{
+			blocks[block++].end = i;
+			while (ref < ref_count && refs[ref].pos < i)
+				ref++;
+			blocks[block].first_ref = ref;
+		}
+
+		blocks[block].last = i;
+		blocks[block].last_bytecode = out_code[i];
+	}
+	while (block + 1 < block_count)
+	{
+		blocks[block++].end = code_pointer;
+		blocks[block].first_ref = ref_count;
+	}
+	blocks[block].end = code_pointer;
+}
+
+static int block_ref_end(int block)
+{
+	return block + 1 < block_count ? blocks[block + 1].first_ref : ref_count;
+}
+
+// Returns the ref of the branch ending the block, or -1
+static int branch_ref(int block)
+{
+	struct Block *b = &blocks[block];
+	int end = block_ref_end(block);
+
+	if (!ends_block(b->last_bytecode) || end == b->first_ref)
+		return -1;
+	if (refs[end - 1].pos != b->last + 1)
+		return -1;
+	return end - 1;
+}
+
+static int ref_block(int ref)
+{
+	return find_block(labels[refs[ref].label].addr);
+}
+
+// Marks a block live and queues it, so each is only ever queued once
+// and the stack never holds more than every block
+static void mark_live(int block, int *stack, int *stack_pointer)
+{
+	if (blocks[block].is_live)
+		return;
+
+	blocks[block].is_live = 1;
+	stack[(*stack_pointer)++] = block;
+}
+
+static void remove_dead_code()
+{
+	int i, j, block, ref;
+
+	// Mark the blocks reachable from the exported labels, or the 
+	// start of the code if none of them exist
+	int *stack = malloc(sizeof(int) * block_count);
+	int stack_pointer = 0;
+	for (i = 0; i < export_count; i++)
+	{
+		int addr = linker_find_addr(exports[i]);
+		if (addr != -1)
+			mark_live(find_block(addr), stack, &stack_pointer);
+	}
+	if (stack_pointer == 0)
+		mark_live(0, stack, &stack_pointer);
+
+	while (stack_pointer > 0)
+	{
+		block = stack[--stack_pointer];
+
+		// Follow each ref, then fall through to the next block
+		for (ref = blocks[block].first_ref; ref < block_ref_end(block); ref++)
+			mark_live(ref_block(ref), stack, &stack_pointer);
+
+		if (falls_through(blocks[block].last_bytecode) && block + 1 < block_count)
+			mark_live(block + 1, stack, &stack_pointer);
+	}
+	free(stack);
+
+	// Compact the live blocks
+	int new_pointer = 0, removed_count = 0;
+	for (i = 0; i < block_count; i++)
+	{
+		struct Block *b = &blocks[i];
+		b->shift = b->start - new_pointer;
+		if (!b->is_live)
+		{
+			removed_count += b->label != -1;
+			continue;
+		}
+
+		memmove(out_code + new_pointer, out_code + b->start, b->end - b->start);
+		new_pointer += b->end - b->start;
+	}
+
+	// Move the labels, labels in removed blocks no longer exist
+	for (i = 0; i < label_count; i++)
+	{
+		if (labels[i].addr == -1)
+			continue;
+
+		int first = find_block(labels[i].addr);
+		struct Block *b = &blocks[first];
+		if (!b->is_live)
+		{
+			// The routine runs on through dead blocks to the next label
+			int k, size = 0;
+			for (k = first; k < block_count && !blocks[k].is_live && 
+				(k == first || blocks[k].label == -1); k++)
+				size += blocks[k].end - blocks[k].start;
+
+			LOG("Removing '%s' (%i bytes)\n", LABEL_NAME(&labels[i]), size);
+			labels[i].addr = -1;
+			continue;
+		}
+		labels[i].addr -= b->shift;
+	}
+
+	// Drop refs from removed blocks, and move the rest
+	for (block = 0, i = 0, j = 0; i < ref_count; i++)
+	{
+		while (block + 1 < block_count && blocks[block + 1].first_ref <= i)
+			block++;
+		if (!blocks[block].is_live)
+			continue;
+
+		refs[j] = refs[i];
+		refs[j++].pos -= blocks[block].shift;
+	}
+	ref_count = j;
+
+	if (new_pointer < code_pointer)
+	{
+		LOG("Removed %i unreachable routines, %i of %i bytes (%i%%)\n", 
+			removed_count, code_pointer - new_pointer, code_pointer,
+			(code_pointer - new_pointer) * 100 / code_pointer);
+	}
+	code_pointer = new_pointer;
+}
+
+// Code from one label to the next, with the refs inside it
+struct Routine
+{
+	int start, end, first_ref, ref_end;
+	unsigned int hash;
+	int is_open, is_taken, folded_into;
+};
+
+static int find_routine(struct Routine *routines, int count, int addr)
+{
+	int low = 0, high = count - 1;
+
+	while (low < high)
+	{
+		int mid = (low + high + 1) / 2;
+		if (routines[mid].start <= addr)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	return low;
+}
+
+// Refs to the routine's own start are the same in every copy,
+// anything else is compared by where it goes
+static int ref_target(const struct Routine *routine, int ref)
+{
+	int addr = labels[refs[ref].label].addr;
+	return addr == routine->start ? -1 : addr;
+}
+
+static unsigned int hash_routine(const struct Routine *routine)
+{
+	// FNV-1a over the code, then where each ref is and goes
+	unsigned int hash = 2166136261u;
+	int i;
+
+	for (i = routine->start; i < routine->end; i++)
+	{
+		hash ^= (unsigned char)out_code[i];
+		hash *= 16777619u;
+	}
+	for (i = routine->first_ref; i < routine->ref_end; i++)
+	{
+		hash ^= refs[i].pos - routine->start;
+		hash *= 16777619u;
+		hash ^= ref_target(routine, i);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int is_same_routine(const struct Routine *a, const struct Routine *b)
+{
+	int i;
+
+	if (a->hash != b->hash || a->end - a->start != b->end - b->start ||
+		a->ref_end - a->first_ref != b->ref_end - b->first_ref ||
+		memcmp(out_code + a->start, out_code + b->start, a->end - a->start))
+		return 0;
+
+	for (i = 0; i < a->ref_end - a->first_ref; i++)
+	{
+		int ref_a = a->first_ref + i, ref_b = b->first_ref + i;
+		if (refs[ref_a].pos - a->start != refs[ref_b].pos - b->start ||
+			ref_target(a, ref_a) != ref_target(b, ref_b))
+			return 0;
+	}
+	return 1;
+}
+
+static struct Routine *sorting_routines;
+
+static int compare_routine_hash(const void *a, const void *b)
+{
+	const struct Routine *routine_a = &sorting_routines[*(const int*)a];
+	const struct Routine *routine_b = &sorting_routines[*(const int*)b];
+
+	if (routine_a->hash != routine_b->hash)
+		return routine_a->hash < routine_b->hash ? -1 : 1;
+	return routine_a->start - routine_b->start;
+}
+
+static struct Routine *build_routines(int *count)
+{
+	int i, next, routine_count = 0;
+	int *starts = malloc(sizeof(int) * (label_count + 1));
+
+	// Split the code at each label, the code before the first is
+	// never folded, as nothing can refer to it
+	starts[routine_count++] = 0;
+	for (i = 0; i < label_count; i++)
+		if (labels[i].addr != -1 && labels[i].addr < code_pointer)
+			starts[routine_count++] = labels[i].addr;
+	qsort(starts, routine_count, sizeof(int), compare_int);
+
+	struct Routine *routines = malloc(sizeof(struct Routine) * routine_count);
+	for (i = 0, *count = 0; i < routine_count; i++)
+	{
+		if (*count > 0 && routines[*count - 1].start == starts[i])
+			continue;
+
+		struct Routine *routine = &routines[(*count)++];
+		memset(routine, 0, sizeof(struct Routine));
+		routine->start = starts[i];
+		routine->folded_into = -1;
+	}
+	free(starts);
+
+	// Find the refs in each, if it runs on into the next one, and
+	// which have their address used other than by a branch or call
+	int routine = 0, ref = 0;
+	for (i = 0; i < *count; i++)
+		routines[i].end = i + 1 < *count ? routines[i + 1].start : code_pointer;
+
+	for (i = 0; i < code_pointer; i = next)
+	{
+		next = next_instruction(out_code, i);
+		while (routines[routine].end <= i)
+		{
+			routines[routine++].ref_end = ref;
+			routines[routine].first_ref = ref;
+		}
+
+		routines[routine].is_open = falls_through(out_code[i]);
+		for (; ref < ref_count && refs[ref].pos < next; ref++)
+		{
+			if (refs[ref].pos != i + 1 ||
+				!(is_branch(out_code[i]) || is_parallel(out_code[i])))
+			{
+				int target = labels[refs[ref].label].addr;
+				routines[find_routine(routines, *count, target)].is_taken = 1;
+			}
+		}
+	}
+	while (routine < *count)
+	{
+		routines[routine++].ref_end = ref;
+		if (routine < *count)
+			routines[routine].first_ref = ref;
+	}
+
+	return routines;
+}
+
+// Folds routines with the same code and refs into one copy, returning
+// the bytes saved. Routines that run on into the next, have one run on
+// into them or have their address taken are never removed
+static int fold_routines()
+{
+	int i, j, routine_count;
+	struct Routine *routines = build_routines(&routine_count);
+	int *order = malloc(sizeof(int) * routine_count);
+
+	for (i = 0; i < routine_count; i++)
+	{
+		routines[i].hash = hash_routine(&routines[i]);
+		order[i] = i;
+	}
+	sorting_routines = routines;
+	qsort(order, routine_count, sizeof(int), compare_routine_hash);
+
+	// Compare each routine with the first of its hash that's kept
+	int folded_count = 0;
+	for (i = 0; i < routine_count; i++)
+	{
+		struct Routine *routine = &routines[order[i]];
+		if (order[i] == 0 || routine->is_open || routine->is_taken ||
+			routines[order[i] - 1].is_open)
+			continue;
+
+		for (j = i - 1; j >= 0 && routines[order[j]].hash == routine->hash; j--)
+		{
+			struct Routine *kept = &routines[order[j]];
+			if (kept->folded_into == -1 && !kept->is_open &&
+				is_same_routine(kept, routine))
+			{
+				routine->folded_into = order[j];
+				folded_count++;
+				break;
+			}
+		}
+	}
+	free(order);
+
+	if (folded_count == 0)
+	{
+		free(routines);
+		return 0;
+	}
+
+	// Point the folded routine's labels at the copy that's kept
+	for (i = 0; i < label_count; i++)
+	{
+		if (labels[i].addr == -1 || labels[i].addr >= code_pointer)
+			continue;
+
+		struct Routine *routine = &routines[find_routine(routines, routine_count, labels[i].addr)];
+		if (routine->folded_into != -1)
+		{
+			LOG("Folding '%s' into %i\n", LABEL_NAME(&labels[i]),
+				routines[routine->folded_into].start);
+			labels[i].addr = routines[routine->folded_into].start;
+		}
+	}
+
+	// Compact the routines that are kept, and move their labels and refs
+	int new_pointer = 0;
+	int *shifts = malloc(sizeof(int) * routine_count);
+	for (i = 0, j = 0; i < routine_count; i++)
+	{
+		struct Routine *routine = &routines[i];
+		shifts[i] = routine->start - new_pointer;
+		if (routine->folded_into != -1)
+			continue;
+
+		memmove(out_code + new_pointer, out_code + routine->start, routine->end - routine->start);
+		new_pointer += routine->end - routine->start;
+
+		int ref;
+		for (ref = routine->first_ref; ref < routine->ref_end; ref++)
+		{
+			refs[j] = refs[ref];
+			refs[j++].pos -= shifts[i];
+		}
+	}
+	ref_count = j;
+
+	int saved = code_pointer - new_pointer;
+	for (i = 0; i < label_count; i++)
+	{
+		if (labels[i].addr >= code_pointer)
+			labels[i].addr -= saved;
+		else if (labels[i].addr != -1)
+			labels[i].addr -= shifts[find_routine(routines, routine_count, labels[i].addr)];
+	}
+
+	code_pointer = new_pointer;
+	free(shifts);
+	free(routines);
+	return saved;
+}
+
+// Folds identical routines until there are none left, as calls to
+// folded copies can make their callers the same too
+static void fold_identical_code()
+{
+	int saved, total = 0, start_len = code_pointer, pass_count = 0;
+
+	while ((saved = fold_routines()) > 0)
+	{
+		total += saved;
+		pass_count++;
+	}
+
+	if (total > 0)
+	{
+		LOG("Folded identical routines in %i passes, %i of %i bytes (%i%%)\n",
+			pass_count, total, start_len, total * 100 / start_len);
+	}
+}
+
+static int read_profile()
+{
+	char name[80];
+	int index, count, taken, found = 0;
+
+	FILE *in = fopen(profile_path, "r");
+	if (in == NULL)
+	{
+		ERROR("Could not open profile");
+		return 0;
+	}
+
+	// Each line is a block, as 'label index count taken', where 
+	// index counts the blocks after the label
+	while (fscanf(in, "%79s %i %i %i", name, &index, &count, &taken) == 4)
+	{
+		int addr = strcmp(name, ".") ? linker_find_addr(name) : 0;
+		if (addr == -1 || addr >= code_pointer)
+			continue;
+
+		int first = find_block(addr);
+		if (blocks[first].start != addr || first + index >= block_count ||
+			blocks[first + index].base_label != blocks[first].base_label)
+			continue;
+
+		struct Block *block = &blocks[first + index];
+
+		block->count = count;
+		block->taken = taken;
+		found += count > 0;
+	}
+
+	fclose(in);
+	return found;
+}
+
+// Returns a label at the start of the block, making one if needed
+static int block_label(int block)
+{
+	char name[80];
+
+	if (blocks[block].label == -1)
+	{
+		int len = sprintf(name, "@%i", blocks[block].start);
+		int label = find_label(name, len, hash_name(name, len));
+		labels[label].addr = blocks[block].start;
+		blocks[block].label = label;
+	}
+	return blocks[block].label;
+}
+
+static int compare_edge(const void *a, const void *b)
+{
+	return ((const struct Edge*)b)->weight - ((const struct Edge*)a)->weight;
+}
+
+static int compare_hotness(const void *a, const void *b)
+{
+	const struct Block *block_a = &blocks[*(const int*)a];
+	const struct Block *block_b = &blocks[*(const int*)b];
+
+	if (block_a->count != block_b->count)
+		return block_a->count < block_b->count ? 1 : -1;
+	return block_a->start - block_b->start;
+}
+
+static int find_chain(int *chain_of, int block)
+{
+	while (chain_of[block] != block)
+		block = chain_of[block] = chain_of[chain_of[block]];
+	return block;
+}
+
+static void add_edge(struct Edge *edges, int *edge_count, int from, int to, int weight, int type)
+{
+	if (weight <= 0)
+		return;
+
+	struct Edge *edge = &edges[(*edge_count)++];
+	edge->from = from;
+	edge->to = to;
+	edge->weight = weight;
+	edge->type = type;
+}
+
+static void lay_out_code()
+{
+	int i, j, ref;
+
+	// Weigh each link between blocks from the profile
+	struct Edge *edges = malloc(sizeof(struct Edge) * (block_count + ref_count));
+	int edge_count = 0;
+	for (i = 0; i < block_count; i++)
+	{
+		struct Block *block = &blocks[i];
+		char last = block->last_bytecode;
+		int branch = branch_ref(i);
+
+		if (branch != -1)
+		{
+			int type = EDGE_CALL;
+			if (last == BC_B_A) type = EDGE_JUMP;
+			if (last == BC_BEQ_A || last == BC_BNE_A) type = EDGE_INVERT;
+			add_edge(edges, &edge_count, i, ref_block(branch), 
+				last == BC_B_A ? block->count : block->taken, type);
+		}
+
+		if (falls_through(last) && i + 1 < block_count)
+		{
+			int weight = block->count - (branch != -1 ? block->taken : 0);
+			add_edge(edges, &edge_count, i, i + 1, weight, EDGE_FALL);
+		}
+
+		// Calls only matter for keeping callers and callees close
+		for (ref = block->first_ref; ref < block_ref_end(i); ref++)
+			if (out_code[refs[ref].pos - 1] == BC_CALL_A || 
+				is_parallel(out_code[refs[ref].pos - 1]))
+				add_edge(edges, &edge_count, i, ref_block(ref), block->count, EDGE_CALL);
+	}
+	qsort(edges, edge_count, sizeof(struct Edge), compare_edge);
+
+	// Join blocks into chains along the hottest edges, the entry 
+	// block has to start a chain
+	int *next = malloc(sizeof(int) * block_count);
+	int *prev = malloc(sizeof(int) * block_count);
+	int *chain_of = malloc(sizeof(int) * block_count);
+	for (i = 0; i < block_count; i++)
+	{
+		next[i] = prev[i] = -1;
+		chain_of[i] = i;
+	}
+
+	int entry = 0;
+	for (i = 0; i < export_count; i++)
+	{
+		int addr = linker_find_addr(exports[i]);
+		if (addr != -1)
+		{
+			entry = find_block(addr);
+			break;
+		}
+	}
+
+	for (i = 0; i < edge_count; i++)
+	{
+		struct Edge edge = edges[i];
+		if (next[edge.from] != -1 || prev[edge.to] != -1 || edge.to == entry)
+			continue;
+
+		// A call only joins chains if it doesn't break a fall through
+		if (edge.type == EDGE_CALL && falls_through(blocks[edge.from].last_bytecode))
+			continue;
+
+		int from_chain = find_chain(chain_of, edge.from);
+		int to_chain = find_chain(chain_of, edge.to);
+		if (from_chain == to_chain)
+			continue;
+
+		next[edge.from] = edge.to;
+		prev[edge.to] = edge.from;
+		chain_of[to_chain] = from_chain;
+	}
+	free(edges);
+
+	// Order the chains, the entry first, then hottest first. Cold 
+	// blocks end up at the end, in their original order
+	int *heads = malloc(sizeof(int) * block_count);
+	int *order = malloc(sizeof(int) * block_count);
+	int head_count = 0, order_count = 0;
+	for (i = 0; i < block_count; i++)
+	{
+		if (prev[i] != -1 || i == entry)
+			continue;
+
+		// Rate each chain by its hottest block
+		int hottest = i;
+		for (j = i; j != -1; j = next[j])
+			if (blocks[j].count > blocks[hottest].count)
+				hottest = j;
+		blocks[i].count = blocks[hottest].count;
+		heads[head_count++] = i;
+	}
+	qsort(heads, head_count, sizeof(int), compare_hotness);
+
+	for (j = entry; j != -1; j = next[j])
+		order[order_count++] = j;
+	for (i = 0; i < head_count; i++)
+		for (j = heads[i]; j != -1; j = next[j])
+			order[order_count++] = j;
+	free(heads);
+	free(next);
+	free(prev);
+	free(chain_of);
+
+	// Write out the blocks in order, fixing up how they end
+	char *new_code = malloc(code_pointer + block_count * (sizeof(int) + 1));
+	struct Ref *new_refs = malloc(sizeof(struct Ref) * (ref_count + block_count));
+	int new_pointer = 0, new_ref_count = 0, jump_count = 0;
+	for (i = 0; i < block_count; i++)
+	{
+		int block = order[i];
+		int next_block = i + 1 < block_count ? order[i + 1] : -1;
+		struct Block *b = &blocks[block];
+		char last = b->last_bytecode;
+		int branch = branch_ref(block);
+		int fall = falls_through(last) && block + 1 < block_count ? block + 1 : -1;
+		int target = branch != -1 ? ref_block(branch) : -1;
+		int end = b->end, ref_end = block_ref_end(block);
+
+		// A jump to the next block isn't needed
+		if (last == BC_B_A && target == next_block)
+		{
+			end = b->last;
+			ref_end--;
+		}
+
+		b->shift = b->start - new_pointer;
+		memcpy(new_code + new_pointer, out_code + b->start, end - b->start);
+		for (ref = b->first_ref; ref < ref_end; ref++)
+		{
+			new_refs[new_ref_count] = refs[ref];
+			new_refs[new_ref_count++].pos -= b->shift;
+		}
+		new_pointer += end - b->start;
+
+		// If the branch goes to the next block, branch on the 
+		// opposite condition to the fall through block instead
+		if ((last == BC_BEQ_A || last == BC_BNE_A) && 
+			target == next_block && fall != -1 && fall != next_block)
+		{
+			new_code[b->last - b->shift] = (last == BC_BEQ_A ? BC_BNE_A : BC_BEQ_A);
+			new_refs[new_ref_count - 1].label = block_label(fall);
+			fall = next_block;
+		}
+
+		// Jump to the fall through block if it's not next
+		if (fall != -1 && fall != next_block)
+		{
+			int zero = 0;
+			new_code[new_pointer++] = BC_B_A;
+			new_refs[new_ref_count].pos = new_pointer;
+			new_refs[new_ref_count++].label = block_label(fall);
+			memcpy(new_code + new_pointer, &zero, sizeof(int));
+			new_pointer += sizeof(int);
+			jump_count++;
+		}
+	}
+	free(order);
+
+	// Move the labels to their new blocks
+	for (i = 0; i < label_count; i++)
+		if (labels[i].addr != -1 && labels[i].addr < code_pointer)
+			labels[i].addr -= blocks[find_block(labels[i].addr)].shift;
+
+	LOG("Laid out %i blocks, adding %i jumps\n", block_count, jump_count);
+	free(out_code);
+	free(refs);
+	out_code = new_code;
+	refs = new_refs;
+	code_pointer = new_pointer;
+	code_max_len = code_pointer + block_count * (sizeof(int) + 1);
+	ref_count = new_ref_count;
+	ref_max_len = ref_count + block_count;
+}
+
+// Branches to labels, and how many bytes each takes
+struct Branch
+{
+	int pos, ref, size;
+};
+
+// Shrink each branch to the smallest offset form its target fits in
+static void relax_branches()
+{
+	int i, ref = 0;
+	int branch_count = 0, branch_max_len = CHUNK_SIZE;
+	struct Branch *branches = malloc(sizeof(struct Branch) * branch_max_len);
+
+	// Start with every branch in the 8 bit form
+	for (i = 0; i < code_pointer; i = next_instruction(out_code, i))
+	{
+		while (ref < ref_count && refs[ref].pos <= i)
+			ref++;
+		if (!is_branch(out_code[i]) || ref >= ref_count || refs[ref].pos != i + 1)
+			continue;
+
+		if (branch_count >= branch_max_len)
+		{
+			branch_max_len *= 2;
+			branches = realloc(branches, sizeof(struct Branch) * branch_max_len);
+		}
+
+		branches[branch_count].pos = i;
+		branches[branch_count].ref = ref;
+		branches[branch_count++].size = 2;
+	}
+
+	// Bytes saved by the branches before each one
+	int *shrink = malloc(sizeof(int) * (branch_count + 1));
+
+	// Grow any branch whose target doesn't fit, until they all do. 
+	// Branches only ever grow, so this always finishes
+	int is_changed = 1, pass_count = 0;
+	while (is_changed)
+	{
+		is_changed = 0;
+		pass_count++;
+
+		shrink[0] = 0;
+		for (i = 0; i < branch_count; i++)
+			shrink[i + 1] = shrink[i] + sizeof(int) + 1 - branches[i].size;
+
+		for (i = 0; i < branch_count; i++)
+		{
+			struct Branch *branch = &branches[i];
+			int target = labels[refs[branch->ref].label].addr;
+
+			// Find the branches before the target to get its new address
+			int low = 0, high = branch_count;
+			while (low < high)
+			{
+				int mid = (low + high) / 2;
+				if (branches[mid].pos < target)
+					low = mid + 1;
+				else
+					high = mid;
+			}
+
+			int end = branch->pos - shrink[i] + branch->size;
+			int offset = target - shrink[low] - end;
+			if (branch->size == 2 && (offset < -128 || offset > 127))
+			{
+				branch->size = 3;
+				is_changed = 1;
+			}
+			else if (branch->size == 3 && (offset < -32768 || offset > 32767))
+			{
+				branch->size = sizeof(int) + 1;
+				is_changed = 1;
+			}
+		}
+	}
+
+	// Write out the code with the new branches. Short branches are 
+	// relative, so no longer need their ref
+	char *new_code = malloc(code_pointer - shrink[branch_count] + 1);
+	int new_pointer = 0, new_ref_count = 0, last = 0;
+	for (i = 0, ref = 0; i <= branch_count; i++)
+	{
+		int end = i < branch_count ? branches[i].pos : code_pointer;
+		memcpy(new_code + new_pointer, out_code + last, end - last);
+		new_pointer += end - last;
+
+		for (; ref < ref_count && refs[ref].pos < end; ref++)
+		{
+			refs[new_ref_count] = refs[ref];
+			refs[new_ref_count++].pos -= shrink[i];
+		}
+		if (i == branch_count)
+			break;
+
+		struct Branch *branch = &branches[i];
+		last = branch->pos + sizeof(int) + 1;
+		ref++;
+
+		if (branch->size == sizeof(int) + 1)
+		{
+			memcpy(new_code + new_pointer, out_code + branch->pos, branch->size);
+			refs[new_ref_count] = refs[branch->ref];
+			refs[new_ref_count++].pos = new_pointer + 1;
+			new_pointer += branch->size;
+			continue;
+		}
+
+		// The label's new address is now known
+		int target = labels[refs[branch->ref].label].addr;
+		int low = 0, high = branch_count;
+		while (low < high)
+		{
+			int mid = (low + high) / 2;
+			if (branches[mid].pos < target)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		int offset = target - shrink[low] - (new_pointer + branch->size);
+
+		new_code[new_pointer++] = branch_form(out_code[branch->pos], branch->size);
+		if (branch->size == 2)
+		{
+			new_code[new_pointer++] = (char)offset;
+		}
+		else
+		{
+			short s = offset;
+			memcpy(new_code + new_pointer, &s, sizeof(short));
+			new_pointer += sizeof(short);
+		}
+	}
+
+	// Move the labels
+	for (i = 0; i < label_count; i++)
+	{
+		int addr = labels[i].addr;
+		if (addr == -1)
+			continue;
+
+		int low = 0, high = branch_count;
+		while (low < high)
+		{
+			int mid = (low + high) / 2;
+			if (branches[mid].pos < addr)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		labels[i].addr = addr - shrink[low];
+	}
+
+	LOG("Relaxed %i branches in %i passes, saving %i bytes\n", 
+		branch_count, pass_count, shrink[branch_count]);
+	free(out_code);
+	out_code = new_code;
+	code_pointer = new_pointer;
+	code_max_len = code_pointer + 1;
+	ref_count = new_ref_count;
+	free(branches);
+	free(shrink);
+}
+
+void linker_write_profile(const char *path, const int *counts, const int *taken)
+{
+	int i;
+	FILE *out = fopen(path, "w");
+	if (out == NULL)
+	{
+		ERROR("Could not write profile");
+		return;
+	}
+
+	// Write each block that ran, by the label before it. Blocks are 
+	// counted rather than measured, so it still works after relaxing
+	build_blocks();
+	for (i = 0; i < block_count; i++)
+	{
+		struct Block *block = &blocks[i];
+		if (counts[block->start] == 0)
+			continue;
+
+		const char *name = ".";
+		int index = i;
+		if (block->base_label != -1)
+		{
+			name = LABEL_NAME(&labels[block->base_label]);
+			index -= find_block(labels[block->base_label].addr);
+		}
+
+		fprintf(out, "%s %i %i %i\n", name, index, 
+			counts[block->start], taken[block->last]);
+	}
+
+	fclose(out);
 }
 
 char *linker_link(int *len)
 {
-	int i, j;
+	int i;
 
 	for (i = 0; i < label_count; i++)
 	{
 		struct Label label = labels[i];
 		if (label.addr == -1)
-			ERROR("Undefined reference '%s'", label.name);
-		LOG("Linking '%s' (%i)\n", label.name, label.addr);
+			ERROR("Undefined reference '%s'", LABEL_NAME(&label));
+	}
 
-		for (j = 0; j < label.ref_count; j++)
-		{
-			memcpy(out_code + label.refs[j], 
-				&label.addr, sizeof(int));
-			LOG("	=> ref %i\n", label.refs[j]);
-		}
+	if (!has_error() && code_pointer > 0 && is_movable())
+	{
+		build_blocks();
+		remove_dead_code();
+		fold_identical_code();
+
+		build_blocks();
+		if (profile_path != NULL && read_profile())
+			lay_out_code();
+
+		relax_branches();
+	}
+
+	for (i = 0; i < label_count; i++)
+		if (labels[i].addr != -1)
+			LOG("Linking '%s' (%i)\n", LABEL_NAME(&labels[i]), labels[i].addr);
+
+	// Patch refs in order, adding the label address to the offset
+	for (i = 0; i < ref_count; i++)
+	{
+		struct Ref ref = refs[i];
+		int addr;
+
+		memcpy(&addr, out_code + ref.pos, sizeof(int));
+		addr += labels[ref.label].addr;
+		memcpy(out_code + ref.pos, &addr, sizeof(int));
+		LOG("	=> ref %i to '%s'\n", ref.pos, LABEL_NAME(&labels[ref.label]));
 	}
 
 	*len = code_pointer;
 	return out_code;
 }
 
+// Returns if labels are only used as branch or call targets in the 
+// linked code, so it can be rearranged knowing only where each goes
+int linker_is_relocatable()
+{
+	int i, next, ref = 0;
+
+	for (i = 0; i < code_pointer; i = next)
+	{
+		next = next_instruction(out_code, i);
+		for (; ref < ref_count && refs[ref].pos < next; ref++)
+			if (refs[ref].pos != i + 1 || 
+				!(is_branch(out_code[i]) || is_parallel(out_code[i])))
+				return 0;
+	}
+
+	return 1;
+}
+
 int linker_find_addr(const char *name)
 {
-	struct Label *label = find_label(name);
-	return label->addr;
+	int len = strlen(name);
+	struct Slot *slot = find_slot(name, len, hash_name(name, len));
+	if (slot->label == -1)
+		return -1;
+
+	return labels[slot->label].addr;
+}
+
+char *linker_symbols(int *len, int *count)
+{
+	int i, pointer = 0;
+	char *out = malloc(name_pointer + label_count * sizeof(int) + 1);
+
+	// Each symbol is its address then its name
+	*count = 0;
+	for (i = 0; i < label_count; i++)
+	{
+		if (labels[i].addr == -1)
+			continue;
+
+		const char *name = LABEL_NAME(&labels[i]);
+		memcpy(out + pointer, &labels[i].addr, sizeof(int));
+		strcpy(out + pointer + sizeof(int), name);
+		pointer += sizeof(int) + strlen(name) + 1;
+		(*count)++;
+	}
+
+	*len = pointer;
+	return out;
 }
 
 void linker_close()
 {
+	int i;
+	for (i = 0; i < export_count; i++)
+		free(exports[i]);
+
+	free(exports);
+	free(profile_path);
+	free(blocks);
 	free(labels);
+	free(refs);
+	free(names);
+	free(label_table);
+	constants_close();
 	if (out_code != NULL)
 		free(out_code);
 }
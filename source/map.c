@@ -0,0 +1,320 @@
+#include "map.h"
+#include "bytecode.h"
+#include "debug.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define START_CAPACITY	MAP_GROUP
+#define CONTROL_EMPTY	((signed char)0x80)
+#define CONTROL_DELETED	((signed char)0xFE)
+
+// Any VM can make maps, so changes to the table are locked. A map's
+// entries aren't, as with memory, sharing one is up to the guest
+struct Map map_table[MAP_MAX];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned mix(unsigned hash)
+{
+	// Murmur3 finalizer, so the low bits pick groups and the high
+	// bits fill control bytes
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+static unsigned hash_key(Register key)
+{
+	unsigned hash = 2166136261u;
+	const char *c;
+
+	switch (key.type)
+	{
+		case CONST_INT: return mix(key.i);
+		case CONST_FLOAT:
+		{
+			// -0 equals 0, so hashes the same
+			float f = key.f == 0 ? 0 : key.f;
+			unsigned bits;
+			memcpy(&bits, &f, sizeof(unsigned));
+			return mix(bits ^ 0x9e3779b9u);
+		}
+		case CONST_STRING:
+			for (c = key.str; *c != '\0'; c++)
+			{
+				hash ^= (unsigned char)*c;
+				hash *= 16777619u;
+			}
+			return mix(hash);
+	}
+	return 0;
+}
+
+static int is_same_key(Register a, Register b)
+{
+	if (a.type != b.type)
+		return 0;
+
+	switch (a.type)
+	{
+		case CONST_INT: return a.i == b.i;
+		case CONST_FLOAT: return a.f == b.f;
+		case CONST_STRING: return a.str == b.str || !strcmp(a.str, b.str);
+	}
+	return 0;
+}
+
+// Bits for each control byte in the group equal to 'byte'
+static inline unsigned match_byte(const signed char *group, signed char byte)
+{
+#ifdef __SSE2__
+	__m128i control = _mm_load_si128((const __m128i*)group);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(byte)));
+#else
+	unsigned bits = 0;
+	int i;
+	for (i = 0; i < MAP_GROUP; i++)
+		bits |= (unsigned)(group[i] == byte) << i;
+	return bits;
+#endif
+}
+
+// Bits for each slot in the group that's empty or deleted, which are
+// the only control bytes with their top bit set
+static inline unsigned match_free(const signed char *group)
+{
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_load_si128((const __m128i*)group));
+#else
+	unsigned bits = 0;
+	int i;
+	for (i = 0; i < MAP_GROUP; i++)
+		bits |= (unsigned)(group[i] < 0) << i;
+	return bits;
+#endif
+}
+
+// Returns the slot holding the key, or -1. Groups are probed
+// triangularly, which visits all of them as their count is a power of 2
+static int find_entry(struct Map *map, Register key, unsigned hash)
+{
+	unsigned group_mask = map->capacity / MAP_GROUP - 1;
+	unsigned group = (hash >> 7) & group_mask, step;
+	signed char tag = hash & 0x7F;
+
+	for (step = 1; ; step++)
+	{
+		const signed char *control = map->control + group * MAP_GROUP;
+		unsigned bits = match_byte(control, tag);
+		for (; bits != 0; bits &= bits - 1)
+		{
+			int slot = group * MAP_GROUP + __builtin_ctz(bits);
+			if (is_same_key(map->entries[slot].key, key))
+				return slot;
+		}
+
+		// A key is never past a group with an empty slot
+		if (match_byte(control, CONTROL_EMPTY) != 0)
+			return -1;
+		group = (group + step) & group_mask;
+	}
+}
+
+// Returns the first empty or deleted slot along the key's probe
+static int find_free(struct Map *map, unsigned hash)
+{
+	unsigned group_mask = map->capacity / MAP_GROUP - 1;
+	unsigned group = (hash >> 7) & group_mask, step;
+
+	for (step = 1; ; step++)
+	{
+		unsigned bits = match_free(map->control + group * MAP_GROUP);
+		if (bits != 0)
+			return group * MAP_GROUP + __builtin_ctz(bits);
+		group = (group + step) & group_mask;
+	}
+}
+
+static int allocate(struct Map *map, unsigned capacity)
+{
+	signed char *control = aligned_alloc(MAP_GROUP, capacity);
+	struct Entry *entries = malloc(sizeof(struct Entry) * capacity);
+	if (control == NULL || entries == NULL)
+	{
+		free(control);
+		free(entries);
+		return 0;
+	}
+
+	memset(control, CONTROL_EMPTY, capacity);
+	map->control = control;
+	map->entries = entries;
+	map->capacity = capacity;
+	map->count = 0;
+	map->used = 0;
+	return 1;
+}
+
+// Moves the entries to a new table, twice the size if they'd fill
+// over half of it, otherwise the same size with its deleted slots cleared
+static int rehash(struct Map *map)
+{
+	struct Map old = *map;
+	unsigned capacity = map->count * 2 >= map->capacity ? map->capacity * 2 : map->capacity;
+	unsigned i;
+
+	if (!allocate(map, capacity))
+		return 0;
+
+	for (i = 0; i < old.capacity; i++)
+	{
+		if (old.control[i] < 0)
+			continue;
+
+		unsigned hash = hash_key(old.entries[i].key);
+		int slot = find_free(map, hash);
+		map->control[slot] = hash & 0x7F;
+		map->entries[slot] = old.entries[i];
+	}
+	map->count = old.count;
+	map->used = old.count;
+
+	free(old.control);
+	free(old.entries);
+	return 1;
+}
+
+int map_create()
+{
+	struct Map map = { 0 };
+	if (!allocate(&map, START_CAPACITY))
+	{
+		LOG("Can't make a map\n");
+		return -1;
+	}
+	map.is_used = 1;
+
+	int slot;
+	pthread_mutex_lock(&lock);
+	for (slot = 0; slot < MAP_MAX && map_table[slot].is_used; slot++);
+	if (slot < MAP_MAX)
+		map_table[slot] = map;
+	pthread_mutex_unlock(&lock);
+
+	if (slot == MAP_MAX)
+	{
+		LOG("Too many maps\n");
+		free(map.control);
+		free(map.entries);
+		return -1;
+	}
+
+	return MAP_BASE + slot;
+}
+
+void map_free(int addr)
+{
+	pthread_mutex_lock(&lock);
+	struct Map *map = map_find(addr);
+	if (map != NULL)
+	{
+		free(map->control);
+		free(map->entries);
+		*map = (struct Map) { 0 };
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void map_close()
+{
+	int i;
+	for (i = 0; i < MAP_MAX; i++)
+		map_free(MAP_BASE + i);
+}
+
+Register map_get(int addr, Register key)
+{
+	struct Map *map = map_find(addr);
+	if (map == NULL || key.type == CONST_NULL)
+		return (Register) { CONST_NULL };
+
+	int slot = find_entry(map, key, hash_key(key));
+	return slot == -1 ? (Register) { CONST_NULL } : map->entries[slot].value;
+}
+
+void map_set(int addr, Register key, Register value)
+{
+	struct Map *map = map_find(addr);
+	if (map == NULL || key.type == CONST_NULL)
+		return;
+
+	unsigned hash = hash_key(key);
+	int slot = find_entry(map, key, hash);
+	if (slot != -1)
+	{
+		map->entries[slot].value = value;
+		return;
+	}
+
+	// Keep an empty slot in most groups, so misses stop early
+	if ((map->used + 1) * 8 > map->capacity * 7 && !rehash(map))
+	{
+		LOG("Can't grow map\n");
+		return;
+	}
+
+	slot = find_free(map, hash);
+	map->used += map->control[slot] == CONTROL_EMPTY;
+	map->count++;
+	map->control[slot] = hash & 0x7F;
+	map->entries[slot] = (struct Entry) { key, value };
+}
+
+void map_delete(int addr, Register key)
+{
+	struct Map *map = map_find(addr);
+	if (map == NULL || key.type == CONST_NULL)
+		return;
+
+	int slot = find_entry(map, key, hash_key(key));
+	if (slot == -1)
+		return;
+
+	// Probes stop at a group with an empty slot, so none pass through
+	// this one and the slot can be emptied rather than marked deleted
+	const signed char *group = map->control + slot / MAP_GROUP * MAP_GROUP;
+	if (match_byte(group, CONTROL_EMPTY) != 0)
+	{
+		map->control[slot] = CONTROL_EMPTY;
+		map->used--;
+	}
+	else
+	{
+		map->control[slot] = CONTROL_DELETED;
+	}
+	map->count--;
+}
+
+Register map_next(int addr, int *cursor)
+{
+	struct Map *map = map_find(addr);
+	unsigned i;
+
+	for (i = *cursor; map != NULL && *cursor >= 0 && i < map->capacity; i++)
+	{
+		if (map->control[i] >= 0)
+		{
+			*cursor = i + 1;
+			return map->entries[i].key;
+		}
+	}
+
+	*cursor = -1;
+	return (Register) { CONST_NULL };
+}
@@ -1,49 +1,77 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include "assembler.h"
-#include "tokenizer.h"
-#include "linker.h"
+#include <string.h>
+#include "program.h"
+#include "server.h"
+#include "image.h"
+#include "debug.h"
 #include "vm.h"
 
-void assemble_file(const char *file)
+int run_image(const char *path)
 {
-	int len;
-	char *code;
-
-	// Assemble code and add to linker
-	tokenizer_open(file);
-	code = assemble(&len);
-	linker_add_code(code, len);
-	
-	// Clean up
-	tokenizer_close();
-	free(code);
+	int len, constant_len, entry, offset;
+	const char *constants;
+
+	// Run the image straight from the mapped file
+	vm_init();
+	const char *code = image_map(path, &len, &constants, &constant_len, &entry);
+	if (code == NULL)
+	{
+		vm_close();
+		return 1;
+	}
+
+	const char *symbol = image_find_symbol(entry, &offset);
+	LOG("Running '%s' from %s + %i\n", path, symbol ? symbol : "?", offset);
+
+	if (!vm_constants(constants, constant_len))
+	{
+		ERROR("Image constants are malformed");
+		vm_close();
+		image_close();
+		return 1;
+	}
+
+	// Code that fails to verify aborts too
+	vm_map(code, len);
+	int state = vm_run(entry);
+
+	vm_close();
+	image_close();
+	return state == VM_ABORTED;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-	// Init
-	vm_init();
-	linker_init();
+	struct Options options;
+	struct Program program;
 
-	// Assemble all code
-	assemble_file("test.asm");
-	
-	// Link the code together
-	int len, main_addr = linker_find_addr("start");
-	char *code = linker_link(&len);
+	// '-r image' runs a linked image, without assembling anything
+	if (argc == 3 && !strcmp(argv[1], "-r"))
+		return run_image(argv[2]);
 
-	// If no start point was found, start at the beginning
-	if (main_addr == -1)
-		main_addr = 0;
+	// '--serve socket' keeps programs built, running them for clients
+	// which use '--send socket' followed by the usual arguments
+	if (argc == 3 && !strcmp(argv[1], "--serve"))
+		return server_run(argv[2]);
+	if (argc >= 3 && !strcmp(argv[1], "--send"))
+		return server_send(argv[2], argc - 3, argv + 3);
 
-	// Load and run the code
-	vm_load(0, code, len);
-	vm_run(main_addr);
+	// Init
+	vm_init();
+	program_parse(&options, argc - 1, argv + 1);
+
+	// Build the code, then either write it out or run it
+	int status = 0;
+	int is_built = program_build(&options, &program);
+	if (program_writes_out(&options))
+		status = is_built ? 0 : 1;
+	else
+		status = program_run(&options, &program);
 
 	// Clean up
+	program_close(&program);
+	program_free_options(&options);
 	vm_close();
-	linker_close();
-	return 0;
+	return status;
 }
-
@@ -0,0 +1,1619 @@
+#include "optimizer.h"
+#include "codec.h"
+#include "constants.h"
+#include "debug.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Registers are tracked as sets of bits, with the flags set by compares 
+// after them
+#define FLAGS		REGISTER_TOTAL
+#define SET_WORDS	(FLAGS / 64 + 1)
+#define NO_REG		-1
+
+// Branch forms, by how far they reach
+#define FORM_O8		0
+#define FORM_O16	1
+#define FORM_A		2
+
+// What's known about a register while propagating constants
+#define VALUE_UNKNOWN	0
+#define VALUE_CONST	1
+#define VALUE_VARYING	2
+
+#define MAX_PASSES	16
+#define MAX_INST_SIZE	16
+
+// Ints are worked on by value, anything else is kept as its index in
+// the constant pool
+typedef struct
+{
+	unsigned long long words[SET_WORDS];
+} RegSet;
+
+struct Const
+{
+	char type;
+	int i;
+	int index;
+};
+
+// A decoded instruction, always in its long form. Branches hold the
+// index of the instruction they go to, 'next' and 'prev' are the
+// order they're laid out in
+struct Inst
+{
+	char bytecode;
+	unsigned char regs[3];
+	int reg_count;
+	struct Const value;
+	int addr, offset;
+	int pos, new_pos;
+	int form;
+	int next, prev;
+	int block;
+	int is_removed;
+};
+
+struct Block
+{
+	int first, last;
+	int target, fall;
+	int pred_first, pred_count;
+	int is_root, is_reachable;
+	RegSet live_in, live_out;
+};
+
+// Constants known at a point in the code, the flags are the result
+// of the last compare
+struct State
+{
+	char kinds[REGISTER_TOTAL + 1];
+	int values[REGISTER_TOTAL + 1];
+	int is_set;
+};
+
+// Registers known to be a copy of another
+struct Copies
+{
+	short of[REGISTER_COUNT];
+	int is_set;
+};
+
+// Each branch, with its 8 and 16 bit offset forms
+static const char branch_forms[][3] =
+{
+	{ BC_CALL_O8, BC_CALL_O16, BC_CALL_A },
+	{ BC_B_O8, BC_B_O16, BC_B_A },
+	{ BC_BEQ_O8, BC_BEQ_O16, BC_BEQ_A },
+	{ BC_BNE_O8, BC_BNE_O16, BC_BNE_A },
+	{ BC_BLT_O8, BC_BLT_O16, BC_BLT_A },
+	{ BC_BGT_O8, BC_BGT_O16, BC_BGT_A },
+};
+
+#define BRANCH_FORM_COUNT sizeof(branch_forms) / sizeof(branch_forms[0])
+
+// Code being optimized
+static struct Inst 	*insts;
+static int 		inst_count;
+static int 		first_inst;
+static int 		*inst_at;
+static int 		code_len;
+
+// Entry points, kept as instruction indices
+static int 		*roots;
+static int 		root_count;
+
+// Control flow
+static struct Block 	*blocks;
+static int 		block_count;
+static int 		*preds;
+static unsigned 	*doms;
+static int 		dom_words;
+
+// Where each address in the original code moved to
+static int 		*addr_map;
+
+#define DOMINATES(a, b) (doms[(b) * dom_words + (a) / 32] >> ((a) % 32) & 1)
+
+static int branch_row(char bytecode)
+{
+	int i, j;
+	for (i = 0; i < BRANCH_FORM_COUNT; i++)
+		for (j = 0; j < 3; j++)
+			if (branch_forms[i][j] == bytecode)
+				return i;
+	return -1;
+}
+
+static int is_parallel(char bytecode)
+{
+	return bytecode == BC_PFOR_A || bytecode == BC_PSUM_A || 
+		bytecode == BC_PMIN_A || bytecode == BC_PMAX_A;
+}
+
+static int is_call(char bytecode)
+{
+	return bytecode == BC_CALL_A || is_parallel(bytecode);
+}
+
+// Instructions that go to another instruction
+static int has_target(char bytecode)
+{
+	return branch_row(bytecode) != -1 || is_parallel(bytecode);
+}
+
+static int is_branch(char bytecode)
+{
+	return branch_row(bytecode) != -1 && bytecode != BC_CALL_A;
+}
+
+static int ends_block(char bytecode)
+{
+	return is_branch(bytecode) || bytecode == BC_RET || bytecode == BC_HULT;
+}
+
+static int falls_through(char bytecode)
+{
+	return bytecode != BC_B_A && bytecode != BC_RET && bytecode != BC_HULT;
+}
+
+// The register, register form of each packed instruction
+static char long_form(char bytecode)
+{
+	switch (bytecode)
+	{
+		case BC_MOV_P: return BC_MOV_RR;
+		case BC_CMP_P: return BC_CMP_RR;
+		case BC_ADD_PR: return BC_ADD_RRR;
+		case BC_SUB_PR: return BC_SUB_RRR;
+		case BC_MUL_PR: return BC_MUL_RRR;
+		case BC_DIV_PR: return BC_DIV_RRR;
+	}
+
+	int row = branch_row(bytecode);
+	return row != -1 ? branch_forms[row][FORM_A] : bytecode;
+}
+
+static char packed_form(char bytecode)
+{
+	switch (bytecode)
+	{
+		case BC_MOV_RR: return BC_MOV_P;
+		case BC_CMP_RR: return BC_CMP_P;
+		case BC_ADD_RRR: return BC_ADD_PR;
+		case BC_SUB_RRR: return BC_SUB_PR;
+		case BC_MUL_RRR: return BC_MUL_PR;
+		case BC_DIV_RRR: return BC_DIV_PR;
+	}
+	return -1;
+}
+
+// The register, constant form of arithmetic
+static char const_form(char bytecode)
+{
+	switch (bytecode)
+	{
+		case BC_ADD_RRR: return BC_ADD_RRC;
+		case BC_SUB_RRR: return BC_SUB_RRC;
+		case BC_MUL_RRR: return BC_MUL_RRC;
+		case BC_DIV_RRR: return BC_DIV_RRC;
+	}
+	return -1;
+}
+
+static char arithmetic(char bytecode)
+{
+	switch (bytecode)
+	{
+		case BC_ADD_RRR: case BC_ADD_RRC: return '+';
+		case BC_SUB_RRR: case BC_SUB_RRC: return '-';
+		case BC_MUL_RRR: case BC_MUL_RRC: return '*';
+		case BC_DIV_RRR: case BC_DIV_RRC: return '/';
+	}
+	return 0;
+}
+
+static int is_const_arithmetic(char bytecode)
+{
+	return arithmetic(bytecode) && const_form(bytecode) == -1;
+}
+
+// Works out arithmetic the same way the VM does
+static int fold(char op, int a, int b)
+{
+	switch (op)
+	{
+		case '+': return a + b;
+		case '-': return a - b;
+		case '*': return a * b;
+		case '/': return b == 0 ? 0 : a / b;
+	}
+	return 0;
+}
+
+// The set of up to three registers, NO_REG leaving a place empty
+static RegSet reg_set(int a, int b, int c)
+{
+	RegSet set = { { 0 } };
+	int regs[3] = { a, b, c }, i;
+
+	for (i = 0; i < 3; i++)
+		if (regs[i] != NO_REG)
+			set.words[regs[i] / 64] |= 1ull << (regs[i] % 64);
+	return set;
+}
+
+// Every register and the flags
+static RegSet all_regs()
+{
+	RegSet set;
+	int i;
+
+	for (i = 0; i < SET_WORDS; i++)
+		set.words[i] = ~0ull;
+	set.words[FLAGS / 64] = (1ull << (FLAGS % 64) << 1) - 1;
+	return set;
+}
+
+// Registers every instruction might need, so they're always live
+static RegSet fixed_regs()
+{
+	return reg_set(REGISTER_PC, REGISTER_SP, REGISTER_FP);
+}
+
+static RegSet set_union(RegSet a, RegSet b)
+{
+	int i;
+	for (i = 0; i < SET_WORDS; i++)
+		a.words[i] |= b.words[i];
+	return a;
+}
+
+static RegSet set_minus(RegSet a, RegSet b)
+{
+	int i;
+	for (i = 0; i < SET_WORDS; i++)
+		a.words[i] &= ~b.words[i];
+	return a;
+}
+
+static int set_overlaps(RegSet a, RegSet b)
+{
+	int i;
+	for (i = 0; i < SET_WORDS; i++)
+		if (a.words[i] & b.words[i])
+			return 1;
+	return 0;
+}
+
+static int set_has(RegSet set, int reg)
+{
+	return set.words[reg / 64] >> (reg % 64) & 1;
+}
+
+// Takes the lowest register out of the set, -1 once it's empty
+static int set_pop(RegSet *set)
+{
+	int i;
+	for (i = 0; i < SET_WORDS; i++)
+	{
+		if (set->words[i] != 0)
+		{
+			int bit = __builtin_ctzll(set->words[i]);
+			set->words[i] &= set->words[i] - 1;
+			return i * 64 + bit;
+		}
+	}
+	return -1;
+}
+
+// Registers an instruction reads
+static RegSet inst_uses(struct Inst *inst)
+{
+	int r0 = inst->regs[0], r1 = inst->regs[1], r2 = inst->regs[2];
+
+	if (arithmetic(inst->bytecode))
+		return reg_set(r1, is_const_arithmetic(inst->bytecode) ? NO_REG : r2, NO_REG);
+
+	switch (inst->bytecode)
+	{
+		case BC_MOV_RR: case BC_MOV_RI: case BC_MOV_RIP: case BC_MOV_RIS:
+			return reg_set(r1, NO_REG, NO_REG);
+		case BC_MOV_AR: case BC_MOV_IC: case BC_MOV_IPC: case BC_MOV_ISC: case BC_CMP_RC:
+			return reg_set(r0, NO_REG, NO_REG);
+		case BC_MOV_IR: case BC_MOV_IPR: case BC_MOV_ISR: case BC_CMP_RR:
+			return reg_set(r0, r1, NO_REG);
+		case BC_PFOR_A: case BC_PSUM_A: case BC_PMIN_A: case BC_PMAX_A:
+			return all_regs();
+		case BC_XADD_RIR: case BC_LDB_RIR: case BC_LDE_RIR:
+		case BC_MAP_GET_RIR: case BC_MAP_NEXT_RIR:
+			return reg_set(r1, r2, NO_REG);
+		case BC_CAS_RIR: case BC_STB_IRR: case BC_STE_IRR: case BC_MAP_SET_IRR:
+			return reg_set(r0, r1, r2);
+		case BC_XCHG_RI: case BC_STL_IR: case BC_MAP_DEL_IR:
+			return reg_set(r0, r1, NO_REG);
+		case BC_LDA_RI:
+			return reg_set(r1, NO_REG, NO_REG);
+		case BC_PUSH_R:
+			return reg_set(r0, REGISTER_SP, NO_REG);
+		case BC_PUSH_C: case BC_POP_R: case BC_ENTER_A:
+			return reg_set(REGISTER_SP, NO_REG, NO_REG);
+		case BC_LEAVE:
+			return reg_set(REGISTER_FP, NO_REG, NO_REG);
+		case BC_INT_A:
+			return inst->addr == INT_PRINT ? reg_set(0, NO_REG, NO_REG) : all_regs();
+		case BC_CALL_A: case BC_RET:
+			return all_regs();
+		case BC_BEQ_A: case BC_BNE_A: case BC_BLT_A: case BC_BGT_A:
+			return reg_set(FLAGS, NO_REG, NO_REG);
+	}
+	return reg_set(NO_REG, NO_REG, NO_REG);
+}
+
+// Registers an instruction writes
+static RegSet inst_defs(struct Inst *inst)
+{
+	int r0 = inst->regs[0];
+
+	if (arithmetic(inst->bytecode))
+		return reg_set(r0, NO_REG, NO_REG);
+
+	switch (inst->bytecode)
+	{
+		case BC_MOV_RR: case BC_MOV_RC: case BC_MOV_RA:
+		case BC_MOV_RI: case BC_MOV_RIP: case BC_MOV_RIS:
+		case BC_XADD_RIR: case BC_XCHG_RI: case BC_LDA_RI: 
+		case BC_LDB_RIR: case BC_LDE_RIR:
+		case BC_MAP_NEW_R: case BC_MAP_GET_RIR:
+			return reg_set(r0, NO_REG, NO_REG);
+		case BC_MAP_NEXT_RIR:
+			return reg_set(r0, inst->regs[2], NO_REG);
+		case BC_CAS_RIR:
+			return reg_set(r0, FLAGS, NO_REG);
+		case BC_POP_R:
+			return reg_set(r0, REGISTER_SP, NO_REG);
+		case BC_PUSH_R: case BC_PUSH_C: case BC_ENTER_A: case BC_LEAVE:
+			return reg_set(REGISTER_SP, NO_REG, NO_REG);
+		case BC_RET:
+			return reg_set(REGISTER_SP, REGISTER_FP, NO_REG);
+		case BC_CMP_RR: case BC_CMP_RC:
+			return reg_set(FLAGS, NO_REG, NO_REG);
+		case BC_CALL_A: case BC_PFOR_A: case BC_PSUM_A: case BC_PMIN_A: case BC_PMAX_A:
+			return all_regs();
+		case BC_INT_A:
+			return inst->addr == INT_PRINT ? reg_set(NO_REG, NO_REG, NO_REG) : all_regs();
+	}
+	return reg_set(NO_REG, NO_REG, NO_REG);
+}
+
+// The operands of an instruction that are registers it only reads, 
+// as bits of 'regs'
+static int use_slots(char bytecode)
+{
+	if (arithmetic(bytecode))
+		return is_const_arithmetic(bytecode) ? 2 : 2 | 4;
+
+	switch (bytecode)
+	{
+		case BC_MOV_RR: case BC_MOV_RI: case BC_MOV_RIP: case BC_MOV_RIS: return 2;
+		case BC_MOV_AR: case BC_MOV_IC: case BC_MOV_IPC: case BC_MOV_ISC: return 1;
+		case BC_CMP_RC: case BC_PUSH_R: return 1;
+		case BC_MOV_IR: case BC_MOV_IPR: case BC_MOV_ISR: case BC_CMP_RR: return 1 | 2;
+		case BC_PFOR_A: case BC_PSUM_A: case BC_PMIN_A: case BC_PMAX_A: return 1 | 2;
+		case BC_XADD_RIR: case BC_CAS_RIR: case BC_LDB_RIR: case BC_LDE_RIR: return 2 | 4;
+		case BC_MAP_GET_RIR: return 2 | 4;
+		case BC_STB_IRR: case BC_STE_IRR: case BC_MAP_SET_IRR: return 1 | 2 | 4;
+		case BC_XCHG_RI: case BC_LDA_RI: case BC_MAP_NEXT_RIR: return 2;
+		case BC_STL_IR: case BC_MAP_DEL_IR: return 1 | 2;
+	}
+	return 0;
+}
+
+// Instructions that only write registers, so can go if they're not read
+static int is_removable(struct Inst *inst)
+{
+	switch (inst->bytecode)
+	{
+		case BC_MOV_RR: case BC_MOV_RC: case BC_MOV_RA:
+		case BC_MOV_RI: case BC_MOV_RIP: case BC_MOV_RIS:
+		case BC_CMP_RR: case BC_CMP_RC:
+			break;
+		default:
+			if (!arithmetic(inst->bytecode))
+				return 0;
+	}
+
+	return !set_overlaps(inst_defs(inst), fixed_regs());
+}
+
+// Instructions that give the same result wherever they run
+static int is_pure(struct Inst *inst)
+{
+	if (inst->bytecode != BC_MOV_RR && inst->bytecode != BC_MOV_RC && !arithmetic(inst->bytecode))
+		return 0;
+
+	return !set_overlaps(set_union(inst_defs(inst), inst_uses(inst)),
+		set_union(fixed_regs(), reg_set(FLAGS, NO_REG, NO_REG)));
+}
+
+static int resolve(int i)
+{
+	while (i != -1 && insts[i].is_removed)
+		i = insts[i].next;
+	return i;
+}
+
+static int next_kept(int i)
+{
+	return resolve(insts[i].next);
+}
+
+static int prev_kept(int i)
+{
+	i = insts[i].prev;
+	while (i != -1 && insts[i].is_removed)
+		i = insts[i].prev;
+	return i;
+}
+
+static void unlink_inst(int i)
+{
+	struct Inst *inst = &insts[i];
+	if (inst->prev != -1)
+		insts[inst->prev].next = inst->next;
+	else
+		first_inst = inst->next;
+
+	if (inst->next != -1)
+		insts[inst->next].prev = inst->prev;
+}
+
+static void link_before(int i, int at)
+{
+	insts[i].next = at;
+	insts[i].prev = insts[at].prev;
+	if (insts[at].prev != -1)
+		insts[insts[at].prev].next = i;
+	else
+		first_inst = i;
+	insts[at].prev = i;
+}
+
+static void read_const(int index, struct Const *value)
+{
+	const char *encoded = constants_find(index);
+	value->type = encoded[0];
+	value->i = 0;
+	value->index = index;
+	if (value->type == CONST_INT)
+		memcpy(&value->i, encoded + 1, sizeof(int));
+}
+
+// Decodes the instruction at 'p', returning the start of the next
+// one, or -1 if it's not valid
+static int decode(const char *code, int len, int p, struct Inst *inst)
+{
+	struct Decoded decoded;
+	int i;
+
+	memset(inst, 0, sizeof(struct Inst));
+	if (!codec_decode(code, len, p, &decoded))
+		return -1;
+
+	for (i = 0; i < decoded.operand_count; i++)
+	{
+		struct Operand *operand = &decoded.operands[i];
+		switch (operand->type)
+		{
+			case OPERAND_CONST: read_const(operand->value, &inst->value); break;
+			case OPERAND_ADDR: case OPERAND_OFFSET8: case OPERAND_OFFSET16:
+				inst->addr = operand->value;
+				break;
+			case OPERAND_INDIRECT_PLUS: case OPERAND_INDIRECT_SUB:
+				inst->offset = operand->offset;
+				inst->regs[inst->reg_count++] = operand->value;
+				break;
+			default: inst->regs[inst->reg_count++] = operand->value; break;
+		}
+	}
+
+	inst->bytecode = long_form(decoded.bytecode);
+	return decoded.end;
+}
+
+// Decodes the whole program, returns 0 if it can't be optimized
+static int decode_all(const char *code, int len)
+{
+	int i, p;
+
+	insts = malloc(sizeof(struct Inst) * (len + 1));
+	inst_at = malloc(sizeof(int) * (len + 1));
+	inst_count = 0;
+	first_inst = len > 0 ? 0 : -1;
+	for (i = 0; i <= len; i++)
+		inst_at[i] = -1;
+
+	for (p = 0; p < len;)
+	{
+		struct Inst *inst = &insts[inst_count];
+		int next = decode(code, len, p, inst);
+		if (next == -1)
+			return 0;
+
+		// Reading PC would see where the code has moved
+		for (i = 0; i < inst->reg_count; i++)
+			if (inst->regs[i] == REGISTER_PC)
+				return 0;
+
+		inst->pos = p;
+		inst->prev = inst_count - 1;
+		inst->next = next < len ? inst_count + 1 : -1;
+		inst_at[p] = inst_count++;
+		p = next;
+	}
+
+	// Branches go to instructions rather than addresses
+	for (i = 0; i < inst_count; i++)
+	{
+		struct Inst *inst = &insts[i];
+		if (!has_target(inst->bytecode))
+			continue;
+
+		if (inst->addr < 0 || inst->addr >= len || inst_at[inst->addr] == -1)
+			return 0;
+		inst->addr = inst_at[inst->addr];
+	}
+
+	return 1;
+}
+
+static void find_reachable()
+{
+	int *stack = malloc(sizeof(int) * (block_count + 1));
+	int i, b, stack_count = 0;
+
+	for (i = 0; i < root_count; i++)
+	{
+		b = insts[roots[i]].block;
+		if (!blocks[b].is_reachable)
+		{
+			blocks[b].is_reachable = 1;
+			stack[stack_count++] = b;
+		}
+	}
+
+	while (stack_count > 0)
+	{
+		int next[3], next_count = 0;
+		b = stack[--stack_count];
+		next[next_count++] = blocks[b].target;
+		next[next_count++] = blocks[b].fall;
+
+		// Whatever's called is reached too
+		for (i = blocks[b].first; ; i = next_kept(i))
+		{
+			if (is_call(insts[i].bytecode))
+			{
+				int called = insts[insts[i].addr].block;
+				if (!blocks[called].is_reachable)
+				{
+					blocks[called].is_reachable = 1;
+					stack[stack_count++] = called;
+				}
+			}
+			if (i == blocks[b].last)
+				break;
+		}
+
+		for (i = 0; i < next_count; i++)
+		{
+			if (next[i] != -1 && !blocks[next[i]].is_reachable)
+			{
+				blocks[next[i]].is_reachable = 1;
+				stack[stack_count++] = next[i];
+			}
+		}
+	}
+
+	free(stack);
+}
+
+// Splits the code into blocks at each branch target and after each
+// branch, and links them together
+static void build_blocks()
+{
+	char *is_leader = calloc(inst_count + 1, 1);
+	int i, b;
+
+	// Branches go to the instruction that's actually there
+	for (i = resolve(first_inst); i != -1; i = next_kept(i))
+	{
+		struct Inst *inst = &insts[i];
+		if (has_target(inst->bytecode) && resolve(inst->addr) != -1)
+		{
+			inst->addr = resolve(inst->addr);
+			is_leader[inst->addr] = 1;
+		}
+
+		if (ends_block(inst->bytecode) && next_kept(i) != -1)
+			is_leader[next_kept(i)] = 1;
+	}
+
+	for (i = 0; i < root_count; i++)
+	{
+		roots[i] = resolve(roots[i]);
+		is_leader[roots[i]] = 1;
+	}
+
+	block_count = 0;
+	blocks = realloc(blocks, sizeof(struct Block) * (inst_count + 1));
+	for (i = resolve(first_inst); i != -1; i = next_kept(i))
+	{
+		if (is_leader[i] || block_count == 0)
+		{
+			struct Block *block = &blocks[block_count++];
+			memset(block, 0, sizeof(struct Block));
+			block->first = i;
+			block->target = block->fall = -1;
+		}
+
+		blocks[block_count - 1].last = i;
+		insts[i].block = block_count - 1;
+	}
+
+	for (b = 0; b < block_count; b++)
+	{
+		struct Inst *last = &insts[blocks[b].last];
+		int next = next_kept(blocks[b].last);
+		if (is_branch(last->bytecode))
+			blocks[b].target = insts[last->addr].block;
+		if (falls_through(last->bytecode) && next != -1)
+			blocks[b].fall = insts[next].block;
+	}
+
+	// Entry points, and anything called, can be reached from outside
+	for (i = 0; i < root_count; i++)
+		blocks[insts[roots[i]].block].is_root = 1;
+	for (i = resolve(first_inst); i != -1; i = next_kept(i))
+		if (is_call(insts[i].bytecode))
+			blocks[insts[insts[i].addr].block].is_root = 1;
+
+	// Predecessors of each block
+	preds = realloc(preds, sizeof(int) * (block_count * 2 + 1));
+	for (b = 0, i = 0; b < block_count; b++)
+	{
+		if (blocks[b].target != -1)
+			blocks[blocks[b].target].pred_count++;
+		if (blocks[b].fall != -1)
+			blocks[blocks[b].fall].pred_count++;
+	}
+
+	for (b = 0, i = 0; b < block_count; b++)
+	{
+		blocks[b].pred_first = i;
+		i += blocks[b].pred_count;
+		blocks[b].pred_count = 0;
+	}
+
+	for (b = 0; b < block_count; b++)
+	{
+		struct Block *target = blocks[b].target != -1 ? &blocks[blocks[b].target] : NULL;
+		struct Block *fall = blocks[b].fall != -1 ? &blocks[blocks[b].fall] : NULL;
+		if (target != NULL)
+			preds[target->pred_first + target->pred_count++] = b;
+		if (fall != NULL)
+			preds[fall->pred_first + fall->pred_count++] = b;
+	}
+
+	find_reachable();
+	free(is_leader);
+}
+
+static int remove_block(int b)
+{
+	int i, count = 0;
+	for (i = blocks[b].first; ; i = next_kept(i))
+	{
+		int is_last = (i == blocks[b].last);
+		insts[i].is_removed = 1;
+		count++;
+		if (is_last)
+			break;
+	}
+	return count;
+}
+
+static int remove_unreachable()
+{
+	int b, count = 0;
+	for (b = 0; b < block_count; b++)
+		if (!blocks[b].is_reachable)
+			count += remove_block(b);
+	return count;
+}
+
+static void set_value(struct State *state, int reg, int kind, int value)
+{
+	state->kinds[reg] = kind;
+	state->values[reg] = value;
+}
+
+static int is_known(struct State *state, int reg)
+{
+	return state->kinds[reg] == VALUE_CONST;
+}
+
+static void transfer_consts(struct State *state, struct Inst *inst)
+{
+	RegSet defs = inst_defs(inst);
+	int d = inst->regs[0], a = inst->regs[1], b = inst->regs[2];
+	int kind = VALUE_VARYING, value = 0, reg = d, r;
+	char op = arithmetic(inst->bytecode);
+
+	if (op && is_const_arithmetic(inst->bytecode))
+	{
+		if (is_known(state, a) && inst->value.type == CONST_INT)
+		{
+			kind = VALUE_CONST;
+			value = fold(op, state->values[a], inst->value.i);
+		}
+	}
+	else if (op)
+	{
+		if (is_known(state, a) && is_known(state, b))
+		{
+			kind = VALUE_CONST;
+			value = fold(op, state->values[a], state->values[b]);
+		}
+	}
+	else switch (inst->bytecode)
+	{
+		case BC_MOV_RR:
+			kind = state->kinds[a];
+			value = state->values[a];
+			break;
+		case BC_MOV_RC:
+			if (inst->value.type == CONST_INT)
+			{
+				kind = VALUE_CONST;
+				value = inst->value.i;
+			}
+			break;
+		case BC_CMP_RR: case BC_CMP_RC:
+		{
+			int is_const = inst->bytecode == BC_CMP_RC;
+			reg = FLAGS;
+			if (is_known(state, d) && (is_const ? inst->value.type == CONST_INT : is_known(state, a)))
+			{
+				int other = is_const ? inst->value.i : state->values[a];
+				kind = VALUE_CONST;
+				value = state->values[d] < other ? -1 : state->values[d] > other;
+			}
+			break;
+		}
+	}
+
+	int is_known_def = kind == VALUE_CONST && set_has(defs, reg);
+	while ((r = set_pop(&defs)) != -1)
+		set_value(state, r, VALUE_VARYING, 0);
+
+	if (is_known_def)
+		set_value(state, reg, kind, value);
+
+	set_value(state, REGISTER_PC, VALUE_VARYING, 0);
+	set_value(state, REGISTER_SP, VALUE_VARYING, 0);
+	set_value(state, REGISTER_FP, VALUE_VARYING, 0);
+}
+
+static int meet_state(struct State *into, struct State *from)
+{
+	int r, is_changed = 0;
+	if (!into->is_set)
+	{
+		*into = *from;
+		into->is_set = 1;
+		return 1;
+	}
+
+	for (r = 0; r <= FLAGS; r++)
+	{
+		if (into->kinds[r] == VALUE_CONST && (from->kinds[r] != VALUE_CONST ||
+			from->values[r] != into->values[r]))
+		{
+			set_value(into, r, VALUE_VARYING, 0);
+			is_changed = 1;
+		}
+	}
+
+	return is_changed;
+}
+
+// Returns 1 if a branch is always taken, 0 if never, or -1 if not known
+static int branch_outcome(struct State *state, char bytecode)
+{
+	if (bytecode == BC_B_A)
+		return 1;
+	if (!is_known(state, FLAGS))
+		return -1;
+
+	int compare = state->values[FLAGS];
+	switch (bytecode)
+	{
+		case BC_BEQ_A: return compare == 0;
+		case BC_BNE_A: return compare != 0;
+		case BC_BLT_A: return compare < 0;
+		case BC_BGT_A: return compare > 0;
+	}
+	return -1;
+}
+
+static void make_const(struct Inst *inst, char bytecode, int value)
+{
+	inst->bytecode = bytecode;
+	inst->value.type = CONST_INT;
+	inst->value.i = value;
+	inst->value.index = -1;
+}
+
+// Rewrites an instruction using the constants known before it,
+// returns if it changed
+static int rewrite_consts(struct State *state, struct Inst *inst)
+{
+	int d = inst->regs[0], a = inst->regs[1], b = inst->regs[2];
+	char op = arithmetic(inst->bytecode);
+
+	if (op && !is_const_arithmetic(inst->bytecode))
+	{
+		if (is_known(state, a) && is_known(state, b))
+		{
+			make_const(inst, BC_MOV_RC, fold(op, state->values[a], state->values[b]));
+			return 1;
+		}
+
+		if (is_known(state, b))
+		{
+			make_const(inst, const_form(inst->bytecode), state->values[b]);
+			return 1;
+		}
+
+		// Only if the order doesn't matter
+		if (is_known(state, a) && (op == '+' || op == '*'))
+		{
+			inst->regs[1] = b;
+			make_const(inst, const_form(inst->bytecode), state->values[a]);
+			return 1;
+		}
+		return 0;
+	}
+
+	if (op && is_known(state, a) && inst->value.type == CONST_INT)
+	{
+		make_const(inst, BC_MOV_RC, fold(op, state->values[a], inst->value.i));
+		return 1;
+	}
+
+	switch (inst->bytecode)
+	{
+		case BC_MOV_RR: if (!is_known(state, a)) return 0; make_const(inst, BC_MOV_RC, state->values[a]); return 1;
+		case BC_CMP_RR: if (!is_known(state, a)) return 0; make_const(inst, BC_CMP_RC, state->values[a]); return 1;
+		case BC_PUSH_R: if (!is_known(state, d)) return 0; make_const(inst, BC_PUSH_C, state->values[d]); return 1;
+		case BC_MOV_AR: if (!is_known(state, d)) return 0; make_const(inst, BC_MOV_AC, state->values[d]); return 1;
+		case BC_MOV_IR: if (!is_known(state, a)) return 0; make_const(inst, BC_MOV_IC, state->values[a]); return 1;
+		case BC_MOV_IPR: if (!is_known(state, a)) return 0; make_const(inst, BC_MOV_IPC, state->values[a]); return 1;
+		case BC_MOV_ISR: if (!is_known(state, a)) return 0; make_const(inst, BC_MOV_ISC, state->values[a]); return 1;
+
+		case BC_BEQ_A: case BC_BNE_A: case BC_BLT_A: case BC_BGT_A:
+			switch (branch_outcome(state, inst->bytecode))
+			{
+				case 1: inst->bytecode = BC_B_A; return 1;
+				case 0: inst->is_removed = 1; return 1;
+			}
+			break;
+	}
+
+	return 0;
+}
+
+// Propagates constants through the code, following only the way
+// branches go when the compare they test is known. Code that's never
+// reached that way is removed
+static int propagate_constants()
+{
+	struct State *states = calloc(block_count, sizeof(struct State));
+	int *stack = malloc(sizeof(int) * (block_count + 1));
+	char *is_queued = calloc(block_count, 1);
+	int b, i, r, count = 0, stack_count = 0;
+
+	for (b = 0; b < block_count; b++)
+	{
+		if (!blocks[b].is_root)
+			continue;
+
+		for (r = 0; r <= FLAGS; r++)
+			set_value(&states[b], r, VALUE_VARYING, 0);
+		states[b].is_set = 1;
+		stack[stack_count++] = b;
+		is_queued[b] = 1;
+	}
+
+	while (stack_count > 0)
+	{
+		b = stack[--stack_count];
+		is_queued[b] = 0;
+
+		struct State state = states[b];
+		for (i = blocks[b].first; ; i = next_kept(i))
+		{
+			transfer_consts(&state, &insts[i]);
+			if (i == blocks[b].last)
+				break;
+		}
+
+		struct Inst *last = &insts[blocks[b].last];
+		int outcome = is_branch(last->bytecode) ? branch_outcome(&state, last->bytecode) : -1;
+		int next[2] = { outcome != 0 ? blocks[b].target : -1, outcome != 1 ? blocks[b].fall : -1 };
+		for (i = 0; i < 2; i++)
+		{
+			if (next[i] != -1 && meet_state(&states[next[i]], &state) && !is_queued[next[i]])
+			{
+				stack[stack_count++] = next[i];
+				is_queued[next[i]] = 1;
+			}
+		}
+	}
+
+	for (b = 0; b < block_count; b++)
+	{
+		if (!states[b].is_set)
+		{
+			count += remove_block(b);
+			continue;
+		}
+
+		struct State state = states[b];
+		for (i = blocks[b].first; i != -1;)
+		{
+			int next = (i == blocks[b].last) ? -1 : next_kept(i);
+			count += rewrite_consts(&state, &insts[i]);
+			if (!insts[i].is_removed)
+				transfer_consts(&state, &insts[i]);
+			i = next;
+		}
+	}
+
+	free(states);
+	free(stack);
+	free(is_queued);
+	return count;
+}
+
+static void transfer_copies(struct Copies *copies, struct Inst *inst)
+{
+	RegSet defs = inst_defs(inst);
+	int r;
+
+	for (r = 0; r < REGISTER_COUNT; r++)
+		if (set_has(defs, r) || (copies->of[r] != -1 && set_has(defs, copies->of[r])))
+			copies->of[r] = -1;
+
+	if (inst->bytecode == BC_MOV_RR && inst->regs[0] < REGISTER_COUNT &&
+		inst->regs[1] < REGISTER_COUNT && inst->regs[0] != inst->regs[1])
+	{
+		copies->of[inst->regs[0]] = inst->regs[1];
+	}
+}
+
+static int meet_copies(struct Copies *into, struct Copies *from)
+{
+	int r, is_changed = 0;
+	if (!into->is_set)
+	{
+		*into = *from;
+		into->is_set = 1;
+		return 1;
+	}
+
+	for (r = 0; r < REGISTER_COUNT; r++)
+	{
+		if (into->of[r] != -1 && into->of[r] != from->of[r])
+		{
+			into->of[r] = -1;
+			is_changed = 1;
+		}
+	}
+
+	return is_changed;
+}
+
+// Reads the original register rather than a copy of it, so the copy
+// can be removed if nothing else needs it
+static int propagate_copies()
+{
+	struct Copies *copies = calloc(block_count, sizeof(struct Copies));
+	int *stack = malloc(sizeof(int) * (block_count + 1));
+	char *is_queued = calloc(block_count, 1);
+	int b, i, r, count = 0, stack_count = 0;
+
+	for (b = 0; b < block_count; b++)
+	{
+		if (!blocks[b].is_root)
+			continue;
+
+		memset(copies[b].of, -1, sizeof(copies[b].of));
+		copies[b].is_set = 1;
+		stack[stack_count++] = b;
+		is_queued[b] = 1;
+	}
+
+	while (stack_count > 0)
+	{
+		b = stack[--stack_count];
+		is_queued[b] = 0;
+
+		struct Copies state = copies[b];
+		for (i = blocks[b].first; ; i = next_kept(i))
+		{
+			transfer_copies(&state, &insts[i]);
+			if (i == blocks[b].last)
+				break;
+		}
+
+		int next[2] = { blocks[b].target, blocks[b].fall };
+		for (i = 0; i < 2; i++)
+		{
+			if (next[i] != -1 && meet_copies(&copies[next[i]], &state) && !is_queued[next[i]])
+			{
+				stack[stack_count++] = next[i];
+				is_queued[next[i]] = 1;
+			}
+		}
+	}
+
+	for (b = 0; b < block_count; b++)
+	{
+		struct Copies state = copies[b];
+		if (!state.is_set)
+			continue;
+
+		for (i = blocks[b].first; i != -1;)
+		{
+			struct Inst *inst = &insts[i];
+			int next = (i == blocks[b].last) ? -1 : next_kept(i);
+			int slots = use_slots(inst->bytecode);
+
+			for (r = 0; r < inst->reg_count; r++)
+			{
+				int reg = inst->regs[r];
+				if ((slots >> r & 1) && reg < REGISTER_COUNT && state.of[reg] != -1)
+				{
+					inst->regs[r] = state.of[reg];
+					count++;
+				}
+			}
+
+			transfer_copies(&state, inst);
+			i = next;
+		}
+	}
+
+	free(copies);
+	free(stack);
+	free(is_queued);
+	return count;
+}
+
+// Replaces arithmetic by constants with cheaper instructions
+static int reduce_strength()
+{
+	int i, count = 0;
+
+	for (i = resolve(first_inst); i != -1; i = next_kept(i))
+	{
+		struct Inst *inst = &insts[i];
+		char op = arithmetic(inst->bytecode);
+		int c = inst->value.i;
+
+		if (inst->bytecode == BC_MOV_RR && inst->regs[0] == inst->regs[1])
+		{
+			inst->is_removed = 1;
+			count++;
+			continue;
+		}
+
+		if (!op || !is_const_arithmetic(inst->bytecode) || inst->value.type != CONST_INT)
+			continue;
+
+		if ((op == '*' && c == 1) || (op == '/' && c == 1) ||
+			((op == '+' || op == '-') && c == 0))
+		{
+			inst->bytecode = BC_MOV_RR;
+			count++;
+		}
+		else if (op == '*' && c == 0)
+		{
+			make_const(inst, BC_MOV_RC, 0);
+			count++;
+		}
+		else if (op == '*' && c == 2)
+		{
+			inst->bytecode = BC_ADD_RRR;
+			inst->regs[2] = inst->regs[1];
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static RegSet live_before(struct Inst *inst, RegSet live)
+{
+	return set_union(set_union(set_minus(live, inst_defs(inst)), inst_uses(inst)), fixed_regs());
+}
+
+static void find_liveness()
+{
+	int b, i, is_changed = 1;
+
+	for (b = 0; b < block_count; b++)
+		blocks[b].live_in = blocks[b].live_out = reg_set(NO_REG, NO_REG, NO_REG);
+
+	while (is_changed)
+	{
+		is_changed = 0;
+		for (b = block_count - 1; b >= 0; b--)
+		{
+			RegSet live = fixed_regs();
+			if (blocks[b].target != -1)
+				live = set_union(live, blocks[blocks[b].target].live_in);
+			if (blocks[b].fall != -1)
+				live = set_union(live, blocks[blocks[b].fall].live_in);
+			blocks[b].live_out = live;
+
+			for (i = blocks[b].last; ; i = prev_kept(i))
+			{
+				live = live_before(&insts[i], live);
+				if (i == blocks[b].first)
+					break;
+			}
+
+			if (memcmp(&live, &blocks[b].live_in, sizeof(RegSet)))
+			{
+				blocks[b].live_in = live;
+				is_changed = 1;
+			}
+		}
+	}
+}
+
+// Removes instructions that write registers nothing reads
+static int remove_dead_stores()
+{
+	int b, i, count = 0;
+
+	find_liveness();
+	for (b = 0; b < block_count; b++)
+	{
+		RegSet live = blocks[b].live_out;
+		for (i = blocks[b].last; i != -1;)
+		{
+			struct Inst *inst = &insts[i];
+			int prev = (i == blocks[b].first) ? -1 : prev_kept(i);
+
+			if (is_removable(inst) && !set_overlaps(inst_defs(inst), live))
+			{
+				inst->is_removed = 1;
+				count++;
+			}
+			else
+			{
+				live = live_before(inst, live);
+			}
+			i = prev;
+		}
+	}
+
+	return count;
+}
+
+static void find_dominators()
+{
+	int b, i, j, is_changed = 1;
+	unsigned *dom = malloc(sizeof(unsigned) * (block_count / 32 + 1));
+
+	dom_words = block_count / 32 + 1;
+	doms = realloc(doms, sizeof(unsigned) * dom_words * (block_count + 1));
+	for (b = 0; b < block_count; b++)
+	{
+		memset(doms + b * dom_words, blocks[b].is_root ? 0 : 0xFF, sizeof(unsigned) * dom_words);
+		doms[b * dom_words + b / 32] |= 1u << (b % 32);
+	}
+
+	while (is_changed)
+	{
+		is_changed = 0;
+		for (b = 0; b < block_count; b++)
+		{
+			if (blocks[b].is_root || !blocks[b].is_reachable)
+				continue;
+
+			// Dominated by whatever dominates every way in
+			memset(dom, 0xFF, sizeof(unsigned) * dom_words);
+			for (i = 0; i < blocks[b].pred_count; i++)
+			{
+				int pred = preds[blocks[b].pred_first + i];
+				if (blocks[pred].is_reachable)
+					for (j = 0; j < dom_words; j++)
+						dom[j] &= doms[pred * dom_words + j];
+			}
+			dom[b / 32] |= 1u << (b % 32);
+
+			if (memcmp(dom, doms + b * dom_words, sizeof(unsigned) * dom_words))
+			{
+				memcpy(doms + b * dom_words, dom, sizeof(unsigned) * dom_words);
+				is_changed = 1;
+			}
+		}
+	}
+
+	free(dom);
+}
+
+// Finds the blocks of the loop with header 'h', returns 0 if it's not one
+static int find_loop(int h, char *in_loop)
+{
+	int *stack = malloc(sizeof(int) * (block_count + 1));
+	int i, stack_count = 0, latch_count = 0;
+
+	memset(in_loop, 0, block_count);
+	in_loop[h] = 1;
+	for (i = 0; i < blocks[h].pred_count; i++)
+	{
+		int latch = preds[blocks[h].pred_first + i];
+		if (!DOMINATES(h, latch))
+			continue;
+
+		latch_count++;
+		if (!in_loop[latch])
+		{
+			in_loop[latch] = 1;
+			stack[stack_count++] = latch;
+		}
+	}
+
+	// Everything that reaches a latch without going through the header
+	while (stack_count > 0)
+	{
+		int b = stack[--stack_count];
+		for (i = 0; i < blocks[b].pred_count; i++)
+		{
+			int pred = preds[blocks[b].pred_first + i];
+			if (!in_loop[pred] && blocks[pred].is_reachable)
+			{
+				in_loop[pred] = 1;
+				stack[stack_count++] = pred;
+			}
+		}
+	}
+
+	free(stack);
+	return latch_count > 0;
+}
+
+// Moves the instructions of a loop that give the same result every
+// time around to just before it. Returns how many were moved
+static int hoist_loop(int h, char *in_loop)
+{
+	int def_counts[FLAGS + 1] = { 0 };
+	RegSet exit_live = reg_set(NO_REG, NO_REG, NO_REG);
+	int b, i, r, count = 0;
+	int header = blocks[h].first, anchor = header, first_moved = -1;
+
+	// Instructions are put in front of the header, so nothing in the
+	// loop can fall into it, and it can't be entered from outside
+	int before = prev_kept(header);
+	if (before != -1 && in_loop[insts[before].block] && falls_through(insts[before].bytecode))
+		return 0;
+
+	for (b = 0; b < block_count; b++)
+	{
+		if (!in_loop[b])
+			continue;
+		if (blocks[b].is_root)
+			return 0;
+
+		for (i = blocks[b].first; ; i = next_kept(i))
+		{
+			RegSet defs = inst_defs(&insts[i]);
+			while ((r = set_pop(&defs)) != -1)
+				def_counts[r]++;
+			if (i == blocks[b].last)
+				break;
+		}
+
+		if (blocks[b].target != -1 && !in_loop[blocks[b].target])
+			exit_live = set_union(exit_live, blocks[blocks[b].target].live_in);
+		if (blocks[b].fall != -1 && !in_loop[blocks[b].fall])
+			exit_live = set_union(exit_live, blocks[blocks[b].fall].live_in);
+	}
+
+	for (b = 0; b < block_count; b++)
+	{
+		if (!in_loop[b])
+			continue;
+
+		// Values live after the loop must only be moved if they're
+		// always worked out on the way out
+		int is_on_exits = 1;
+		for (i = 0; i < block_count; i++)
+		{
+			int is_exit = in_loop[i] &&
+				((blocks[i].target != -1 && !in_loop[blocks[i].target]) ||
+				(blocks[i].fall != -1 && !in_loop[blocks[i].fall]));
+			if (is_exit && !DOMINATES(b, i))
+				is_on_exits = 0;
+		}
+
+		for (i = blocks[b].first; i != -1;)
+		{
+			struct Inst *inst = &insts[i];
+			int next = (i == blocks[b].last) ? -1 : next_kept(i);
+			int d = inst->regs[0];
+			RegSet uses = inst_uses(inst);
+
+			int is_invariant = is_pure(inst) && def_counts[d] == 1 &&
+				!set_has(blocks[h].live_in, d) &&
+				(is_on_exits || !set_has(exit_live, d));
+			while (is_invariant && (r = set_pop(&uses)) != -1)
+				if (def_counts[r] != 0)
+					is_invariant = 0;
+
+			if (is_invariant)
+			{
+				if (i == anchor)
+				{
+					anchor = next_kept(i);
+				}
+				else
+				{
+					unlink_inst(i);
+					link_before(i, anchor);
+				}
+
+				if (first_moved == -1)
+					first_moved = i;
+				def_counts[d] = 0;
+				count++;
+			}
+			i = next;
+		}
+	}
+
+	if (count == 0)
+		return 0;
+
+	// Branches from inside the loop go to what's left of the header,
+	// and from outside to what's been moved in front of it
+	for (i = resolve(first_inst); i != -1; i = next_kept(i))
+	{
+		struct Inst *inst = &insts[i];
+		if (is_branch(inst->bytecode) && inst->addr == header)
+			inst->addr = in_loop[inst->block] ? anchor : first_moved;
+	}
+
+	return count;
+}
+
+static int hoist_invariants()
+{
+	char *in_loop = malloc(block_count + 1);
+	int h, count = 0;
+
+	find_liveness();
+	find_dominators();
+	for (h = 0; h < block_count && count == 0; h++)
+		if (!blocks[h].is_root && blocks[h].is_reachable && find_loop(h, in_loop))
+			count = hoist_loop(h, in_loop);
+
+	free(in_loop);
+	return count;
+}
+
+static int remove_jumps_to_next()
+{
+	int i, count = 0;
+	for (i = resolve(first_inst); i != -1; i = next_kept(i))
+	{
+		if (is_branch(insts[i].bytecode) && resolve(insts[i].addr) == next_kept(i))
+		{
+			insts[i].is_removed = 1;
+			count++;
+		}
+	}
+	return count;
+}
+
+static int const_index(struct Const *value)
+{
+	// Ints may have been folded, so are found in the pool again
+	return value->type == CONST_INT ? constants_add_int(value->i) : value->index;
+}
+
+// Writes an instruction to 'out', returning its length
+static int encode(struct Inst *inst, char *out)
+{
+	struct Decoded decoded = { inst->bytecode, inst->new_pos };
+	const char *types = bytecode_operands[(unsigned char)inst->bytecode];
+	int i, reg = 0;
+	int row = branch_row(inst->bytecode);
+
+	if (row != -1)
+	{
+		decoded.bytecode = branch_forms[row][inst->form];
+		decoded.operands[decoded.operand_count++].value = insts[resolve(inst->addr)].new_pos;
+		return codec_encode(&decoded, out);
+	}
+
+	// Register only instructions pack two registers into a byte,
+	// taking the same operands
+	char packed = packed_form(inst->bytecode);
+	if (packed != -1 && inst->regs[0] <= 15 && inst->regs[1] <= 15)
+		decoded.bytecode = packed;
+
+	for (i = 0; types[i] != OPERAND_NONE; i++)
+	{
+		struct Operand *operand = &decoded.operands[decoded.operand_count++];
+		switch (types[i])
+		{
+			case OPERAND_CONST: operand->value = const_index(&inst->value); break;
+
+			// Parallel loops call an instruction, not an address
+			case OPERAND_ADDR:
+				operand->value = is_parallel(inst->bytecode) ? 
+					insts[resolve(inst->addr)].new_pos : inst->addr;
+				break;
+
+			default:
+				operand->value = inst->regs[reg++];
+				operand->offset = inst->offset;
+				break;
+		}
+	}
+	return codec_encode(&decoded, out);
+}
+
+// Lays the code out again, starting with every branch in its shortest
+// form and lengthening those that can't reach
+static char *lower(int *out_len)
+{
+	char buffer[MAX_INST_SIZE];
+	int i, pos = 0, is_changed = 1;
+
+	for (i = resolve(first_inst); i != -1; i = next_kept(i))
+		insts[i].form = FORM_O8;
+
+	while (is_changed)
+	{
+		pos = 0;
+		for (i = resolve(first_inst); i != -1; i = next_kept(i))
+		{
+			insts[i].new_pos = pos;
+			pos += encode(&insts[i], buffer);
+		}
+
+		is_changed = 0;
+		for (i = resolve(first_inst); i != -1; i = next_kept(i))
+		{
+			struct Inst *inst = &insts[i];
+			if (branch_row(inst->bytecode) == -1 || inst->form == FORM_A)
+				continue;
+
+			int size = inst->form == FORM_O8 ? 2 : 3;
+			int offset = insts[resolve(inst->addr)].new_pos - (inst->new_pos + size);
+			if ((inst->form == FORM_O8 && (offset < -128 || offset > 127)) ||
+				(inst->form == FORM_O16 && (offset < -32768 || offset > 32767)))
+			{
+				inst->form++;
+				is_changed = 1;
+			}
+		}
+	}
+
+	char *out = malloc(pos + 1);
+	for (i = resolve(first_inst); i != -1; i = next_kept(i))
+		encode(&insts[i], out + insts[i].new_pos);
+
+	*out_len = pos;
+	return out;
+}
+
+static void free_state()
+{
+	free(insts);
+	free(inst_at);
+	free(roots);
+	free(blocks);
+	free(preds);
+	free(doms);
+	insts = NULL;
+	inst_at = NULL;
+	roots = NULL;
+	blocks = NULL;
+	preds = NULL;
+	doms = NULL;
+}
+
+char *optimizer_run(const char *code, int len, int *entries, int entry_count, int *out_len)
+{
+	int i, pass;
+
+	optimizer_close();
+	code_len = len;
+	if (!decode_all(code, len))
+	{
+		LOG("Code can't be optimized\n");
+		free_state();
+		return NULL;
+	}
+
+	root_count = entry_count;
+	roots = malloc(sizeof(int) * (entry_count + 1));
+	for (i = 0; i < entry_count; i++)
+	{
+		if (entries[i] < 0 || entries[i] >= len || inst_at[entries[i]] == -1)
+		{
+			LOG("Entry point %i isn't an instruction\n", entries[i]);
+			free_state();
+			return NULL;
+		}
+		roots[i] = inst_at[entries[i]];
+	}
+
+	for (pass = 1; pass <= MAX_PASSES; pass++)
+	{
+		int count = 0;
+		build_blocks(); count += remove_unreachable();
+		build_blocks(); count += propagate_constants();
+		build_blocks(); count += propagate_copies();
+		count += reduce_strength();
+		build_blocks(); count += remove_dead_stores();
+		build_blocks(); count += hoist_invariants();
+		build_blocks(); count += remove_jumps_to_next();
+		if (count == 0)
+			break;
+	}
+
+	build_blocks();
+	char *out = lower(out_len);
+	LOG("Optimized %i bytes to %i in %i passes\n", len, *out_len, pass);
+
+	// Addresses go to the instruction that's now there
+	addr_map = malloc(sizeof(int) * (len + 1));
+	for (i = 0; i <= len; i++)
+		addr_map[i] = -1;
+	for (i = 0; i < inst_count; i++)
+	{
+		int kept = resolve(i);
+		if (kept != -1)
+			addr_map[insts[i].pos] = insts[kept].new_pos;
+	}
+
+	for (i = 0; i < entry_count; i++)
+		entries[i] = insts[roots[i]].new_pos;
+
+	free_state();
+	return out;
+}
+
+int optimizer_find_addr(int addr)
+{
+	if (addr_map == NULL || addr < 0 || addr > code_len)
+		return -1;
+	return addr_map[addr];
+}
+
+void optimizer_close()
+{
+	free(addr_map);
+	addr_map = NULL;
+}
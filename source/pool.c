@@ -0,0 +1,105 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_THREADS 	16
+
+static pthread_t 	*threads;
+static int 		thread_count;
+static pthread_mutex_t 	lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t 	run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t 	has_task = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t 	has_finished = PTHREAD_COND_INITIALIZER;
+
+// The task being run, each new one bumps the generation so 
+// threads know they haven't run it yet
+static void 		(*current_task)(int worker, void *data);
+static void 		*current_data;
+static int 		generation;
+static int 		running_count;
+static int 		is_closing;
+
+static void *worker_main(void *arg)
+{
+	int worker = (int)(long)arg, seen = 0;
+
+	pthread_mutex_lock(&lock);
+	for (;;)
+	{
+		while (generation == seen && !is_closing)
+			pthread_cond_wait(&has_task, &lock);
+		if (is_closing)
+			break;
+
+		seen = generation;
+		pthread_mutex_unlock(&lock);
+		current_task(worker, current_data);
+		pthread_mutex_lock(&lock);
+
+		if (--running_count == 0)
+			pthread_cond_signal(&has_finished);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+int pool_size()
+{
+	int i;
+
+	// One thread for each core
+	pthread_mutex_lock(&lock);
+	if (threads == NULL)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = cores < 1 ? 1 : cores > MAX_THREADS ? MAX_THREADS : cores;
+		threads = malloc(sizeof(pthread_t) * thread_count);
+		for (i = 0; i < thread_count; i++)
+			pthread_create(&threads[i], NULL, worker_main, (void*)(long)i);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return thread_count;
+}
+
+int pool_run(void (*task)(int worker, void *data), void *data)
+{
+	pool_size();
+
+	// Only one task at a time, whichever thread it's from
+	if (pthread_mutex_trylock(&run_lock))
+		return 0;
+
+	pthread_mutex_lock(&lock);
+	current_task = task;
+	current_data = data;
+	running_count = thread_count;
+	generation++;
+	pthread_cond_broadcast(&has_task);
+
+	while (running_count > 0)
+		pthread_cond_wait(&has_finished, &lock);
+	pthread_mutex_unlock(&lock);
+	pthread_mutex_unlock(&run_lock);
+	return 1;
+}
+
+void pool_close()
+{
+	int i;
+	if (threads == NULL)
+		return;
+
+	pthread_mutex_lock(&lock);
+	is_closing = 1;
+	pthread_cond_broadcast(&has_task);
+	pthread_mutex_unlock(&lock);
+
+	for (i = 0; i < thread_count; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	threads = NULL;
+	is_closing = 0;
+}
@@ -0,0 +1,422 @@
+#include "program.h"
+#include "assembler.h"
+#include "tokenizer.h"
+#include "compiler.h"
+#include "linker.h"
+#include "constants.h"
+#include "codec.h"
+#include "optimizer.h"
+#include "channel.h"
+#include "shared.h"
+#include "filemap.h"
+#include "region.h"
+#include "map.h"
+#include "input.h"
+#include "image.h"
+#include "aot.h"
+#include "debug.h"
+#include "vm.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void assemble_file(const char *file)
+{
+	int len;
+	char *code;
+
+	// Assemble code and add to linker
+	tokenizer_open(file);
+	code = assemble(&len);
+	linker_add_code(code, len);
+
+	// Clean up
+	tokenizer_close();
+	free(code);
+}
+
+static void compile_file(const char *file)
+{
+	int len;
+	char *code;
+
+	// Compile to assembly, then assemble that like any other file
+	char *text = compiler_compile(file);
+	tokenizer_open(NULL);
+	tokenizer_insert(text);
+	code = assemble(&len);
+	linker_add_code(code, len);
+
+	// Clean up
+	tokenizer_close();
+	free(text);
+	free(code);
+}
+
+static int is_basic_file(const char *file)
+{
+	int len = strlen(file);
+	return len > 4 && !strcmp(file + len - 4, ".bas");
+}
+
+static int write_image(const char *path, const struct Program *program, int is_optimized)
+{
+	int i, pointer, symbol_len, symbol_count;
+	char *symbols = linker_symbols(&symbol_len, &symbol_count);
+
+	// Symbols go to where the optimizer moved their code
+	for (i = 0, pointer = 0; is_optimized && i < symbol_count; i++)
+	{
+		int addr;
+		memcpy(&addr, symbols + pointer, sizeof(int));
+		addr = optimizer_find_addr(addr);
+		memcpy(symbols + pointer, &addr, sizeof(int));
+		pointer += sizeof(int) + strlen(symbols + pointer + sizeof(int)) + 1;
+	}
+
+	int is_written = image_write(path, program->code, program->len,
+		program->constants, program->constants_len, program->main_addr,
+		symbols, symbol_len, symbol_count);
+
+	free(symbols);
+	return is_written;
+}
+
+static int write_listing(const char *path, const struct Program *program)
+{
+	struct Decoded inst;
+	int p, count;
+
+	FILE *out = fopen(path, "w");
+	if (out == NULL)
+	{
+		ERROR("Can't write '%.48s'", path);
+		return 0;
+	}
+
+	Register *constants = constants_load(program->constants, program->constants_len, &count);
+	for (p = 0; p < program->len && codec_decode(program->code, program->len, p, &inst); p = inst.end)
+		codec_print(out, &inst, constants);
+
+	free(constants);
+	fclose(out);
+	return 1;
+}
+
+static char *optimize(const char *code, int *len, const char **exports, int export_count, int *main_addr)
+{
+	int i, entry_count = 0, out_len;
+	int *entries = malloc(sizeof(int) * (export_count + 1));
+
+	// Exported labels can be called from outside, so are kept as
+	// entry points along with the start
+	for (i = 0; i < export_count; i++)
+	{
+		int addr = linker_find_addr(exports[i]);
+		if (addr != -1)
+			entries[entry_count++] = addr;
+	}
+	entries[entry_count++] = *main_addr;
+
+	char *optimized = optimizer_run(code, *len, entries, entry_count, &out_len);
+	if (optimized != NULL)
+	{
+		*len = out_len;
+		*main_addr = entries[entry_count - 1];
+	}
+
+	free(entries);
+	return optimized;
+}
+
+// '.bas' files are compiled, anything else is assembled. '-e label'
+// keeps a label even if it's not used, '-p file' writes an execution
+// profile, '-u file' lays out the code using one, '-O2' optimizes the
+// linked code and '-o image' writes the linked image. '-c size' creates
+// a channel between VMs, '-s size' one with a single sender and
+// receiver, numbered in order, '-m size' maps a shared segment of that
+// many ints, '-t label' runs another VM from the label on its own
+// thread, '-b budget' stops the program once it's taken that many
+// backward branches, calls and returns, '-a file.c' translates the
+// linked code to C, '-d file' lists it and '-i file' reads input from
+// the file rather than stdin
+void program_parse(struct Options *options, int argc, char *argv[])
+{
+	int i;
+
+	*options = (struct Options) { 0 };
+	options->files = malloc(sizeof(char*) * argc);
+	options->exports = malloc(sizeof(char*) * argc);
+	options->spawns = malloc(sizeof(char*) * argc);
+	options->channel_sizes = malloc(sizeof(int) * argc);
+	options->channel_types = malloc(sizeof(int) * argc);
+	options->segment_sizes = malloc(sizeof(int) * argc);
+
+	for (i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-m") && i + 1 < argc)
+		{
+			options->segment_sizes[options->segment_count++] = atoi(argv[++i]);
+			continue;
+		}
+
+		if ((!strcmp(argv[i], "-c") || !strcmp(argv[i], "-s")) && i + 1 < argc)
+		{
+			int type = argv[i][1] == 's' ? CHANNEL_SPSC : CHANNEL_MPMC;
+			options->channel_types[options->channel_count] = type;
+			options->channel_sizes[options->channel_count++] = atoi(argv[++i]);
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-t") && i + 1 < argc)
+		{
+			options->spawns[options->spawn_count++] = argv[++i];
+			options->exports[options->export_count++] = argv[i];
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-b") && i + 1 < argc)
+		{
+			options->budget = atoi(argv[++i]);
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-O2"))
+		{
+			options->is_optimized = 1;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-o") && i + 1 < argc)
+		{
+			options->image_out = argv[++i];
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-a") && i + 1 < argc)
+		{
+			options->aot_out = argv[++i];
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-i") && i + 1 < argc)
+		{
+			options->input_path = argv[++i];
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-d") && i + 1 < argc)
+		{
+			options->listing_out = argv[++i];
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-e") && i + 1 < argc)
+		{
+			options->exports[options->export_count++] = argv[++i];
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-p") && i + 1 < argc)
+		{
+			options->profile_out = argv[++i];
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-u") && i + 1 < argc)
+		{
+			options->profile_in = argv[++i];
+			continue;
+		}
+
+		options->files[options->file_count++] = argv[i];
+	}
+
+	if (options->file_count == 0)
+		options->files[options->file_count++] = "test.asm";
+}
+
+void program_free_options(struct Options *options)
+{
+	free(options->files);
+	free(options->exports);
+	free(options->spawns);
+	free(options->channel_sizes);
+	free(options->channel_types);
+	free(options->segment_sizes);
+}
+
+int program_writes_out(const struct Options *options)
+{
+	return options->image_out != NULL || options->aot_out != NULL ||
+		options->listing_out != NULL;
+}
+
+int program_build(const struct Options *options, struct Program *program)
+{
+	int i;
+
+	// Init
+	*program = (struct Program) { 0 };
+	linker_init();
+	linker_export("start");
+	for (i = 0; i < options->export_count; i++)
+		linker_export(options->exports[i]);
+	if (options->profile_in != NULL)
+		linker_use_profile(options->profile_in);
+
+	// Assemble all code, '.bas' files are compiled first
+	for (i = 0; i < options->file_count; i++)
+	{
+		if (is_basic_file(options->files[i]))
+			compile_file(options->files[i]);
+		else
+			assemble_file(options->files[i]);
+	}
+
+	// Link the code together
+	int len;
+	char *code = linker_link(&len);
+	int main_addr = linker_find_addr("start");
+
+	// If no start point was found, start at the beginning
+	if (main_addr == -1)
+		main_addr = 0;
+
+	program->spawn_count = options->spawn_count;
+	program->spawn_addrs = malloc(sizeof(int) * (options->spawn_count + 1));
+	for (i = 0; i < options->spawn_count; i++)
+		program->spawn_addrs[i] = linker_find_addr(options->spawns[i]);
+
+	// The profile is of the code as it was linked, so don't
+	// optimize it when profiling
+	if (options->is_optimized && options->profile_out == NULL && !has_error())
+	{
+		if (linker_is_relocatable())
+			program->optimized = optimize(code, &len, options->exports,
+				options->export_count, &main_addr);
+		else
+			LOG("Code uses absolute addresses, not optimizing\n");
+	}
+
+	for (i = 0; program->optimized != NULL && i < options->spawn_count; i++)
+		program->spawn_addrs[i] = optimizer_find_addr(program->spawn_addrs[i]);
+
+	program->code = program->optimized != NULL ? program->optimized : code;
+	program->len = len;
+	program->main_addr = main_addr;
+
+	// The program keeps its own copy of the pool, as the code
+	const char *pool = constants_pool(&program->constants_len);
+	program->constants = malloc(program->constants_len + 1);
+	memcpy(program->constants, pool, program->constants_len);
+
+	int is_written = 1;
+	if (options->image_out != NULL)
+		is_written = !has_error() && write_image(options->image_out, program,
+			program->optimized != NULL);
+	if (options->aot_out != NULL)
+		is_written = is_written && !has_error() && aot_write(options->aot_out, options, program);
+	if (options->listing_out != NULL)
+		is_written = is_written && !has_error() && write_listing(options->listing_out, program);
+	return is_written;
+}
+
+int program_run(const struct Options *options, const struct Program *program)
+{
+	int i;
+	if (options->input_path != NULL && !input_open(options->input_path))
+		return 1;
+
+	vm_budget(options->budget, VM_BUDGET_ABORT, NULL, NULL);
+
+	for (i = 0; i < options->channel_count; i++)
+		if (channel_create(options->channel_sizes[i], options->channel_types[i]) == -1)
+		{
+			channel_free_all();
+			input_close();
+			return 1;
+		}
+
+	for (i = 0; i < options->segment_count; i++)
+	{
+		int addr = shared_create(options->segment_sizes[i]);
+		if (addr == -1)
+		{
+			channel_free_all();
+			shared_close();
+			input_close();
+			return 1;
+		}
+		LOG("Shared segment at %i\n", addr);
+	}
+
+	// Count each instruction and branch when profiling
+	int *counts = NULL, *taken = NULL;
+	if (options->profile_out != NULL)
+	{
+		counts = calloc(program->len, sizeof(int));
+		taken = calloc(program->len, sizeof(int));
+		vm_profile(counts, taken);
+	}
+
+	// Run the code, with any other VMs alongside
+	vm_constants(program->constants, program->constants_len);
+	vm_map(program->code, program->len);
+	int state = VM_ABORTED, is_spawned = 1;
+	for (i = 0; i < program->spawn_count && is_spawned; i++)
+	{
+		if (program->spawn_addrs[i] == -1)
+		{
+			ERROR("Can't find '%s'", options->spawns[i]);
+			is_spawned = 0;
+		}
+	}
+
+	for (i = 0; i < program->spawn_count && is_spawned; i++)
+	{
+		if (!vm_spawn(program->spawn_addrs[i]))
+		{
+			ERROR("Can't run '%s'", options->spawns[i]);
+			is_spawned = 0;
+		}
+	}
+
+	// Main only runs if they all started, closing the channels lets 
+	// any that did finish
+	if (is_spawned)
+		state = vm_run(program->main_addr);
+	else
+		for (i = 0; i < options->channel_count; i++)
+			channel_close(i);
+
+	vm_join();
+	if (is_spawned && state == VM_ABORTED && options->budget > 0)
+		LOG("Stopped after a budget of %i\n", options->budget);
+
+	if (options->profile_out != NULL)
+	{
+		if (is_spawned)
+			linker_write_profile(options->profile_out, counts, taken);
+		vm_profile(NULL, NULL);
+		free(counts);
+		free(taken);
+	}
+
+	// Clean up
+	channel_free_all();
+	shared_close();
+	filemap_close();
+	region_close();
+	map_close();
+	input_close();
+	return state == VM_ABORTED;
+}
+
+void program_close(struct Program *program)
+{
+	free(program->spawn_addrs);
+	free(program->optimized);
+	free(program->constants);
+	optimizer_close();
+	linker_close();
+}
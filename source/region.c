@@ -0,0 +1,82 @@
+#include "region.h"
+#include "bytecode.h"
+#include "debug.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// Aligned so regions can be handed to vector code as they are
+#define REGION_ALIGN	64
+
+// Any VM can allocate regions, so changes to the table are locked
+struct Region region_table[REGION_MAX];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int element_size(int type)
+{
+	switch (type)
+	{
+		case ELEMENT_INT8: return 1;
+		case ELEMENT_INT32: return 4;
+		case ELEMENT_INT64: return 8;
+		case ELEMENT_FLOAT32: return 4;
+		case ELEMENT_FLOAT64: return 8;
+	}
+	return 0;
+}
+
+// Guest code checks for -1, so failing to allocate isn't an error
+int region_create(int type, int count)
+{
+	size_t size = (size_t)element_size(type) * count;
+	if (size == 0 || count < 0)
+	{
+		LOG("Can't make a region of %i of type %i\n", count, type);
+		return -1;
+	}
+
+	// Round up to the alignment, as aligned_alloc needs
+	size_t rounded = (size + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+	void *data = aligned_alloc(REGION_ALIGN, rounded);
+	if (data == NULL)
+	{
+		LOG("Can't make a region of %i of type %i\n", count, type);
+		return -1;
+	}
+	memset(data, 0, size);
+
+	int slot;
+	pthread_mutex_lock(&lock);
+	for (slot = 0; slot < REGION_MAX && region_table[slot].is_used; slot++);
+	if (slot < REGION_MAX)
+		region_table[slot] = (struct Region) { data, count, type, 1 };
+	pthread_mutex_unlock(&lock);
+
+	if (slot == REGION_MAX)
+	{
+		LOG("Too many regions\n");
+		free(data);
+		return -1;
+	}
+
+	return REGION_BASE + slot;
+}
+
+void region_free(int addr)
+{
+	pthread_mutex_lock(&lock);
+	struct Region *region = region_find(addr);
+	if (region != NULL && region->is_used)
+	{
+		free(region->data);
+		*region = (struct Region) { 0 };
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void region_close()
+{
+	int i;
+	for (i = 0; i < REGION_MAX; i++)
+		region_free(REGION_BASE + i);
+}
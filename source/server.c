@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "program.h"
+#include "debug.h"
+#include "vm.h"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#define CACHE_SIZE	32
+#define LATENCY_COUNT	1024
+#define BACKLOG		64
+
+// Clients pass their stdin, stdout and stderr, which the program
+// uses in place of the server's while it runs
+#define FD_COUNT	3
+
+// Sources are checked by time and size first, then by hash if they've
+// been touched, so saving a file without changing it doesn't rebuild
+struct Source
+{
+	char *path;
+	struct timespec mtime;
+	off_t size;
+	unsigned long long hash;
+};
+
+// A built program, keyed by the directory and arguments it was
+// built with
+struct Entry
+{
+	char *key;
+	int key_len;
+	struct Source *sources;
+	int source_count;
+	struct Program program;
+	long long last_used;
+};
+
+static struct Entry cache[CACHE_SIZE];
+static int cache_count;
+static int is_serving;
+
+// Latencies are kept for the most recent requests, in microseconds
+static long long request_count, hit_count, build_count;
+static long long latencies[LATENCY_COUNT];
+
+static int hash_file(const char *path, unsigned long long *hash)
+{
+	char buffer[1 << 16];
+	int i, len, fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 0;
+
+	// FNV-1a
+	*hash = 14695981039346656037ULL;
+	while ((len = read(fd, buffer, sizeof(buffer))) > 0)
+	{
+		for (i = 0; i < len; i++)
+		{
+			*hash ^= (unsigned char)buffer[i];
+			*hash *= 1099511628211ULL;
+		}
+	}
+
+	close(fd);
+	return len == 0;
+}
+
+static int is_same_time(struct timespec a, struct timespec b)
+{
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static int is_fresh(struct Source *source)
+{
+	struct stat info;
+	unsigned long long hash;
+	if (stat(source->path, &info) == -1)
+		return 0;
+
+	if (is_same_time(info.st_mtim, source->mtime) && info.st_size == source->size)
+		return 1;
+
+	if (!hash_file(source->path, &hash) || hash != source->hash)
+		return 0;
+
+	source->mtime = info.st_mtim;
+	source->size = info.st_size;
+	return 1;
+}
+
+static void free_sources(struct Source *sources, int count)
+{
+	int i;
+	for (i = 0; i < count; i++)
+		free(sources[i].path);
+	free(sources);
+}
+
+// Reads what the sources are before building, so changes made while
+// building are seen next time. NULL if any can't be read
+static struct Source *read_sources(const struct Options *options, int *count)
+{
+	int i, is_read = 1;
+	struct Source *sources = malloc(sizeof(struct Source) * (options->file_count + 1));
+
+	*count = 0;
+	for (i = 0; i <= options->file_count; i++)
+	{
+		const char *path = i < options->file_count ? options->files[i] : options->profile_in;
+		struct stat info;
+		if (path == NULL)
+			continue;
+
+		struct Source *source = &sources[(*count)++];
+		source->path = strdup(path);
+		if (stat(path, &info) == -1 || !hash_file(path, &source->hash))
+		{
+			is_read = 0;
+			continue;
+		}
+		source->mtime = info.st_mtim;
+		source->size = info.st_size;
+	}
+
+	if (is_read)
+		return sources;
+
+	free_sources(sources, *count);
+	return NULL;
+}
+
+static void free_entry(struct Entry *entry)
+{
+	free(entry->key);
+	free_sources(entry->sources, entry->source_count);
+	free(entry->program.spawn_addrs);
+	free(entry->program.optimized);
+	free(entry->program.constants);
+}
+
+static struct Entry *find_entry(const char *key, int key_len)
+{
+	int i;
+	for (i = 0; i < cache_count; i++)
+		if (cache[i].key_len == key_len && !memcmp(cache[i].key, key, key_len))
+			return &cache[i];
+	return NULL;
+}
+
+// Keeps a copy of the program, replacing an old build of it, or the
+// least recently used once the cache is full
+static void store(const char *key, int key_len, struct Source *sources,
+	int source_count, const struct Program *program)
+{
+	int i;
+	struct Entry *entry = find_entry(key, key_len);
+	if (entry == NULL && cache_count < CACHE_SIZE)
+	{
+		entry = &cache[cache_count++];
+	}
+	else if (entry == NULL)
+	{
+		entry = &cache[0];
+		for (i = 1; i < cache_count; i++)
+			if (cache[i].last_used < entry->last_used)
+				entry = &cache[i];
+		free_entry(entry);
+	}
+	else
+	{
+		free_entry(entry);
+	}
+
+	// The copy owns its code and constants, as the optimized code
+	// would be owned
+	char *code = malloc(program->len);
+	memcpy(code, program->code, program->len);
+
+	*entry = (struct Entry) { malloc(key_len), key_len, sources, source_count };
+	memcpy(entry->key, key, key_len);
+	entry->program = *program;
+	entry->program.code = code;
+	entry->program.optimized = code;
+	entry->program.constants = malloc(program->constants_len + 1);
+	memcpy(entry->program.constants, program->constants, program->constants_len);
+	entry->program.spawn_addrs = malloc(sizeof(int) * (program->spawn_count + 1));
+	memcpy(entry->program.spawn_addrs, program->spawn_addrs, sizeof(int) * program->spawn_count);
+	entry->last_used = request_count;
+}
+
+static int run_request(const char *key, int key_len, int argc, char *argv[])
+{
+	int i, status = 0, source_count;
+	struct Options options;
+	struct Program program;
+	struct Entry *entry = find_entry(key, key_len);
+
+	program_parse(&options, argc, argv);
+	debug_init();
+	vm_reset();
+
+	for (i = 0; entry != NULL && i < entry->source_count; i++)
+		if (!is_fresh(&entry->sources[i]))
+			entry = NULL;
+
+	if (entry != NULL)
+	{
+		hit_count++;
+		entry->last_used = request_count;
+		status = program_run(&options, &entry->program);
+		program_free_options(&options);
+		return status;
+	}
+
+	build_count++;
+	struct Source *sources = read_sources(&options, &source_count);
+	int is_built = program_build(&options, &program);
+	if (program_writes_out(&options))
+		status = is_built ? 0 : 1;
+	else
+		status = program_run(&options, &program);
+
+	// Only keep clean builds that were run as they are
+	if (sources != NULL && !program_writes_out(&options) &&
+		options.profile_out == NULL && !has_error())
+	{
+		store(key, key_len, sources, source_count, &program);
+	}
+	else if (sources != NULL)
+	{
+		free_sources(sources, source_count);
+	}
+
+	program_close(&program);
+	program_free_options(&options);
+	return status;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	long long x = *(const long long*)a, y = *(const long long*)b;
+	return (x > y) - (x < y);
+}
+
+static void print_stats()
+{
+	int i, count = request_count < LATENCY_COUNT ? request_count : LATENCY_COUNT;
+	long long sorted[LATENCY_COUNT], total = 0;
+
+	printf("%lld requests, %lld from the cache, %lld built\n",
+		request_count, hit_count, build_count);
+	if (count == 0)
+		return;
+
+	memcpy(sorted, latencies, sizeof(long long) * count);
+	qsort(sorted, count, sizeof(long long), compare_latency);
+	for (i = 0; i < count; i++)
+		total += sorted[i];
+
+	printf("Last %i in us: mean %lld, p50 %lld, p99 %lld, max %lld\n", count,
+		total / count, sorted[count / 2], sorted[count * 99 / 100], sorted[count - 1]);
+}
+
+static long long microseconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static int read_all(int fd, void *data, int len)
+{
+	int done = 0;
+	while (done < len)
+	{
+		int count = read(fd, (char*)data + done, len - done);
+		if (count <= 0)
+			return 0;
+		done += count;
+	}
+	return 1;
+}
+
+static int write_all(int fd, const void *data, int len)
+{
+	int done = 0;
+	while (done < len)
+	{
+		int count = write(fd, (const char*)data + done, len - done);
+		if (count <= 0)
+			return 0;
+		done += count;
+	}
+	return 1;
+}
+
+// Requests start with the payload length and argument count, sent
+// along with the client's files
+static int receive_header(int client, int *header, int *fds)
+{
+	char control[CMSG_SPACE(sizeof(int) * FD_COUNT)];
+	struct iovec iov = { header, sizeof(int) * 2 };
+	struct msghdr message = { 0 };
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	if (recvmsg(client, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(int) * 2)
+		return 0;
+
+	struct cmsghdr *files = CMSG_FIRSTHDR(&message);
+	if (files == NULL || files->cmsg_type != SCM_RIGHTS ||
+		files->cmsg_len != CMSG_LEN(sizeof(int) * FD_COUNT))
+	{
+		return 0;
+	}
+
+	memcpy(fds, CMSG_DATA(files), sizeof(int) * FD_COUNT);
+	return 1;
+}
+
+// Splits the payload into the directory, then the arguments
+static char **split_payload(char *payload, int len, int argc)
+{
+	int i, pointer = 0;
+	char **argv = malloc(sizeof(char*) * argc);
+	for (i = 0; i < argc; i++)
+	{
+		if (pointer >= len)
+		{
+			free(argv);
+			return NULL;
+		}
+
+		argv[i] = payload + pointer;
+		pointer += strlen(payload + pointer) + 1;
+	}
+	return argv;
+}
+
+static void serve(int client, int server_dir)
+{
+	int i, header[2], fds[FD_COUNT], saved[FD_COUNT];
+	if (!receive_header(client, header, fds))
+		return;
+
+	int len = header[0], argc = header[1];
+	char *payload = len > 0 ? malloc(len + 1) : NULL;
+	char **argv = NULL;
+	if (payload != NULL && argc > 0 && read_all(client, payload, len))
+	{
+		payload[len] = '\0';
+		argv = split_payload(payload, len, argc);
+	}
+
+	if (argv == NULL)
+	{
+		for (i = 0; i < FD_COUNT; i++)
+			close(fds[i]);
+		free(payload);
+		return;
+	}
+
+	// Run as if in the client's process
+	long long start = microseconds();
+	fflush(stdout);
+	for (i = 0; i < FD_COUNT; i++)
+	{
+		saved[i] = dup(i);
+		dup2(fds[i], i);
+		close(fds[i]);
+	}
+
+	int status = 0, is_run = 0;
+	if (chdir(argv[0]) == -1)
+	{
+		printf("Error: Can't use the directory '%s'\n", argv[0]);
+		status = 1;
+	}
+	else if (argc == 2 && !strcmp(argv[1], "--stats"))
+	{
+		print_stats();
+	}
+	else if (argc == 2 && !strcmp(argv[1], "--stop"))
+	{
+		is_serving = 0;
+	}
+	else
+	{
+		status = run_request(payload, len, argc - 1, argv + 1);
+		is_run = 1;
+	}
+
+	fflush(stdout);
+	for (i = 0; i < FD_COUNT; i++)
+	{
+		dup2(saved[i], i);
+		close(saved[i]);
+	}
+	fchdir(server_dir);
+
+	if (is_run)
+		latencies[request_count++ % LATENCY_COUNT] = microseconds() - start;
+
+	write_all(client, &status, sizeof(int));
+	free(argv);
+	free(payload);
+}
+
+static int open_socket(const char *path, struct sockaddr_un *addr)
+{
+	if (strlen(path) >= sizeof(addr->sun_path))
+		return -1;
+
+	*addr = (struct sockaddr_un) { AF_UNIX };
+	strcpy(addr->sun_path, path);
+	return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+}
+
+int server_run(const char *socket_path)
+{
+	int i;
+	struct sockaddr_un addr;
+	int fd = open_socket(socket_path, &addr);
+	if (fd == -1)
+	{
+		ERROR("Can't serve on '%.48s'", socket_path);
+		return 1;
+	}
+
+	// A socket left by a server that's gone can be replaced
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+	{
+		ERROR("Already serving on '%.48s'", socket_path);
+		close(fd);
+		return 1;
+	}
+	unlink(socket_path);
+
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, BACKLOG) == -1)
+	{
+		ERROR("Can't serve on '%.48s'", socket_path);
+		close(fd);
+		return 1;
+	}
+
+	// Clients that go away mid request shouldn't stop the server
+	signal(SIGPIPE, SIG_IGN);
+	int server_dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	LOG("Serving on '%s'\n", socket_path);
+
+	// Requests are run one at a time, as the code and the standard
+	// files they use belong to the process
+	vm_init();
+	is_serving = 1;
+	while (is_serving)
+	{
+		int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (client == -1)
+			continue;
+
+		serve(client, server_dir);
+		close(client);
+	}
+
+	print_stats();
+
+	// Clean up
+	for (i = 0; i < cache_count; i++)
+		free_entry(&cache[i]);
+	cache_count = 0;
+	vm_close();
+	close(server_dir);
+	close(fd);
+	unlink(socket_path);
+	return 0;
+}
+
+int server_send(const char *socket_path, int argc, char *argv[])
+{
+	int i, status = 1;
+	int fds[FD_COUNT] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	char dir[PATH_MAX];
+	struct sockaddr_un addr;
+
+	int fd = open_socket(socket_path, &addr);
+	if (fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+	{
+		ERROR("Can't connect to '%.48s'", socket_path);
+		if (fd != -1)
+			close(fd);
+		return 1;
+	}
+
+	if (getcwd(dir, sizeof(dir)) == NULL)
+		strcpy(dir, ".");
+
+	// The payload is the directory then each argument, null terminated
+	int len = strlen(dir) + 1;
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+
+	char *payload = malloc(len);
+	int pointer = 0;
+	strcpy(payload, dir);
+	pointer += strlen(dir) + 1;
+	for (i = 0; i < argc; i++)
+	{
+		strcpy(payload + pointer, argv[i]);
+		pointer += strlen(argv[i]) + 1;
+	}
+
+	// Send the header with our files attached
+	int header[2] = { len, argc + 1 };
+	char control[CMSG_SPACE(sizeof(fds))] = { 0 };
+	struct iovec iov = { header, sizeof(header) };
+	struct msghdr message = { 0 };
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	struct cmsghdr *files = CMSG_FIRSTHDR(&message);
+	files->cmsg_level = SOL_SOCKET;
+	files->cmsg_type = SCM_RIGHTS;
+	files->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(files), fds, sizeof(fds));
+
+	if (sendmsg(fd, &message, 0) == sizeof(header) && write_all(fd, payload, len))
+		read_all(fd, &status, sizeof(int));
+
+	free(payload);
+	close(fd);
+	return status;
+}
@@ -0,0 +1,78 @@
+#define _GNU_SOURCE
+#include "shared.h"
+#include "debug.h"
+#include <sys/mman.h>
+#include <unistd.h>
+
+static int 	*segments[SHARED_MAX];
+static int 	sizes[SHARED_MAX];
+static int 	fds[SHARED_MAX];
+static int 	segment_count;
+
+int shared_create(int size)
+{
+	if (segment_count >= SHARED_MAX || size < 1 || size > (1 << SHARED_BITS))
+	{
+		ERROR("Can't create a shared segment of %i", size);
+		return -1;
+	}
+
+	int fd = memfd_create("newbasic", MFD_CLOEXEC);
+	if (fd == -1 || ftruncate(fd, sizeof(int) * size) == -1)
+	{
+		ERROR("Can't create a shared segment of %i", size);
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+
+	int *segment = mmap(NULL, sizeof(int) * size, 
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (segment == MAP_FAILED)
+	{
+		ERROR("Can't map a shared segment of %i", size);
+		close(fd);
+		return -1;
+	}
+
+	segments[segment_count] = segment;
+	sizes[segment_count] = size;
+	fds[segment_count] = fd;
+	return SHARED_BASE + (segment_count++ << SHARED_BITS);
+}
+
+static int find_segment(int addr)
+{
+	if (addr < SHARED_BASE)
+		return -1;
+
+	int segment = (addr - SHARED_BASE) >> SHARED_BITS;
+	return segment < segment_count ? segment : -1;
+}
+
+int shared_fd(int addr)
+{
+	int segment = find_segment(addr);
+	return segment == -1 ? -1 : fds[segment];
+}
+
+int *shared_find(int addr)
+{
+	int segment = find_segment(addr);
+	int index = addr & ((1 << SHARED_BITS) - 1);
+	if (segment == -1 || index >= sizes[segment])
+		return NULL;
+
+	return segments[segment] + index;
+}
+
+void shared_close()
+{
+	int i;
+	for (i = 0; i < segment_count; i++)
+	{
+		munmap(segments[i], sizeof(int) * sizes[i]);
+		close(fds[i]);
+	}
+	segment_count = 0;
+}
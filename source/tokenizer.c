@@ -2,8 +2,10 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define BACK_LOG_SIZE 80
+#define SOURCE_STACK_SIZE 64
 
 // File data
 static FILE *in = NULL;
@@ -11,13 +13,38 @@ static char back_log[BACK_LOG_SIZE];
 static int back_log_index;
 static int is_eof;
 
+// Inserted text, read before the rest of the file
+struct Source
+{
+	char *text;
+	int pointer;
+};
+static struct Source sources[SOURCE_STACK_SIZE];
+static int source_count;
+
 void tokenizer_open(const char *file_path)
 {
 	tokenizer_close();
 	
-	in = fopen(file_path, "r");
+	// With no file, only inserted text is read
+	in = file_path != NULL ? fopen(file_path, "r") : NULL;
 	back_log_index = 0;
+	source_count = 0;
+	is_eof = (in == NULL);
+}
+
+int tokenizer_insert(const char *text)
+{
+	if (source_count >= SOURCE_STACK_SIZE)
+		return 0;
+
+	struct Source *source = &sources[source_count++];
+	source->text = malloc(strlen(text) + 1);
+	source->pointer = 0;
+	strcpy(source->text, text);
+
 	is_eof = 0;
+	return 1;
 }
 
 char tokenizer_next()
@@ -25,7 +52,22 @@ char tokenizer_next()
 	if (back_log_index > 0)
 		return back_log[--back_log_index];
 
-	char c = fgetc(in);
+	// Read from inserted text first, dropping it once it's used up
+	while (source_count > 0)
+	{
+		struct Source *source = &sources[source_count - 1];
+		char c = source->text[source->pointer];
+		if (c != '\0')
+		{
+			source->pointer++;
+			return c;
+		}
+
+		free(source->text);
+		source_count--;
+	}
+
+	char c = in != NULL ? fgetc(in) : EOF;
 	if (c == EOF)
 		is_eof = 1;
 	return c;
@@ -99,11 +141,14 @@ int tokenizer_read_int()
 
 int tokenizer_has_next()
 {
-	return !is_eof; 
+	return !is_eof || source_count > 0; 
 }
 
 void tokenizer_close()
 {
+	while (source_count > 0)
+		free(sources[--source_count].text);
+
 	if (in != NULL)
 	{
 		fclose(in);
@@ -0,0 +1,554 @@
+#include "verifier.h"
+#include "codec.h"
+#include "debug.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Code being checked
+static const char *code;
+static int len;
+static int constant_count;
+static char *is_start;
+
+// Stack depth of each instruction in the current routine, -1 if 
+// not reached, and the instructions reached so far
+static int *depths;
+static int *reached;
+static int reached_count;
+
+// Each routine is the entry point or the target of a call. 'below' is
+// how far under its starting SP it reads, through [SP-n] or [FP-n], and
+// 'base' the least SP it's called with
+struct Routine
+{
+	int start, max_depth, total;
+	int below, base;
+	int first_call, call_count;
+	int state;
+};
+
+struct Call
+{
+	int depth, routine;
+};
+
+static struct Routine *routines;
+static int routine_count;
+static struct Call *calls;
+static int call_count;
+
+// Recursive code is only bounded by how deep calls nest, as long as
+// that's no more memory than this
+#define RECURSIVE_STACK_MAX	(1 << 16)
+
+// What the code touches
+static int max_addr;
+static int is_stack_bounded;
+
+static int is_indirect(int type)
+{
+	return type == OPERAND_INDIRECT || type == OPERAND_INDIRECT_PLUS || 
+		type == OPERAND_INDIRECT_SUB;
+}
+
+// Decodes the instruction at 'start', returning 0 if it's not valid
+static int decode(struct Decoded *inst, int start)
+{
+	int i;
+	if (!codec_decode(code, len, start, inst))
+		return 0;
+
+	for (i = 0; i < inst->operand_count; i++)
+		if (inst->operands[i].type == OPERAND_CONST && 
+			inst->operands[i].value >= constant_count)
+			return 0;
+	return 1;
+}
+
+static int is_parallel(char bytecode)
+{
+	return bytecode == BC_PFOR_A || bytecode == BC_PSUM_A || 
+		bytecode == BC_PMIN_A || bytecode == BC_PMAX_A;
+}
+
+static int is_call(char bytecode)
+{
+	return bytecode == BC_CALL_A || bytecode == BC_CALL_O8 || 
+		bytecode == BC_CALL_O16 || is_parallel(bytecode);
+}
+
+// Atomics, byte and element loads and stores and map lookups point 
+// into shared segments, mapped files, typed regions and maps, never memory
+static int is_outside_memory(char bytecode)
+{
+	return bytecode >= BC_XADD_RIR && bytecode <= BC_MAP_NEXT_RIR;
+}
+
+static int is_jump(char bytecode)
+{
+	return bytecode == BC_B_A || bytecode == BC_B_O8 || bytecode == BC_B_O16;
+}
+
+static int is_branch(char bytecode)
+{
+	switch (bytecode)
+	{
+		case BC_BEQ_A: case BC_BNE_A: case BC_BLT_A: case BC_BGT_A:
+		case BC_BEQ_O8: case BC_BNE_O8: case BC_BLT_O8: case BC_BGT_O8:
+		case BC_BEQ_O16: case BC_BNE_O16: case BC_BLT_O16: case BC_BGT_O16:
+			return 1;
+	}
+
+	return is_jump(bytecode) || is_call(bytecode);
+}
+
+// Returns if the first register is written to
+static int writes_register(char bytecode)
+{
+	switch (bytecode)
+	{
+		case BC_MOV_RR: case BC_MOV_P: case BC_MOV_RC: case BC_MOV_RA: 
+		case BC_MOV_RI: case BC_MOV_RIP: case BC_MOV_RIS:
+		case BC_ADD_RRR: case BC_ADD_PR: case BC_ADD_RRC:
+		case BC_SUB_RRR: case BC_SUB_PR: case BC_SUB_RRC:
+		case BC_MUL_RRR: case BC_MUL_PR: case BC_MUL_RRC:
+		case BC_DIV_RRR: case BC_DIV_PR: case BC_DIV_RRC:
+		case BC_XADD_RIR: case BC_CAS_RIR: case BC_XCHG_RI: case BC_LDA_RI:
+		case BC_LDB_RIR: case BC_LDE_RIR:
+		case BC_MAP_NEW_R: case BC_MAP_GET_RIR: case BC_MAP_NEXT_RIR:
+		case BC_POP_R:
+			return 1;
+	}
+
+	return 0;
+}
+
+static int branch_target(struct Decoded *inst)
+{
+	struct Operand operand = inst->operands[0];
+	if (operand.type == OPERAND_ADDR || operand.type == OPERAND_OFFSET8 || 
+		operand.type == OPERAND_OFFSET16)
+		return operand.value;
+	return -1;
+}
+
+// Checks the operands of an instruction on its own
+static int check_operands(struct Decoded *inst)
+{
+	int i;
+
+	for (i = 0; i < inst->operand_count; i++)
+	{
+		struct Operand operand = inst->operands[i];
+		if ((operand.type == OPERAND_REG || is_indirect(operand.type)) && 
+			operand.value >= REGISTER_TOTAL)
+		{
+			ERROR("Invalid register %i at %i", operand.value, inst->start);
+			return 0;
+		}
+
+		// The VM reads offsets as signed bytes
+		if ((operand.type == OPERAND_INDIRECT_PLUS || operand.type == OPERAND_INDIRECT_SUB) &&
+			operand.offset > 127)
+		{
+			ERROR("Invalid offset %i at %i", operand.offset, inst->start);
+			return 0;
+		}
+
+		// Using anything other than SP or FP as a pointer means memory 
+		// use can't be known
+		if (is_indirect(operand.type) && !is_outside_memory(inst->bytecode) && 
+			operand.value != REGISTER_SP && operand.value != REGISTER_FP)
+		{
+			max_addr = -1;
+		}
+	}
+
+	// Map iteration also moves its cursor, the last register
+	for (i = 0; i < inst->operand_count; i++)
+	{
+		if (!(i == 0 && writes_register(inst->bytecode)) &&
+			!(i == 2 && inst->bytecode == BC_MAP_NEXT_RIR))
+			continue;
+
+		if (inst->operands[i].value == REGISTER_PC)
+		{
+			ERROR("Write to PC at %i", inst->start);
+			return 0;
+		}
+
+		if (inst->operands[i].value == REGISTER_SP || inst->operands[i].value == REGISTER_FP)
+			is_stack_bounded = 0;
+	}
+
+	if (inst->bytecode == BC_ENTER_A && inst->operands[0].value < 0)
+	{
+		ERROR("Invalid frame size %i at %i", inst->operands[0].value, inst->start);
+		return 0;
+	}
+
+	if (inst->bytecode == BC_INT_A && 
+		(inst->operands[0].value < 0 || inst->operands[0].value >= INT_COUNT))
+	{
+		ERROR("Invalid interupt %i at %i", inst->operands[0].value, inst->start);
+		return 0;
+	}
+
+	// Batches are read and written anywhere in memory
+	if (inst->bytecode == BC_INT_A && (inst->operands[0].value == INT_SEND_BATCH || 
+		inst->operands[0].value == INT_RECV_BATCH || inst->operands[0].value == INT_READ_BATCH))
+	{
+		max_addr = -1;
+	}
+
+	// Fixed memory addresses
+	if (inst->bytecode == BC_MOV_AR || inst->bytecode == BC_MOV_AC || inst->bytecode == BC_MOV_RA)
+	{
+		int addr = inst->operands[inst->bytecode == BC_MOV_RA ? 1 : 0].value;
+		if (addr < 0)
+		{
+			ERROR("Invalid address %i at %i", addr, inst->start);
+			return 0;
+		}
+
+		if (max_addr != -1 && addr > max_addr)
+			max_addr = addr;
+	}
+
+	return 1;
+}
+
+static int add_routine(int start)
+{
+	int i;
+	for (i = 0; i < routine_count; i++)
+		if (routines[i].start == start)
+			return i;
+
+	routines = realloc(routines, sizeof(struct Routine) * (routine_count + 1));
+	memset(&routines[routine_count], 0, sizeof(struct Routine));
+	routines[routine_count].start = start;
+	return routine_count++;
+}
+
+static void add_call(int depth, int routine)
+{
+	calls = realloc(calls, sizeof(struct Call) * (call_count + 1));
+	calls[call_count].depth = depth;
+	calls[call_count++].routine = routine;
+}
+
+// Keeps track of how far below the start of the routine, or above the
+// top of the stack, an instruction reaches through SP or FP
+static void check_reach(struct Decoded *inst, struct Routine *routine, int depth)
+{
+	int i;
+
+	for (i = 0; i < inst->operand_count; i++)
+	{
+		struct Operand operand = inst->operands[i];
+		if (!is_indirect(operand.type) || is_outside_memory(inst->bytecode) ||
+			(operand.value != REGISTER_SP && operand.value != REGISTER_FP))
+			continue;
+
+		// The slot reached, from the start of the routine. FP is SP as 
+		// the routine was called, and [SP] the slot just above the stack
+		int slot = operand.value == REGISTER_SP ? depth : 0;
+		if (operand.type == OPERAND_INDIRECT_PLUS)
+			slot += operand.offset;
+		else if (operand.type == OPERAND_INDIRECT_SUB)
+			slot -= operand.offset;
+
+		if (-slot > routine->below)
+			routine->below = -slot;
+		if (slot + 1 > routine->max_depth)
+			routine->max_depth = slot + 1;
+	}
+}
+
+static int visit(int *stack, int *stack_pointer, int addr, int depth)
+{
+	if (depths[addr] == -1)
+	{
+		depths[addr] = depth;
+		reached[reached_count++] = addr;
+		stack[(*stack_pointer)++] = addr;
+		return 1;
+	}
+
+	if (depths[addr] != depth)
+	{
+		ERROR("Stack depth is %i or %i at %i", depths[addr], depth, addr);
+		return 0;
+	}
+
+	return 1;
+}
+
+// Follows every path through a routine, checking the stack is the 
+// same depth whichever way an instruction is reached
+static int check_routine(int routine, int is_entry)
+{
+	struct Decoded inst;
+	int *stack = malloc(sizeof(int) * (len + 1));
+	int stack_pointer = 0, is_valid = 1;
+
+	routines[routine].first_call = call_count;
+	routines[routine].max_depth = 0;
+	reached_count = 0;
+	visit(stack, &stack_pointer, routines[routine].start, 0);
+
+	while (stack_pointer > 0 && is_valid)
+	{
+		int addr = stack[--stack_pointer];
+		int depth = depths[addr];
+		decode(&inst, addr);
+
+		switch (inst.bytecode)
+		{
+			case BC_PUSH_R: case BC_PUSH_C: 
+				depth++; 
+				break;
+			case BC_ENTER_A:
+				depth += inst.operands[0].value;
+				break;
+			case BC_LEAVE:
+				depth = 0;
+				break;
+			case BC_POP_R:
+				if (depth == 0)
+				{
+					ERROR("Pop past the start of the routine at %i", addr);
+					is_valid = 0;
+				}
+				depth--;
+				break;
+			case BC_RET:
+				if (depth != 0 || is_entry)
+				{
+					ERROR("Return with %i values on the stack at %i", depth, addr);
+					is_valid = 0;
+				}
+				continue;
+			case BC_HULT:
+				continue;
+		}
+
+		if (depth > routines[routine].max_depth)
+			routines[routine].max_depth = depth;
+		check_reach(&inst, &routines[routine], depths[addr]);
+
+		// Parallel loops push the index before calling
+		if (is_call(inst.bytecode))
+			add_call(depth + is_parallel(inst.bytecode), add_routine(branch_target(&inst)));
+		else if (is_branch(inst.bytecode))
+			is_valid &= visit(stack, &stack_pointer, branch_target(&inst), depth);
+
+		if (!is_jump(inst.bytecode) && is_valid)
+			is_valid &= visit(stack, &stack_pointer, inst.end, depth);
+	}
+
+	// Reset the depths for the next routine
+	while (reached_count > 0)
+		depths[reached[--reached_count]] = -1;
+
+	routines[routine].call_count = call_count - routines[routine].first_call;
+	free(stack);
+	return is_valid;
+}
+
+// Returns the most stack a routine can use, including the routines 
+// it calls, or -1 if it's recursive
+static int routine_total(int routine)
+{
+	int i;
+	struct Routine *r = &routines[routine];
+
+	if (r->state == 2)
+		return r->total;
+	if (r->state == 1)
+		return -1;
+
+	r->state = 1;
+	int total = r->max_depth;
+	for (i = 0; i < r->call_count; i++)
+	{
+		struct Call call = calls[r->first_call + i];
+		int callee = routine_total(call.routine);
+		if (callee == -1)
+		{
+			total = -1;
+			break;
+		}
+
+		// Return addresses are kept off the stack
+		if (call.depth + callee > total)
+			total = call.depth + callee;
+	}
+
+	r = &routines[routine];
+	r->state = 2;
+	r->total = total;
+	return total;
+}
+
+// Each frame holds no more than the deepest any routine goes, so that
+// bounds recursive code too. Returns -1 if it's too much
+static int recursive_total()
+{
+	int i, deepest = 0;
+
+	// Parallel loops push the index as well
+	for (i = 0; i < routine_count; i++)
+		if (routines[i].max_depth + 1 > deepest)
+			deepest = routines[i].max_depth + 1;
+
+	if (deepest > RECURSIVE_STACK_MAX / (FRAME_MAX + 1))
+		return -1;
+	return deepest * (FRAME_MAX + 1);
+}
+
+// Works out the least SP each routine is called with, then checks none
+// of them reach below the bottom of memory
+static int check_bases()
+{
+	int i, j, is_changed = 1;
+
+	for (i = 0; i < routine_count; i++)
+		routines[i].base = i == 0 ? 0 : -1;
+
+	// Depths only add, so this settles, even with recursion
+	while (is_changed)
+	{
+		is_changed = 0;
+		for (i = 0; i < routine_count; i++)
+		{
+			if (routines[i].base == -1)
+				continue;
+
+			for (j = 0; j < routines[i].call_count; j++)
+			{
+				struct Call call = calls[routines[i].first_call + j];
+				struct Routine *callee = &routines[call.routine];
+				if (callee->base == -1 || routines[i].base + call.depth < callee->base)
+				{
+					callee->base = routines[i].base + call.depth;
+					is_changed = 1;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < routine_count; i++)
+	{
+		if (routines[i].below > routines[i].base)
+		{
+			ERROR("Stack read %i below 0 in routine at %i", 
+				routines[i].below - routines[i].base, routines[i].start);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int verifier_check(const char *in_code, int in_len, int in_constant_count,
+	int entry, int *memory_size)
+{
+	struct Decoded inst;
+	int i, is_valid = 1;
+
+	code = in_code;
+	len = in_len;
+	constant_count = in_constant_count;
+	max_addr = 0;
+	is_stack_bounded = 1;
+	*memory_size = -1;
+
+	// Find where each instruction starts, and check them on their own
+	is_start = calloc(len + 1, 1);
+	for (i = 0; i < len && is_valid; i = inst.end)
+	{
+		if (!decode(&inst, i))
+		{
+			ERROR("Invalid instruction at %i", i);
+			is_valid = 0;
+			break;
+		}
+
+		is_start[i] = 1;
+		is_valid &= check_operands(&inst);
+
+		// Code can't run off the end
+		if (inst.end >= len && !is_jump(inst.bytecode) && 
+			inst.bytecode != BC_RET && inst.bytecode != BC_HULT)
+		{
+			ERROR("Code runs off the end at %i", i);
+			is_valid = 0;
+		}
+	}
+
+	// Branches have to land on an instruction
+	for (i = 0; i < len && is_valid; i = inst.end)
+	{
+		decode(&inst, i);
+		if (!is_branch(inst.bytecode))
+			continue;
+
+		int target = branch_target(&inst);
+		if (target < 0 || target >= len || !is_start[target])
+		{
+			ERROR("Branch to %i at %i isn't an instruction", target, i);
+			is_valid = 0;
+		}
+	}
+
+	if (is_valid && (entry < 0 || entry >= len || !is_start[entry]))
+	{
+		ERROR("Entry point %i isn't an instruction", entry);
+		is_valid = 0;
+	}
+
+	// Check the stack use of each routine, from the entry point
+	depths = malloc(sizeof(int) * (len + 1));
+	reached = malloc(sizeof(int) * (len + 1));
+	for (i = 0; i <= len; i++)
+		depths[i] = -1;
+
+	routines = NULL;
+	calls = NULL;
+	routine_count = 0;
+	call_count = 0;
+	if (is_valid)
+		add_routine(entry);
+
+	for (i = 0; i < routine_count && is_valid; i++)
+		is_valid &= check_routine(i, i == 0);
+
+	// Once SP or FP is written, where the stack is isn't known until
+	// the code runs, so it's checked then
+	if (is_valid && is_stack_bounded)
+		is_valid &= check_bases();
+
+	if (is_valid)
+	{
+		int stack_size = routine_total(0);
+		if (stack_size == -1)
+			stack_size = recursive_total();
+		if (stack_size != -1 && is_stack_bounded && max_addr != -1)
+		{
+			*memory_size = stack_size > max_addr + 1 ? stack_size : max_addr + 1;
+			LOG("Verified, using %i stack and %i memory\n", stack_size, *memory_size);
+		}
+		else
+		{
+			LOG("Verified, memory use is unbounded\n");
+		}
+	}
+
+	free(is_start);
+	free(depths);
+	free(reached);
+	free(routines);
+	free(calls);
+	return is_valid;
+}
@@ -1,5 +1,17 @@
 #include "vm.h"
 #include "bytecode.h"
+#include "verifier.h"
+#include "constants.h"
+#include "pool.h"
+#include "channel.h"
+#include "shared.h"
+#include "filemap.h"
+#include "region.h"
+#include "map.h"
+#include "input.h"
+#include "register.h"
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <memory.h>
@@ -17,22 +29,22 @@
 // Memory sizes
 #define CODE_SIZE 	1024
 #define MEMORY_SIZE	100
-#define REGISTER_SIZE	10
-#define PC_LOC		REGISTER_SIZE + 0
-#define SP_LOC		REGISTER_SIZE + 1
+#define PC_LOC		REGISTER_PC
+#define SP_LOC		REGISTER_SP
+#define FP_LOC		REGISTER_FP
 
-// Interupts
-#define INT_PRINT 	0
-
-// Flags
-#define FLAG_EQUAL 	0b100
-#define FLAG_LESS_THAN	0b010
-#define FLAG_MORE_THAN	0b001
+// Parallel loops, and how they combine the results of each call
+#define CHUNKS_PER_THREAD	4
+#define REDUCE_NONE		0
+#define REDUCE_SUM		1
+#define REDUCE_MIN		2
+#define REDUCE_MAX		3
 
 // Helper functions
-#define R(i)			registers[i]
+#define R(i)			registers[(unsigned char)(i)]
 #define PC 			R(PC_LOC).i
 #define SP			R(SP_LOC).i
+#define FP			R(FP_LOC).i
 #define RA			R(code[PC])
 #define RB			R(code[PC+1])
 #define RC			R(code[PC+2])
@@ -42,52 +54,167 @@
 #define NEXT_DATA(out, type)	memcpy(&out, code + PC, sizeof(type)); PC += sizeof(type)
 #define NEXT_ADDR		NEXT_DATA(addr, int);
 #define ADDR(offset)		memcpy(&addr, code + PC + offset, sizeof(int));
+#define NEXT_OFFSET8		addr = (signed char)code[PC]; PC++; addr += PC
+#define NEXT_OFFSET16		{ short s; NEXT_DATA(s, short); addr = PC + s; }
+#define PAIR_A			R((unsigned char)code[PC] >> 4)
+#define PAIR_B			R(code[PC] & 15)
+#define INT_RESULT(value)	(Register) { CONST_INT, { .i = (value) } }
+#define FLOAT_RESULT(value)	(Register) { CONST_FLOAT, { .f = (value) } }
+static const char *code;
+static char 	*code_buffer;
+static int 	code_size;
+static int 	code_len;
+static int 	is_verified;
+static int 	verified_entry;
+
+// Constants the code refers to by index, decoded from its pool
+static Register *constants;
+static int 	constant_count;
+
+// Each VM has its own memory, shared by the threads of its parallel 
+// loops, and each thread running code has its own registers
+static __thread Register *memory;
+static __thread int 	memory_size;
+static __thread int 	memory_total;
+static __thread Register registers[REGISTER_TOTAL];
+static __thread char flags;
+
+// Code whose memory use the verifier can't bound runs with each access
+// to memory checked, so it aborts rather than leaving it
+static __thread int is_unbounded;
+static __thread int addr;
+static __thread int is_worker;
 
-typedef struct Register
+// Calls keep where they return to and the caller's FP apart from the 
+// stack, so the stack only holds values
+struct Frame
 {
-	char type;
-	union
-	{
-		int i;
-		float f;
-		char *str;
-	};
-} Register;
+	int pc, fp;
+};
+
+static __thread struct Frame frames[FRAME_MAX];
+static __thread int frame_count;
+static __thread int exit_frame = -1;
 
-static char 	*code;
-static Register *memory;
-static Register registers[REGISTER_SIZE + 2];
-static char flags;
-static int addr;
+// Each thread running code has its own budget, and only the thread 
+// that called vm_run or vm_resume can be suspended back to it
+static int 	budget_limit;
+static int 	budget_action;
+static int	(*budget_callback)(void *data);
+static void	*budget_data;
+static __thread int budget;
+static __thread int stop_state;
+static __thread int is_suspendable;
+
+// A range of calls, split into chunks between the threads of the pool
+struct ParallelFor
+{
+	int entry, end, chunk, reduce;
+	int next;
+	int is_aborted;
+	Register *results;
+	Register *memory;
+	int memory_size, memory_total;
+	int is_unbounded;
+};
+
+// VMs running on their own threads
+static pthread_t *spawned;
+static int spawned_count;
+
+// Execution profile, counts for each instruction and each taken branch
+static int *profile_counts;
+static int *profile_taken;
 
 void vm_init()
 {
 	// Init memory and registers
-	code = malloc(CODE_SIZE);
+	code_buffer = malloc(CODE_SIZE);
+	code_size = CODE_SIZE;
+	code = code_buffer;
 	memory = malloc(sizeof(Register) * MEMORY_SIZE);
-	memset(code, 0, CODE_SIZE);
-	memset(registers, 0, REGISTER_SIZE + 2);
+	memory_size = MEMORY_SIZE;
+	memory_total = MEMORY_SIZE;
+	code_len = 0;
+	is_verified = 0;
+	memset(code_buffer, 0, CODE_SIZE);
+	memset(registers, 0, sizeof(registers));
+}
+
+void vm_profile(int *counts, int *taken)
+{
+	profile_counts = counts;
+	profile_taken = taken;
 }
 
 void vm_load(int offset, const char *program, int len)
 {
+	// Make room for the code
+	if (offset + len > code_size)
+	{
+		code_buffer = realloc(code_buffer, offset + len);
+		memset(code_buffer + code_size, 0, offset + len - code_size);
+		code_size = offset + len;
+	}
+
 	// Copy code into memory
-	memcpy(code + offset, program, len);
+	memcpy(code_buffer + offset, program, len);
+	code = code_buffer;
+	if (offset + len > code_len)
+		code_len = offset + len;
+	is_verified = 0;
 }
 
-static Register next_const()
+void vm_map(const char *program, int len)
+{
+	// Run the code where it is, without copying it
+	code = program;
+	code_len = len;
+	is_verified = 0;
+}
+
+int vm_constants(const char *pool, int len)
 {
-	Register data;
-	data.type = code[PC++];
+	free(constants);
+	constants = constants_load(pool, len, &constant_count);
+	is_verified = 0;
+	return constants != NULL;
+}
+
+int vm_verify(int entry)
+{
+	int size;
+	if (is_verified && verified_entry == entry)
+		return 1;
+
+	if (!verifier_check(code, code_len, constant_count, entry, &size))
+		return 0;
 
-	switch (data.type)
+	// Only allocate the memory the program can use
+	is_unbounded = size == -1;
+	if (size == -1)
+		size = MEMORY_SIZE;
+	if (size < 1)
+		size = 1;
+
+	if (size != memory_size)
 	{
-		case CONST_INT: NEXT_DATA(data.i, int); break;
-		case CONST_STRING: data.str = code + PC + 1; PC += code[PC] + 2; break;
-		default: break; // Do error
+		memory = realloc(memory, sizeof(Register) * size);
+		memory_size = size;
+		memory_total = size;
 	}
-	
-	return data;
+
+	memset(memory, 0, sizeof(Register) * memory_size);
+	is_verified = 1;
+	verified_entry = entry;
+	return 1;
+}
+
+static Register next_const()
+{
+	unsigned short index;
+	NEXT_DATA(index, unsigned short);
+	return constants[index];
 }
 
 static void print_register(Register r)
@@ -95,27 +222,99 @@ static void print_register(Register r)
 	switch (r.type)
 	{
 		case CONST_INT: printf("%i\n", r.i); break;
+		case CONST_FLOAT: printf("%g\n", r.f); break;
 		case CONST_STRING: printf("%s\n", r.str); break;
 		default: printf("\n"); break; // Do error
 	}
 }
 
+// Stops the run at an access outside memory, which only unbounded
+// code is checked for
+static void abort_access(int guest_addr, int pc)
+{
+	printf("Error: Memory access at %i, outside %i, at %i\n", guest_addr, memory_total, pc);
+	stop_state = VM_ABORTED;
+}
+
+// Returns if a batch of R3 values at R2 is inside memory
+static int is_batch_valid()
+{
+	return R(2).i >= 0 && R(3).i >= 0 && R(3).i <= memory_total - R(2).i;
+}
+
+// Maps the file named in R1, to the address in R0 and size in R3
+static void map_file(int is_writable)
+{
+	int size = 0;
+	int addr = R(1).type != CONST_STRING ? -1 : 
+		filemap_open(R(1).str, is_writable, &size);
+	R(0) = INT_RESULT(addr);
+	R(3) = INT_RESULT(size);
+}
+
+// Reads the next value of the input to R0, null once it ends, and R3
+// is whether one was read
+static void read_input(int id)
+{
+	int i = 0, is_read = 0;
+	float f = 0;
+	char *line = NULL;
+
+	switch (id)
+	{
+		case INT_READ_INT: is_read = input_read_int(&i); break;
+		case INT_READ_FLOAT: is_read = input_read_float(&f); break;
+		case INT_READ_LINE: is_read = (line = input_read_line()) != NULL; break;
+	}
+
+	R(0) = (Register) { CONST_NULL };
+	if (is_read && id == INT_READ_INT) R(0) = INT_RESULT(i);
+	if (is_read && id == INT_READ_FLOAT) R(0) = FLOAT_RESULT(f);
+	if (is_read && id == INT_READ_LINE) R(0) = (Register) { CONST_STRING, { .str = line } };
+	R(3) = INT_RESULT(is_read);
+}
+
 static void run_int(int id)
 {
 	switch (id)
 	{
 		case INT_PRINT: print_register(R(0)); break;
+		case INT_SEND: channel_send(R(1).i, &R(0), 1); break;
+		case INT_RECV: 
+			if (!channel_recv(R(1).i, &R(0), 1)) 
+				R(0) = (Register) { CONST_NULL };
+			break;
+		case INT_SEND_BATCH: 
+			R(0).i = is_batch_valid() ? channel_send(R(1).i, memory + R(2).i, R(3).i) : 0; 
+			R(0).type = CONST_INT;
+			break;
+		case INT_RECV_BATCH: 
+			R(0).i = is_batch_valid() ? channel_recv(R(1).i, memory + R(2).i, R(3).i) : 0; 
+			R(0).type = CONST_INT;
+			break;
+		case INT_CLOSE: channel_close(R(1).i); break;
+		case INT_MAP_READ: map_file(0); break;
+		case INT_MAP_WRITE: map_file(1); break;
+		case INT_UNMAP: filemap_unmap(R(1).i); break;
+		case INT_ALLOC: R(0) = INT_RESULT(region_create(R(2).i, R(3).i)); break;
+		case INT_FREE: region_free(R(1).i); map_free(R(1).i); break;
+		case INT_READ_INT: case INT_READ_FLOAT: case INT_READ_LINE: read_input(id); break;
+		case INT_READ_BATCH:
+			R(0) = INT_RESULT(is_batch_valid() ? input_read_ints(memory + R(2).i, R(3).i) : 0);
+			break;
 		default: break; // Do error
 	}
 }
 
-#define SET_FLAGS(a, b) \
+#define SET_FLAGS(a, b, result) \
 	flags = 0; \
 	flags |= (a) == (b) ? FLAG_EQUAL : 0; \
 	flags |= (a) < (b) ? FLAG_LESS_THAN : 0; \
-	flags |= (b) > (b) ? FLAG_MORE_THAN : 0;
+	flags |= (a) > (b) ? FLAG_MORE_THAN : 0;
 
-#define OPERATION(name, out, op) \
+// Ints mixed with floats, as loaded from typed regions, become floats. 
+// Anything else leaves the flags as they were and works out to null
+#define OPERATION(name, out, op, otherwise) \
 	static out name(Register a, Register b) \
 	{ \
 		switch (a.type) \
@@ -123,101 +322,621 @@ static void run_int(int id)
 			case CONST_INT: \
 				switch (b.type) \
 				{ \
-					case CONST_INT: op(a.i, b.i); break; \
+					case CONST_INT: op(a.i, b.i, INT_RESULT); break; \
+					case CONST_FLOAT: op((float)a.i, b.f, FLOAT_RESULT); break; \
+				} \
+				break; \
+			case CONST_FLOAT: \
+				switch (b.type) \
+				{ \
+					case CONST_INT: op(a.f, (float)b.i, FLOAT_RESULT); break; \
+					case CONST_FLOAT: op(a.f, b.f, FLOAT_RESULT); break; \
 				} \
 				break; \
 		} \
+		return otherwise; \
 	}
 
-#define OP(a, b, op) return (Register) { CONST_INT, (a) op (b) }
-#define OP_ADD(a, b) OP(a, b, +)
-#define OP_SUB(a, b) OP(a, b, -)
-#define OP_MUL(a, b) OP(a, b, *)
-#define OP_DIV(a, b) OP(a, b, /)
-OPERATION(op_compare, void, SET_FLAGS);
-OPERATION(op_add, Register, OP_ADD);
-OPERATION(op_sub, Register, OP_SUB);
-OPERATION(op_mul, Register, OP_MUL);
-OPERATION(op_div, Register, OP_DIV);
+#define OP(a, b, op, result) return result((a) op (b))
+#define OP_ADD(a, b, result) OP(a, b, +, result)
+#define OP_SUB(a, b, result) OP(a, b, -, result)
+#define OP_MUL(a, b, result) OP(a, b, *, result)
+#define OP_DIV(a, b, result) return result((b) == 0 ? 0 : (a) / (b))
+OPERATION(op_compare, void, SET_FLAGS, );
+OPERATION(op_add, Register, OP_ADD, (Register) { CONST_NULL });
+OPERATION(op_sub, Register, OP_SUB, (Register) { CONST_NULL });
+OPERATION(op_mul, Register, OP_MUL, (Register) { CONST_NULL });
+OPERATION(op_div, Register, OP_DIV, (Register) { CONST_NULL });
+
+// Atomics only reach shared segments, anywhere else is an error
+int *vm_cell(int guest_addr)
+{
+	int *found = shared_find(guest_addr);
+	if (found == NULL)
+		printf("Error: Atomic at %i, outside shared memory\n", guest_addr);
+	return found;
+}
+
+// Bytes past the end of a file read as -1, and stores to read only 
+// ones are dropped
+int vm_load_byte(int file, unsigned offset)
+{
+	struct FileMap *map = filemap_find(file);
+	return map != NULL && offset < map->size ? map->bytes[offset] : -1;
+}
+
+void vm_store_byte(int file, unsigned offset, int value)
+{
+	struct FileMap *map = filemap_find(file);
+	if (map != NULL && map->is_writable && offset < map->size)
+		map->bytes[offset] = value;
+}
+
+// Elements widen to a register when loaded and narrow when stored, 
+// indexes out of range load null and store nothing
+Register vm_load_element(int region_addr, unsigned index)
+{
+	struct Region *region = region_find(region_addr);
+	if (region == NULL || index >= region->count)
+		return (Register) { CONST_NULL };
+
+	switch (region->type)
+	{
+		case ELEMENT_INT8: return INT_RESULT(((signed char*)region->data)[index]);
+		case ELEMENT_INT32: return INT_RESULT(((int*)region->data)[index]);
+		case ELEMENT_INT64: return INT_RESULT(((long long*)region->data)[index]);
+		case ELEMENT_FLOAT32: return FLOAT_RESULT(((float*)region->data)[index]);
+		default: return FLOAT_RESULT(((double*)region->data)[index]);
+	}
+}
+
+void vm_store_element(int region_addr, unsigned index, Register value)
+{
+	struct Region *region = region_find(region_addr);
+	if (region == NULL || index >= region->count)
+		return;
+
+	int is_float = value.type == CONST_FLOAT;
+	switch (region->type)
+	{
+		case ELEMENT_INT8: ((signed char*)region->data)[index] = is_float ? (int)value.f : value.i; break;
+		case ELEMENT_INT32: ((int*)region->data)[index] = is_float ? (int)value.f : value.i; break;
+		case ELEMENT_INT64: ((long long*)region->data)[index] = is_float ? (long long)value.f : value.i; break;
+		case ELEMENT_FLOAT32: ((float*)region->data)[index] = is_float ? value.f : value.i; break;
+		default: ((double*)region->data)[index] = is_float ? value.f : value.i; break;
+	}
+}
+
+Register vm_operate(char bytecode, Register a, Register b)
+{
+	switch (bytecode)
+	{
+		case BC_ADD_RRR: return op_add(a, b);
+		case BC_SUB_RRR: return op_sub(a, b);
+		case BC_MUL_RRR: return op_mul(a, b);
+		default: return op_div(a, b);
+	}
+}
+
+char vm_compare(char previous, Register a, Register b)
+{
+	flags = previous;
+	op_compare(a, b);
+	return flags;
+}
+
+void vm_interrupt(int id, Register *in_registers, Register *in_memory, int in_memory_size)
+{
+	memory = in_memory;
+	memory_size = in_memory_size;
+	memory_total = in_memory_size;
+	memcpy(registers, in_registers, sizeof(Register) * 4);
+	run_int(id);
+	memcpy(in_registers, registers, sizeof(Register) * 4);
+}
+
+// Called when the budget runs out, returns if the VM should carry on
+static int refill()
+{
+	switch (budget_action)
+	{
+		case VM_BUDGET_CALLBACK:
+			budget = budget_callback(budget_data);
+			if (budget > 0)
+				return 1;
+			break;
+
+		case VM_BUDGET_SUSPEND:
+			budget = budget_limit;
+			if (is_suspendable)
+			{
+				stop_state = VM_SUSPENDED;
+				return 0;
+			}
+
+			// Let other VMs have a turn
+			sched_yield();
+			return 1;
+	}
+
+	stop_state = VM_ABORTED;
+	return 0;
+}
+
+// Only backward branches, calls and returns are charged, as any code 
+// that runs for long has to use them
+#define CHARGE	if (is_metered && --budget < 0 && !refill()) is_running = 0
+
+#define JUMP() \
+	PC = addr; \
+	if (is_profiling) profile_taken[inst_pc]++
+
+#define BRANCH(condition) \
+	if (condition) \
+	{ \
+		if (addr <= inst_pc) CHARGE; \
+		JUMP(); \
+	}
+
+// Running out of frames aborts, rather than overwriting memory
+#define CALL() \
+	if (frame_count == FRAME_MAX) { stop_state = VM_ABORTED; is_running = 0; break; } \
+	frames[frame_count++] = (struct Frame) { PC, FP }; \
+	FP = SP; \
+	CHARGE; \
+	JUMP()
 
 #define IMPLEMENT_OP(func, name) \
 	case BC_##name##_RRC: { int a = NEXT_BYTE, b = NEXT_BYTE; R(a) = func(R(b), NEXT_CONST); } break; \
-	case BC_##name##_RRR: RA = func(RB, RC); PC += 3; break
+	case BC_##name##_RRR: RA = func(RB, RC); PC += 3; break; \
+	case BC_##name##_PR: PAIR_A = func(PAIR_B, RB); PC += 2; break
 
+// The last value pushed is kept in 'tos' until something else is, 
+// 'cached_at' being where it belongs in memory or -1. Loads and stores 
+// there use it instead, anything else that reads memory flushes it
+#define LOAD(a)			((a) == cached_at ? tos : memory[a])
+#define STORE(a, value)		if ((a) == cached_at) tos = (value); else memory[a] = (value)
+#define FLUSH()			if (cached_at != -1) { memory[cached_at] = tos; cached_at = -1; }
 
-void vm_run(int offset)
-{
-	// Run code starting at offset
-	registers[PC_LOC].type = CONST_INT;
-	registers[SP_LOC].type = CONST_INT;
-	PC = offset;
-	SP = 0;
+// Checked runs make sure an address is in memory before it's used, 
+// anything cached has been checked already
+#define CHECK(a) \
+	if (is_checked && (unsigned)(a) >= limit) \
+	{ abort_access(a, inst_pc); is_running = 0; break; }
+
+// Finds the shared cell an atomic works on, stopping the run if there 
+// isn't one
+#define CELL(a) \
+	int *cell = vm_cell(a); \
+	if (cell == NULL) { stop_state = VM_ABORTED; is_running = 0; break; }
+
+#define PUSH(value) \
+	if (cached_at != -1) memory[cached_at] = tos; \
+	tos = (value); \
+	cached_at = SP++
+
+#define POP(out) \
+	if (cached_at == SP - 1) { out = tos; cached_at = -1; SP--; } \
+	else out = memory[--SP]
+
+#define IMPLEMENT_PARALLEL(name, reduce) \
+	case BC_##name##_A: { NEXT_ADDR; int start = NEXT_REGISTER.i; FLUSH(); \
+		parallel_for(addr, start, NEXT_REGISTER.i, reduce); limit = memory_total; \
+		if (is_metered && stop_state) is_running = 0; } break
 
-	int is_running = 1;
+#define IMPLEMENT_BRANCH(name, condition) \
+	case BC_##name##_A: NEXT_ADDR; BRANCH(condition); break; \
+	case BC_##name##_O8: NEXT_OFFSET8; BRANCH(condition); break; \
+	case BC_##name##_O16: NEXT_OFFSET16; BRANCH(condition); break
+
+static void parallel_for(int entry, int start, int end, int reduce);
+
+// Inlined for each use, so profiling, budget and memory checks are 
+// removed when they're not needed
+static inline void run(const int is_profiling, const int is_metered, const int is_checked)
+{
+	int is_running = 1, cached_at = -1;
+	unsigned limit = memory_total;
+	Register tos;
 	while (is_running)
 	{
+		int inst_pc = PC;
+		if (is_profiling) profile_counts[inst_pc]++;
+
 		char bytecode = code[PC++];
 		LOG("%i: %s\n", PC, bytecode_names[bytecode]);
 		
 		switch (bytecode)
 		{
 			case BC_HULT: 	is_running = 0; break;
-			case BC_INT_A:	NEXT_ADDR; run_int(addr); break;
+			case BC_INT_A:	NEXT_ADDR; FLUSH(); run_int(addr); break;
 
 			case BC_MOV_RR: RA = RB; PC += 2; break;
+			case BC_MOV_P: PAIR_A = PAIR_B; PC++; break;
 			case BC_MOV_RC: NEXT_REGISTER = NEXT_CONST; break;
 
-			case BC_MOV_AR: NEXT_ADDR; memory[addr] = NEXT_REGISTER; break;
-			case BC_MOV_AC: NEXT_ADDR; memory[addr] = NEXT_CONST; break;
-			case BC_MOV_IR: memory[RA.i] = RB; PC += 2; break;
-			case BC_MOV_IPR: memory[RA.i + code[PC+2]] = RB; PC += 3; break;
-			case BC_MOV_ISR: memory[RA.i - code[PC+2]] = RB; PC += 3; break;
+			case BC_MOV_AR: { NEXT_ADDR; CHECK(addr); Register value = NEXT_REGISTER; STORE(addr, value); } break;
+			case BC_MOV_AC: { NEXT_ADDR; CHECK(addr); Register value = NEXT_CONST; STORE(addr, value); } break;
+			case BC_MOV_IR: { int a = RA.i; CHECK(a); STORE(a, RB); } PC += 2; break;
+			case BC_MOV_IPR: { int a = RA.i + code[PC+1]; CHECK(a); STORE(a, RC); } PC += 3; break;
+			case BC_MOV_ISR: { int a = RA.i - code[PC+1]; CHECK(a); STORE(a, RC); } PC += 3; break;
 
-			case BC_MOV_IC: memory[NEXT_REGISTER.i] = NEXT_CONST; break;
-			case BC_MOV_IPC: { int ra = NEXT_BYTE; Register c = NEXT_CONST; memory[R(ra).i + NEXT_BYTE] = c; break; }
-			case BC_MOV_ISC: { int ra = NEXT_BYTE; Register c = NEXT_CONST; memory[R(ra).i - NEXT_BYTE] = c; break; }
+			case BC_MOV_IC: { int a = NEXT_REGISTER.i; CHECK(a); Register value = NEXT_CONST; STORE(a, value); } break;
+			case BC_MOV_IPC: { int ra = NEXT_BYTE, offset = NEXT_BYTE; int a = R(ra).i + offset; 
+				CHECK(a); Register value = NEXT_CONST; STORE(a, value); } break;
+			case BC_MOV_ISC: { int ra = NEXT_BYTE, offset = NEXT_BYTE; int a = R(ra).i - offset; 
+				CHECK(a); Register value = NEXT_CONST; STORE(a, value); } break;
 
-			case BC_MOV_RA: ADDR(1); RA = memory[addr]; PC += sizeof(int) + 1; break;
-			case BC_MOV_RI: RA = memory[RB.i]; PC += 2; break;
-			case BC_MOV_RIP: RA = memory[RB.i + code[PC+2]]; PC += 3; break;
-			case BC_MOV_RIS: RA = memory[RB.i - code[PC+2]]; PC += 3; break;
+			case BC_MOV_RA: ADDR(1); CHECK(addr); RA = LOAD(addr); PC += sizeof(int) + 1; break;
+			case BC_MOV_RI: { int a = RB.i; CHECK(a); RA = LOAD(a); } PC += 2; break;
+			case BC_MOV_RIP: { int a = RB.i + code[PC+2]; CHECK(a); RA = LOAD(a); } PC += 3; break;
+			case BC_MOV_RIS: { int a = RB.i - code[PC+2]; CHECK(a); RA = LOAD(a); } PC += 3; break;
 
 			case BC_CMP_RC: { Register r = NEXT_REGISTER; op_compare(r, NEXT_CONST); } break;
 			case BC_CMP_RR: op_compare(RA, RB); PC += 2; break;
+			case BC_CMP_P: op_compare(PAIR_A, PAIR_B); PC++; break;
 
-			case BC_PUSH_R: memory[SP++] = NEXT_REGISTER; break;
-			case BC_PUSH_C: memory[SP++] = NEXT_CONST; break;
-			case BC_POP_R: NEXT_REGISTER = memory[--SP]; break;
-			case BC_CALL_A: NEXT_ADDR; memory[SP++] = R(PC_LOC); PC = addr; break;
-			case BC_RET: R(PC_LOC) = memory[--SP]; break;
-
-			case BC_B_A: NEXT_ADDR; PC = addr; break;
-			case BC_BEQ_A: NEXT_ADDR; if (flags & FLAG_EQUAL) PC = addr; break;
-			case BC_BNE_A: NEXT_ADDR; if (!(flags & FLAG_EQUAL)) PC = addr; break;
-			case BC_BLT_A: NEXT_ADDR; if (flags & FLAG_LESS_THAN) PC = addr; break;
-			case BC_BGT_A: NEXT_ADDR; if (flags & FLAG_MORE_THAN) PC = addr; break;
+			case BC_PUSH_R: { CHECK(SP); Register value = NEXT_REGISTER; PUSH(value); } break;
+			case BC_PUSH_C: { CHECK(SP); Register value = NEXT_CONST; PUSH(value); } break;
+			case BC_POP_R: { CHECK(SP - 1); Register value; POP(value); NEXT_REGISTER = value; } break;
+			case BC_CALL_A: NEXT_ADDR; CALL(); break;
+			case BC_CALL_O8: NEXT_OFFSET8; CALL(); break;
+			case BC_CALL_O16: NEXT_OFFSET16; CALL(); break;
+			case BC_RET: frame_count--; PC = frames[frame_count].pc; FP = frames[frame_count].fp; 
+				is_running = frame_count != exit_frame; CHARGE; break;
+			case BC_ENTER_A: NEXT_ADDR; if (addr > 0) { CHECK(SP); CHECK(SP + addr - 1); }
+				FLUSH(); memset(memory + SP, 0, sizeof(Register) * addr); SP += addr; break;
+			case BC_LEAVE: SP = FP; break;
+
+			IMPLEMENT_BRANCH(B, 1);
+			IMPLEMENT_BRANCH(BEQ, flags & FLAG_EQUAL);
+			IMPLEMENT_BRANCH(BNE, !(flags & FLAG_EQUAL));
+			IMPLEMENT_BRANCH(BLT, flags & FLAG_LESS_THAN);
+			IMPLEMENT_BRANCH(BGT, flags & FLAG_MORE_THAN);
 			
 			IMPLEMENT_OP(op_add, ADD);
 			IMPLEMENT_OP(op_sub, SUB);
+			IMPLEMENT_OP(op_mul, MUL);
+			IMPLEMENT_OP(op_div, DIV);
+
+			IMPLEMENT_PARALLEL(PFOR, REDUCE_NONE);
+			IMPLEMENT_PARALLEL(PSUM, REDUCE_SUM);
+			IMPLEMENT_PARALLEL(PMIN, REDUCE_MIN);
+			IMPLEMENT_PARALLEL(PMAX, REDUCE_MAX);
+
+			case BC_XADD_RIR: { CELL(RB.i); int add = RC.i; RA = INT_RESULT(__atomic_fetch_add(cell, add, __ATOMIC_SEQ_CST)); PC += 3; } break;
+			case BC_CAS_RIR: { CELL(RB.i); int old = RA.i; flags = __atomic_compare_exchange_n(cell, &old, RC.i, 0, 
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ? FLAG_EQUAL : 0; RA = INT_RESULT(old); PC += 3; } break;
+			case BC_XCHG_RI: { CELL(RB.i); RA = INT_RESULT(__atomic_exchange_n(cell, RA.i, __ATOMIC_SEQ_CST)); PC += 2; } break;
+			case BC_LDA_RI: { CELL(RB.i); RA = INT_RESULT(__atomic_load_n(cell, __ATOMIC_ACQUIRE)); PC += 2; } break;
+			case BC_STL_IR: { CELL(RA.i); __atomic_store_n(cell, RB.i, __ATOMIC_RELEASE); PC += 2; } break;
+
+			case BC_LDB_RIR: RA = INT_RESULT(vm_load_byte(RB.i, RC.i)); PC += 3; break;
+			case BC_STB_IRR: vm_store_byte(RA.i, RB.i, RC.i); PC += 3; break;
+			case BC_LDE_RIR: RA = vm_load_element(RB.i, RC.i); PC += 3; break;
+			case BC_STE_IRR: vm_store_element(RA.i, RB.i, RC); PC += 3; break;
+
+			case BC_MAP_NEW_R: NEXT_REGISTER = INT_RESULT(map_create()); break;
+			case BC_MAP_GET_RIR: RA = map_get(RB.i, RC); PC += 3; break;
+			case BC_MAP_SET_IRR: map_set(RA.i, RB, RC); PC += 3; break;
+			case BC_MAP_DEL_IR: map_delete(RA.i, RB); PC += 2; break;
+			case BC_MAP_NEXT_RIR: { int cursor = RC.i; RA = map_next(RB.i, &cursor); RC = INT_RESULT(cursor); PC += 3; } break;
+
+			// The code has been verified, so there's nothing else
+			default: __builtin_unreachable();
 		}
 		
 #if DEBUG_REGISTERS
 		int i;
-		for (i = 0; i < REGISTER_SIZE + 2; i++)
+		for (i = 0; i < REGISTER_TOTAL; i++)
 		{
 			printf("	=> R%i = ", i);
 			print_register(registers[i]);
 		}
 		printf("	=> mem 0 = ");
-		print_register(memory[0]);
+		print_register(LOAD(0));
 #endif
 
 	}
+
+	// Whatever runs next finds the stack in memory
+	FLUSH();
+}
+
+// Runs without profiling, which only the main thread does
+static void run_unprofiled()
+{
+	if (is_unbounded)
+		run(0, budget_limit > 0, 1);
+	else if (budget_limit > 0)
+		run(0, 1, 0);
+	else
+		run(0, 0, 0);
+}
+
+static void run_main()
+{
+	if (profile_counts == NULL)
+		run_unprofiled();
+	else
+		run(1, budget_limit > 0, is_unbounded);
+}
+
+static Register reduce(int how, Register a, Register b)
+{
+	if (a.type != CONST_INT)
+		return b;
+	if (b.type != CONST_INT)
+		return a;
+
+	switch (how)
+	{
+		case REDUCE_SUM: a.i += b.i; break;
+		case REDUCE_MIN: if (b.i < a.i) a = b; break;
+		case REDUCE_MAX: if (b.i > a.i) a = b; break;
+	}
+	return a;
+}
+
+// Calls the routine at 'entry' for each index from 'first' up to 
+// 'last', with the stack starting at 'base', and reduces the results
+static Register run_range(int entry, int first, int last, int base, int how)
+{
+	Register result = { CONST_NULL };
+	int i, saved_exit_frame = exit_frame, saved_frame_count = frame_count, saved_fp = FP;
+
+	// Loops nested deeper than calls can go don't run, nor ones with
+	// their stack outside memory
+	if (frame_count == FRAME_MAX || (is_unbounded && (base < 0 || base >= memory_total)))
+	{
+		stop_state = VM_ABORTED;
+		return result;
+	}
+
+	for (i = first; i < last && !stop_state; i++)
+	{
+		// The index is passed like an argument, then the routine 
+		// runs until it returns to here
+		SP = base;
+		memory[SP++] = (Register) { CONST_INT, .i = i };
+		exit_frame = frame_count;
+		frames[frame_count++] = (struct Frame) { -1, saved_fp };
+		FP = SP;
+		PC = entry;
+		run_unprofiled();
+
+		if (how != REDUCE_NONE)
+			result = reduce(how, result, R(0));
+	}
+
+	exit_frame = saved_exit_frame;
+	frame_count = saved_frame_count;
+	return result;
+}
+
+static void run_chunks(int worker, void *data)
+{
+	struct ParallelFor *loop = data;
+	Register result = { CONST_NULL };
+
+	// Each worker's stack comes after the verified memory
+	int base = loop->memory_size * (worker + 1);
+	memory = loop->memory;
+	memory_size = loop->memory_size;
+	memory_total = loop->memory_total;
+	is_unbounded = loop->is_unbounded;
+	memset(registers, 0, sizeof(registers));
+	registers[PC_LOC].type = CONST_INT;
+	registers[SP_LOC].type = CONST_INT;
+	registers[FP_LOC].type = CONST_INT;
+	is_worker = 1;
+	frame_count = 0;
+	budget = budget_limit;
+	stop_state = VM_HALTED;
+
+	while (!__atomic_load_n(&loop->is_aborted, __ATOMIC_RELAXED))
+	{
+		int first = __atomic_fetch_add(&loop->next, loop->chunk, __ATOMIC_RELAXED);
+		if (first >= loop->end)
+			break;
+
+		int last = loop->end - first > loop->chunk ? first + loop->chunk : loop->end;
+		result = reduce(loop->reduce, result, 
+			run_range(loop->entry, first, last, base, loop->reduce));
+
+		// Stop the other threads too
+		if (stop_state)
+			__atomic_store_n(&loop->is_aborted, 1, __ATOMIC_RELAXED);
+	}
+
+	loop->results[worker] = result;
+}
+
+static void parallel_for(int entry, int start, int end, int how)
+{
+	Register saved[REGISTER_TOTAL];
+	Register result = { CONST_NULL };
+	char saved_flags = flags;
+	int saved_is_suspendable = is_suspendable;
+	int i, thread_count = is_worker ? 1 : pool_size();
+
+	// A loop can't be suspended part way, so only yields
+	memcpy(saved, registers, sizeof(registers));
+	is_suspendable = 0;
+	if (thread_count < 2 || end - start < 2)
+	{
+		// Loops inside a worker run on its thread, above its stack
+		result = run_range(entry, start, end, SP, how);
+	}
+	else
+	{
+		int size = memory_size * (thread_count + 1);
+		if (size > memory_total)
+		{
+			memory = realloc(memory, sizeof(Register) * size);
+			memory_total = size;
+		}
+
+		struct ParallelFor loop = { entry, end, 0, how, start };
+		loop.memory = memory;
+		loop.memory_size = memory_size;
+		loop.memory_total = memory_total;
+		loop.is_unbounded = is_unbounded;
+		loop.chunk = (end - start) / (thread_count * CHUNKS_PER_THREAD);
+		if (loop.chunk < 1)
+			loop.chunk = 1;
+
+		loop.results = malloc(sizeof(Register) * thread_count);
+		if (pool_run(run_chunks, &loop))
+		{
+			for (i = 0; i < thread_count; i++)
+				result = reduce(how, result, loop.results[i]);
+			if (loop.is_aborted)
+				stop_state = VM_ABORTED;
+		}
+		else
+		{
+			// Another VM's loop has the pool, and may be waiting on 
+			// this one, so it runs here instead
+			result = run_range(entry, start, end, SP, how);
+		}
+		free(loop.results);
+	}
+
+	memcpy(registers, saved, sizeof(registers));
+	flags = saved_flags;
+	is_suspendable = saved_is_suspendable;
+
+	// Nothing to sum is 0
+	if (how == REDUCE_SUM && result.type != CONST_INT)
+		result = (Register) { CONST_INT, .i = 0 };
+	if (how != REDUCE_NONE)
+		R(0) = result;
+}
+
+void vm_reset()
+{
+	memset(registers, 0, sizeof(registers));
+	frame_count = 0;
+	memset(memory, 0, sizeof(Register) * memory_total);
+	flags = 0;
+}
+
+void vm_budget(int limit, int action, int (*callback)(void *data), void *data)
+{
+	budget_limit = limit;
+	budget_action = action;
+	budget_callback = callback;
+	budget_data = data;
+}
+
+int vm_run(int offset)
+{
+	// Never run code that hasn't been checked
+	if (!vm_verify(offset))
+		return VM_ABORTED;
+
+	// Run code starting at offset
+	registers[PC_LOC].type = CONST_INT;
+	registers[SP_LOC].type = CONST_INT;
+	registers[FP_LOC].type = CONST_INT;
+	PC = offset;
+	SP = 0;
+	FP = 0;
+	frame_count = 0;
+
+	stop_state = VM_SUSPENDED;
+	return vm_resume();
+}
+
+int vm_resume()
+{
+	if (stop_state != VM_SUSPENDED)
+		return stop_state;
+
+	budget = budget_limit;
+	stop_state = VM_HALTED;
+	is_suspendable = 1;
+	run_main();
+	is_suspendable = 0;
+	return stop_state;
+}
+
+struct Spawn
+{
+	int entry, memory_size;
+	int is_unbounded;
+};
+
+static void *run_spawned(void *arg)
+{
+	struct Spawn spawn = *(struct Spawn*)arg;
+	free(arg);
+
+	// The memory has been verified to be enough already
+	memory = calloc(spawn.memory_size, sizeof(Register));
+	memory_size = spawn.memory_size;
+	memory_total = spawn.memory_size;
+	is_unbounded = spawn.is_unbounded;
+	memset(registers, 0, sizeof(registers));
+	registers[PC_LOC].type = CONST_INT;
+	registers[SP_LOC].type = CONST_INT;
+	registers[FP_LOC].type = CONST_INT;
+	PC = spawn.entry;
+	SP = 0;
+	frame_count = 0;
+	budget = budget_limit;
+
+	run_unprofiled();
+	free(memory);
+	return NULL;
+}
+
+int vm_spawn(int offset)
+{
+	int size;
+	if (!verifier_check(code, code_len, constant_count, offset, &size))
+		return 0;
+
+	struct Spawn *spawn = malloc(sizeof(struct Spawn));
+	spawn->is_unbounded = size == -1;
+	if (size == -1)
+		size = MEMORY_SIZE;
+	if (size < 1)
+		size = 1;
+
+	spawn->entry = offset;
+	spawn->memory_size = size;
+
+	spawned = realloc(spawned, sizeof(pthread_t) * (spawned_count + 1));
+	if (pthread_create(&spawned[spawned_count], NULL, run_spawned, spawn))
+	{
+		free(spawn);
+		return 0;
+	}
+
+	spawned_count++;
+	return 1;
+}
+
+void vm_join()
+{
+	int i;
+	for (i = 0; i < spawned_count; i++)
+		pthread_join(spawned[i], NULL);
+
+	free(spawned);
+	spawned = NULL;
+	spawned_count = 0;
 }
 
 void vm_close()
 {
-	free(code);
+	pool_close();
+	free(code_buffer);
 	free(memory);
+	free(constants);
+	constants = NULL;
+	constant_count = 0;
 }
 
@@ -1,6 +1,6 @@
 
 fac:
-	MOVE R1 [SP-2]
+	MOVE R1 [FP-1]
 	COMPARE R1 2
 	GOTO_IF_LESS_THAN fac_else
 		SUB R1 R1 1
@@ -8,7 +8,7 @@ fac:
 		CALL fib
 		POP R1
 
-		MOVE R1 [SP-2]
+		MOVE R1 [FP-1]
 		ADD R0 R0 R1
 		RETURN
 
@@ -17,7 +17,7 @@ fac:
 		RETURN
 
 fib:
-	MOVE R1 [SP-2]
+	MOVE R1 [FP-1]
 	COMPARE R1 2
 	GOTO_IF_LESS_THAN fib_else
 		SUB R1 R1 1
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Runs each program in tests/optimizer with and without -O2, and fails
+# if what they print differs. Everything up to the last 'Verified' line
+# is logged while building, so only what comes after it is compared
+cd "$(dirname "$0")/.." || exit 1
+
+output()
+{
+	./NEWBASIC $1 -m 16 -i tests/optimizer/input.txt "$2" 2>&1 |
+		awk '/^Verified/ { n = 0; next } { out[n++] = $0 } END { for (i = 0; i < n; i++) print out[i] }'
+}
+
+status=0
+for program in tests/optimizer/*.asm
+do
+	output "" "$program" > /tmp/newbasic_plain.txt
+	output -O2 "$program" > /tmp/newbasic_optimized.txt
+	if diff /tmp/newbasic_plain.txt /tmp/newbasic_optimized.txt > /dev/null
+	then
+		echo "ok      $program"
+	else
+		echo "FAILED  $program"
+		diff /tmp/newbasic_plain.txt /tmp/newbasic_optimized.txt
+		status=1
+	fi
+done
+
+rm -f /tmp/newbasic_plain.txt /tmp/newbasic_optimized.txt
+exit $status
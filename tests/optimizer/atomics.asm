@@ -0,0 +1,43 @@
+
+start:
+	MOVE R8 1073741824
+	MOVE R1 0
+	MOVE R2 1000
+	PARALLEL_FOR bump R1 R2
+	LOAD_ACQUIRE R0 [R8]
+	INTERUPT #0
+
+	PARALLEL_SUM square R1 R2
+	INTERUPT #0
+	PARALLEL_MAX square R1 R2
+	INTERUPT #0
+
+	MOVE R9 R8
+	ADD R9 R9 1
+	MOVE R0 5
+	STORE_RELEASE [R9] R0
+	MOVE R0 5
+	MOVE R3 9
+	CAS R0 [R9] R3
+	GOTO_IF_NOT_EQUAL failed
+	MOVE R0 6
+	XCHG R0 [R9]
+	INTERUPT #0
+	LOAD_ACQUIRE R0 [R9]
+	INTERUPT #0
+	HULT
+failed:
+	MOVE R0 "CAS failed"
+	INTERUPT #0
+	HULT
+
+bump:
+	MOVE R8 1073741824
+	MOVE R1 2
+	ATOMIC_ADD R0 [R8] R1
+	RETURN
+
+square:
+	MOVE R1 [FP-1]
+	MUL R0 R1 R1
+	RETURN
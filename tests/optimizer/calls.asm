@@ -0,0 +1,64 @@
+
+start:
+	PUSH 20
+	CALL fib
+	POP R1
+	INTERUPT #0
+
+	PUSH 3
+	PUSH 4
+	CALL area
+	POP R1
+	POP R1
+	INTERUPT #0
+
+	MOVE R1 10
+	CALL count_down
+	MOVE R0 R1
+	INTERUPT #0
+	HULT
+
+fib:
+	MOVE R1 [FP-1]
+	COMPARE R1 2
+	GOTO_IF_LESS_THAN fib_small
+		SUB R1 R1 1
+		PUSH R1
+		CALL fib
+		POP R1
+		PUSH R0
+
+		SUB R1 R1 1
+		PUSH R1
+		CALL fib
+		POP R1
+
+		POP R2
+		ADD R0 R0 R2
+		RETURN
+
+	fib_small:
+		MOVE R0 R1
+		RETURN
+
+area:
+	ENTER 2
+	MOVE R1 [FP-1]
+	MOVE [FP+0] R1
+	MOVE R1 [FP-2]
+	MOVE [FP+1] R1
+	MOVE R2 [FP+0]
+	MOVE R3 [FP+1]
+	MUL R0 R2 R3
+	MOVE R4 R0
+	ADD R0 R0 R4
+	LEAVE
+	RETURN
+
+count_down:
+	COMPARE R1 0
+	GOTO_IF_EQUAL count_done
+	SUB R1 R1 1
+	CALL count_down
+count_done:
+	RETURN
@@ -0,0 +1,56 @@
+
+start:
+	MOVE R0 "interrupts"
+	INTERUPT #0
+	MOVE R0 3
+	DIV R0 R0 2
+	INTERUPT #0
+
+	INTERUPT #11
+	INTERUPT #0
+	MOVE R6 R0
+
+	MOVE R2 0
+	MOVE R3 8
+	INTERUPT #14
+	MOVE R7 R0
+	MOVE R4 0
+	MOVE R5 0
+sum:
+	MOVE R1 [R4]
+	ADD R5 R5 R1
+	ADD R4 R4 1
+	COMPARE R4 R7
+	GOTO_IF_LESS_THAN sum
+	MOVE R0 R5
+	INTERUPT #0
+
+	INTERUPT #13
+	INTERUPT #0
+	INTERUPT #12
+	INTERUPT #0
+
+	MOVE R2 1
+	MOVE R3 10
+	INTERUPT #9
+	MOVE R8 R0
+	MOVE R1 0
+fill:
+	MUL R2 R1 R6
+	STORE_ELEMENT [R8] R1 R2
+	ADD R1 R1 1
+	COMPARE R1 10
+	GOTO_IF_LESS_THAN fill
+	MOVE R1 9
+	LOAD_ELEMENT R0 [R8] R1
+	INTERUPT #0
+	MOVE R1 10
+	LOAD_ELEMENT R0 [R8] R1
+	INTERUPT #0
+	MOVE R1 R8
+	INTERUPT #10
+
+	INTERUPT #11
+	MOVE R0 R3
+	INTERUPT #0
+	HULT
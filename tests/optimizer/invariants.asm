@@ -0,0 +1,57 @@
+
+start:
+	MOVE R1 0
+	MOVE R2 100
+	MOVE R5 0
+	MOVE R9 3
+
+loop:
+	MOVE R3 7
+	MUL R4 R3 R2
+	ADD R6 R4 1
+	ADD R5 R5 R6
+	MUL R7 R9 1
+	ADD R7 R7 0
+	MUL R8 R1 2
+	MOVE R10 R8
+	ADD R5 R5 R10
+	MUL R11 R4 0
+	ADD R5 R5 R11
+	ADD R1 R1 1
+	COMPARE R1 R2
+	GOTO_IF_LESS_THAN loop
+
+	MOVE R0 R5
+	INTERUPT #0
+	MOVE R0 R4
+	INTERUPT #0
+	MOVE R0 R7
+	INTERUPT #0
+
+	MOVE R1 0
+	MOVE R12 0
+outer:
+	MOVE R2 0
+	inner:
+		MOVE R13 5
+		ADD R14 R13 R1
+		ADD R12 R12 R14
+		ADD R2 R2 1
+		COMPARE R2 10
+		GOTO_IF_LESS_THAN inner
+	ADD R1 R1 1
+	COMPARE R1 10
+	GOTO_IF_LESS_THAN outer
+
+	MOVE R0 R12
+	INTERUPT #0
+
+	MOVE R1 4
+	COMPARE R1 4
+	GOTO_IF_EQUAL known
+	MOVE R0 "not taken"
+	INTERUPT #0
+known:
+	MOVE R0 "taken"
+	INTERUPT #0
+	HULT
@@ -0,0 +1,50 @@
+
+start:
+	MAP_NEW R5
+	MOVE R1 0
+fill:
+	MUL R2 R1 R1
+	MAP_SET [R5] R1 R2
+	ADD R1 R1 1
+	COMPARE R1 500
+	GOTO_IF_LESS_THAN fill
+
+	MAP_NEW R9
+	MOVE R3 "key"
+	MOVE R4 "value"
+	MAP_SET [R9] R3 R4
+	MAP_GET R0 [R9] R3
+	INTERUPT #0
+	MOVE R1 R9
+	INTERUPT #10
+
+	MOVE R1 0
+drop:
+	MAP_DEL [R5] R1
+	ADD R1 R1 3
+	COMPARE R1 500
+	GOTO_IF_LESS_THAN drop
+
+	MOVE R6 0
+	MOVE R8 0
+	MOVE R2 0
+walk:
+	MAP_NEXT R1 [R5] R2
+	COMPARE R2 0
+	GOTO_IF_LESS_THAN walked
+	ADD R8 R8 1
+	MAP_GET R4 [R5] R1
+	ADD R6 R6 R4
+	GOTO walk
+walked:
+	MOVE R0 R6
+	INTERUPT #0
+	MOVE R0 R8
+	INTERUPT #0
+
+	MOVE R1 R5
+	INTERUPT #10
+	MOVE R1 1
+	MAP_GET R0 [R5] R1
+	INTERUPT #0
+	HULT
@@ -0,0 +1,28 @@
+start:
+	PUSH 1
+	PUSH 2
+	MOVE R0 7
+	MOVE [SP] R0
+	MOVE R1 [SP]
+	MOVE R0 R1
+	INTERUPT #0
+
+	MOVE R0 9
+	MOVE [SP + 3] R0
+	MOVE R1 [SP + 3]
+	MOVE R0 R1
+	INTERUPT #0
+
+	CALL scratch
+	INTERUPT #0
+	POP R1
+	POP R1
+	HULT
+
+scratch:
+	MOVE [FP] 5
+	MOVE [FP + 4] 6
+	MOVE R1 [FP]
+	MOVE R2 [FP + 4]
+	ADD R0 R1 R2
+	RETURN